@@ -0,0 +1,81 @@
+// Counts heap allocations per extracted file. Steady state extraction should not allocate at all, the only
+// allocations are the fixed ones of an extraction (reader, context table, write buffers...).
+// usage: rostam-bench-alloc
+// Exits with 1 if extracting more files costs more allocations.
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <new>
+#include <print>
+#include <string_view>
+import rostam;
+import synthetic_ts;
+
+static std::atomic<std::uint64_t> allocations = 0;
+
+auto operator new(const std::size_t size) -> void*
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if(auto* memory = std::malloc(size == 0? 1 : size)) return memory;
+    throw std::bad_alloc();
+}
+
+auto operator new(const std::size_t size, const std::align_val_t alignment) -> void*
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    const auto align = static_cast<std::size_t>(alignment);
+    if(auto* memory = std::aligned_alloc(align, (size + align - 1) / align * align)) return memory;
+    throw std::bad_alloc();
+}
+
+auto operator delete(void* memory) noexcept -> void { std::free(memory); }
+auto operator delete(void* memory, std::size_t) noexcept -> void { std::free(memory); }
+auto operator delete(void* memory, std::align_val_t) noexcept -> void { std::free(memory); }
+auto operator delete(void* memory, std::size_t, std::align_val_t) noexcept -> void { std::free(memory); }
+
+// Allocations of a whole extraction of `files` files of `file_size` bytes
+auto count(const std::size_t files, const std::size_t file_size, const bool io_uring) -> std::uint64_t
+{
+    const auto temp = std::filesystem::temp_directory_path();
+    const auto input = temp / "rostam-bench-alloc.ts";
+    const auto output = temp / "rostam-bench-alloc-out";
+    auto synthetic = synthetic_options();
+    synthetic.payload_bytes = files * file_size;
+    synthetic.file_size = file_size;
+    synthetic.filler_per_data_packet = 1;
+    synthetic_ts(input, synthetic);
+    std::filesystem::remove_all(output);
+    std::filesystem::create_directories(output);
+
+    auto options = extraction_options();
+    options.io_uring = io_uring;
+    options.checkpoint_interval = 0; // a checkpoint every 256 MiB allocates, but not per file
+    options.keep_better_copies = false; // the file index has an entry for every name, these are all different
+    const auto before = allocations.load();
+    {
+        auto core = rostam(options);
+        core.extract(input, output);
+    }
+    const auto result = allocations.load() - before;
+    std::filesystem::remove_all(output);
+    std::filesystem::remove(input);
+    return result;
+}
+
+int main()
+{
+    auto failed = false;
+    const auto check = [&](const std::string_view label, const std::size_t file_size, const bool io_uring){
+        const auto few = count(100, file_size, io_uring);
+        const auto many = count(400, file_size, io_uring);
+        const auto per_file = (static_cast<double>(many) - static_cast<double>(few)) / 300;
+        std::println("{:<32} {} allocations for 100 files, {} for 400 files, {:.2f} per file", label, few, many, per_file);
+        failed |= many > few;
+    };
+    check("small files (batched)", 4 << 10, false);
+    check("files on disk", 512 << 10, false);
+    check("files on disk, io_uring", 512 << 10, true);
+    return failed? 1 : 0;
+}
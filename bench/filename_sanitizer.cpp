@@ -0,0 +1,88 @@
+// Compares sanitize_filename with the uni-algo pipeline it replaced, for output and for speed.
+// usage: rostam-bench-filename [iterations]
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <print>
+#include <random>
+#include <ranges>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "uni_algo/ranges_conv.h"
+import rostam_filename;
+
+// What rostam did before sanitize_filename
+auto reference_sanitize(const std::vector<std::uint8_t>& raw) -> std::string
+{
+    return raw
+    | una::views::utf8
+    | std::views::drop_while([](const auto c){return c == '.';})
+    | std::views::filter([](const auto c){const auto ascii_c = std::min<char32_t>(c,128);return not(isascii(ascii_c) and std::iscntrl(ascii_c))
+                                                                                                and c != 0xfffd
+                                                                                                and c != U'%';})
+    | std::views::transform ([windows_illigal=std::u32string_view(U":<>|*?\"\\/")](const auto c){return windows_illigal.contains(c)?U'-':c;})
+    | una::ranges::to_utf8<std::string>();
+}
+
+// Names like the ones on the carousel plus broken ones like the ones we get when filename_length is off
+auto make_corpus() -> std::vector<std::vector<std::uint8_t>>
+{
+    const auto pieces = std::to_array<std::string_view>({
+        "episode_", "01", ".mp4", "Rostam Media ", "پادکست", "قسمت ", "😀", ".", "%", ":", "/", "\x01", "\x7f",
+        "\xef\xbf\xbd", "\xe2\x82", "\xed\xa0\x80", "\xc0\xaf", "\xff", "\xca\xfe\xc0\xde\xf0\x0d"});
+    auto random = std::mt19937(6530);
+    auto corpus = std::vector<std::vector<std::uint8_t>>();
+    for(auto i = 0; i < 4096; ++i)
+    {
+        auto name = std::vector<std::uint8_t>();
+        const auto count = std::uniform_int_distribution(1, 12)(random);
+        for(auto j = 0; j < count; ++j)
+        {
+            // Mostly plain ASCII names, that's what the carousel sends
+            const auto piece = i % 4 == 0? pieces[random() % pieces.size()] : pieces[random() % 4];
+            name.insert(name.end(), piece.begin(), piece.end());
+        }
+        if(name.size() >= MAX_FILENAME_LENGTH) name.resize(MAX_FILENAME_LENGTH - 1);
+        corpus.push_back(std::move(name));
+    }
+    return corpus;
+}
+
+template <class F>
+auto measure(const std::string_view label, const int iterations, const std::size_t names, F&& f) -> void
+{
+    const auto start = std::chrono::steady_clock::now();
+    auto checksum = 0uz;
+    for(auto i = 0; i < iterations; ++i) checksum += f();
+    const auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    std::println("{:<18} {:8.1f} ns/name (checksum {})", label, elapsed / (static_cast<double>(iterations) * names), checksum);
+}
+
+int main(int argc, char* argv[])
+{
+    const auto iterations = argc > 1? std::atoi(argv[1]) : 200;
+    const auto corpus = make_corpus();
+    auto out = std::array<char, MAX_FILENAME_LENGTH>();
+
+    for(const auto& name : corpus)
+    {
+        if(sanitize_filename(name, out) == reference_sanitize(name)) continue;
+        std::println("Output differs from the uni-algo pipeline for {}", std::string(name.begin(), name.end()));
+        return 1;
+    }
+    std::println("Same output as the uni-algo pipeline for all {} names.", corpus.size());
+
+    measure("uni-algo pipeline", iterations, corpus.size(), [&]{
+        auto total = 0uz;
+        for(const auto& name : corpus) total += reference_sanitize(name).size();
+        return total;
+    });
+    measure("sanitize_filename", iterations, corpus.size(), [&]{
+        auto total = 0uz;
+        for(const auto& name : corpus) total += sanitize_filename(name, out).size();
+        return total;
+    });
+}
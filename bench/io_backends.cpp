@@ -0,0 +1,64 @@
+// Compares the I/O backends of the core on the same recording: synchronous reads, reads on a prefetch thread and io_uring.
+// A run into a null_sink (prefetching reads, nothing written) shows what reading and demuxing alone cost.
+// usage: rostam-bench-io [recording.ts] [runs]
+// Without a recording a synthetic one (256 MiB of EQSat files in ~2.5 GiB of TS) is generated in the temp directory.
+// The recording is read from the page cache after the first run, drop the caches in between
+// (echo 3 > /proc/sys/vm/drop_caches) to measure the disk instead.
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <print>
+#include <string>
+import rostam;
+import rostam_uring;
+import synthetic_ts;
+
+auto run(const std::filesystem::path& input, const bool io_uring, const bool prefetch, const bool write = true) -> double
+{
+    const auto output = std::filesystem::temp_directory_path() / "rostam-bench-io-out";
+    std::filesystem::remove_all(output);
+    std::filesystem::create_directories(output);
+    auto options = extraction_options();
+    options.io_uring = io_uring;
+    options.reader.prefetch = prefetch;
+    if(not write) options.sink = std::make_shared<null_sink>();
+    auto core = rostam(options);
+    const auto start = std::chrono::steady_clock::now();
+    core.extract(input, output);
+    const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::filesystem::remove_all(output);
+    return elapsed;
+}
+
+int main(int argc, char* argv[])
+{
+    auto input = std::filesystem::path();
+    if(argc > 1) input = argv[1];
+    else
+    {
+        input = std::filesystem::temp_directory_path() / "rostam-bench-io.ts";
+        if(not std::filesystem::exists(input))
+        {
+            std::println("Generating {}", input.string());
+            synthetic_ts(input, {});
+        }
+    }
+    const auto runs = argc > 2? std::atoi(argv[2]) : 3;
+    const auto mb = std::filesystem::file_size(input) / 1e6;
+    const auto have_uring = uring_queue::create() != nullptr;
+    if(not have_uring) std::println("io_uring is not available (not compiled in or refused by the kernel), only the portable backends are measured.");
+
+    for(auto i = 0; i < runs; ++i)
+    {
+        const auto synchronous = run(input, false, false);
+        std::println("run {}: synchronous {:.2f}s ({:.0f} MB/s)", i + 1, synchronous, mb / synchronous);
+        const auto prefetch = run(input, false, true);
+        std::println("run {}: prefetch {:.2f}s ({:.0f} MB/s)", i + 1, prefetch, mb / prefetch);
+        const auto demux = run(input, false, true, false);
+        std::println("run {}: prefetch, null sink {:.2f}s ({:.0f} MB/s)", i + 1, demux, mb / demux);
+        if(not have_uring) continue;
+        const auto uring = run(input, true, false);
+        std::println("run {}: io_uring {:.2f}s ({:.0f} MB/s)", i + 1, uring, mb / uring);
+    }
+}
@@ -0,0 +1,177 @@
+// Compares the per-packet header parsing the core used to do with filter_packets and the PID kind dispatch that
+// replaced it, on a recording held in memory. A run into a null_sink shows the whole extraction for reference.
+// usage: rostam-bench-dispatch [recording.ts] [iterations]
+// Without a recording a synthetic one (32 MiB of EQSat files in ~320 MB of TS) is generated in the temp directory.
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <print>
+#include <span>
+#include <string_view>
+#include <vector>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+import rostam;
+import rostam_packet;
+import synthetic_ts;
+
+constexpr auto EQSAT_PID = 6530;
+
+// What rostam did before filter_packets: every packet went through this and an optional of it
+struct reference_header {
+    bool syncByte = true;
+    bool PUSI = false;
+    int PID = 0;
+    int CC = 0;
+    bool hasPayload = false;
+    std::span<const std::uint8_t> payload;
+};
+
+auto reference_parse(const std::span<const std::uint8_t> packet, const pid_table& kinds) -> std::optional<reference_header>
+{
+    auto header = reference_header();
+    if(packet[0] != 0x47)
+    {
+        header.syncByte = false;
+        return header;
+    }
+    header.PUSI = packet[1] & 0b01000000;
+    header.PID = ((0b00011111 & packet[1]) << 8) | packet[2];
+    if(kinds[header.PID] == pid_kind::IGNORED) return std::nullopt;
+    header.CC = packet[3] & 0b00001111;
+    const auto adaptation = (packet[3] & 0b00110000) >> 4;
+    auto offset = 0;
+    if(adaptation == 1) offset = 4;
+    else if(adaptation == 3) offset = 5 + packet[4];
+    header.hasPayload = offset > 0;
+    if(header.hasPayload)
+    {
+        if(offset > static_cast<int>(TS_PACKET_SIZE)) return std::nullopt;
+        header.payload = packet.subspan(offset);
+    }
+    return header;
+}
+
+// Both sides add up what the parsers would get, so the work can't be optimized away and the results can be compared
+struct tally {
+    std::uint64_t packets = 0;
+    std::uint64_t payload = 0;
+    std::uint64_t starts = 0;
+    std::uint64_t continuity = 0;
+
+    auto operator==(const tally&) const -> bool = default;
+};
+
+auto reference_run(const std::span<const std::uint8_t> recording, const pid_table& kinds) -> tally
+{
+    auto result = tally();
+    for(auto offset = 0uz; offset + TS_PACKET_SIZE <= recording.size(); offset += TS_PACKET_SIZE)
+    {
+        const auto header = reference_parse(recording.subspan(offset, TS_PACKET_SIZE), kinds);
+        if(not header or not header->syncByte or not header->hasPayload) continue;
+        ++result.packets;
+        result.payload += header->payload.size();
+        result.starts += header->PUSI;
+        result.continuity += header->CC;
+    }
+    return result;
+}
+
+auto filtered_run(const std::span<const std::uint8_t> recording, const pid_table& kinds) -> tally
+{
+    constexpr auto RUN_PACKETS = 256uz;
+    auto descriptors = std::array<packet_descriptor, RUN_PACKETS>();
+    auto result = tally();
+    for(auto offset = 0uz; offset < recording.size(); offset += RUN_PACKETS * TS_PACKET_SIZE)
+    {
+        const auto run = recording.subspan(offset, std::min(recording.size() - offset, RUN_PACKETS * TS_PACKET_SIZE));
+        const auto filtered = filter_packets(run, 0, kinds, descriptors);
+        for(const auto& descriptor : std::span(descriptors).first(filtered.count))
+        {
+            switch(kinds[descriptor.pid])
+            {
+                case pid_kind::EQSAT:
+                case pid_kind::PSI:
+                    if(descriptor.payload_offset == 0) break;
+                    ++result.packets;
+                    result.payload += descriptor.payload(run).size();
+                    result.starts += descriptor.pusi();
+                    result.continuity += descriptor.continuity();
+                    break;
+                case pid_kind::IGNORED: break;
+            }
+        }
+    }
+    return result;
+}
+
+auto cycles() -> std::uint64_t
+{
+#if defined(__x86_64__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+template <class F>
+auto measure(const std::string_view label, const int iterations, const std::uint64_t packets, F&& f) -> tally
+{
+    auto result = tally();
+    const auto start = std::chrono::steady_clock::now();
+    const auto start_cycles = cycles();
+    for(auto i = 0; i < iterations; ++i) result = f();
+    const auto elapsed_cycles = static_cast<double>(cycles() - start_cycles);
+    const auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    const auto total = static_cast<double>(iterations) * static_cast<double>(packets);
+    std::println("{:<22} {:6.2f} ns/packet {:6.1f} cycles/packet (TSC)", label, elapsed / total, elapsed_cycles / total);
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    auto input = std::filesystem::path();
+    if(argc > 1) input = argv[1];
+    else
+    {
+        input = std::filesystem::temp_directory_path() / "rostam-bench-dispatch.ts";
+        if(not std::filesystem::exists(input))
+        {
+            std::println("Generating {}", input.string());
+            synthetic_ts(input, {.payload_bytes = 32ull << 20});
+        }
+    }
+    const auto iterations = argc > 2? std::atoi(argv[2]) : 5;
+
+    auto recording = std::vector<std::uint8_t>(std::filesystem::file_size(input));
+    std::ifstream(input, std::ios::binary).read(reinterpret_cast<char*>(recording.data()), static_cast<std::streamsize>(recording.size()));
+    recording.resize(recording.size() - recording.size() % TS_PACKET_SIZE);
+    const auto packets = recording.size() / TS_PACKET_SIZE;
+    auto kinds = pid_table();
+    kinds[EQSAT_PID] = pid_kind::EQSAT;
+    std::println("{} packets in memory, PID {} is demuxed.", packets, EQSAT_PID);
+
+    const auto reference = measure("per-packet header", iterations, packets, [&]{ return reference_run(recording, kinds); });
+    const auto filtered = measure("filter and dispatch", iterations, packets, [&]{ return filtered_run(recording, kinds); });
+    if(reference != filtered)
+    {
+        std::println("filter_packets disagrees with the per-packet parse ({} vs {} packets)", filtered.packets, reference.packets);
+        return 1;
+    }
+    std::println("Both found {} packets with {} bytes of payload.", reference.packets, reference.payload);
+
+    // The whole extraction, from the page cache since the recording was just read
+    auto options = extraction_options();
+    options.sink = std::make_shared<null_sink>();
+    measure("extraction, null sink", 1, packets, [&]{
+        auto core = rostam(options);
+        core.extract(input, std::filesystem::temp_directory_path());
+        return tally();
+    });
+}
@@ -0,0 +1,141 @@
+module;
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <random>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+export module synthetic_ts;
+
+// Writes a recording that looks like what we capture from the satellite: EQSat files inside AC-3 PES
+// packets on PID 6530, drowned in packets of another PID that stand in for the video.
+export struct synthetic_options {
+    std::uint64_t payload_bytes = 256ull << 20; // EQSat file bytes in total
+    std::size_t file_size = 4 << 20; // every file is this big except the last one
+    std::size_t filler_per_data_packet = 9; // ~90% of a real recording is video/audio we throw away
+    std::uint32_t seed = 6530;
+};
+
+export class synthetic_ts
+{
+    public:
+
+    synthetic_ts(const std::filesystem::path& path, const synthetic_options& options):
+    m_file(path, std::ios::binary),
+    m_options(options),
+    m_random(options.seed)
+    {
+        if(not m_file) throw std::runtime_error(std::format("Could not create {}", path.string()));
+        auto written = 0ull;
+        for(auto index = 0; written < options.payload_bytes; ++index)
+        {
+            const auto size = std::min<std::uint64_t>(options.file_size, options.payload_bytes - written);
+            write_eqsat_file(std::format("synthetic_{:05}.bin", index), size);
+            written += size;
+        }
+        flush_pes();
+    }
+
+    private:
+
+    auto write_eqsat_file(const std::string& name, const std::uint64_t size) -> void
+    {
+        constexpr auto magic = std::to_array<std::uint8_t>({0xCA, 0xFE, 0xC0, 0xDE, 0xF0, 0x0D, 0xCA, 0xFE, 0xC0, 0xDE, 0xF0, 0x0D});
+        append(magic);
+        append(std::to_array<std::uint8_t>({2, 0}));
+        append_u64(name.size());
+        append_u64(size);
+        append(std::span(reinterpret_cast<const std::uint8_t*>(name.data()), name.size()));
+        auto chunk = std::vector<std::uint8_t>(64 << 10);
+        for(auto left = size; left > 0;)
+        {
+            const auto n = std::min<std::uint64_t>(left, chunk.size());
+            std::ranges::generate_n(chunk.begin(), n, [this]{return static_cast<std::uint8_t>(m_random());});
+            append(std::span(chunk).first(n));
+            left -= n;
+        }
+    }
+
+    auto append_u64(std::uint64_t value) -> void
+    {
+        for(auto i = 0; i < 8; ++i, value >>= 8) m_pes.push_back(value & 0xFF);
+    }
+
+    auto append(const std::span<const std::uint8_t> bytes) -> void
+    {
+        for(auto rest = bytes; not rest.empty();)
+        {
+            const auto n = std::min(rest.size(), PES_DATA_SIZE - m_pes.size());
+            m_pes.insert(m_pes.end(), rest.begin(), rest.begin() + n);
+            rest = rest.subspan(n);
+            if(m_pes.size() == PES_DATA_SIZE) flush_pes();
+        }
+    }
+
+    // One PES is 8 TS packets: PES header, AC-3 sync header and EQSat data, like the real broadcast
+    auto flush_pes() -> void
+    {
+        if(m_pes.empty()) return;
+        constexpr auto pes_header = std::to_array<std::uint8_t>({0x00, 0x00, 0x01, 0xBD, 0x00, 0x00, 0x80, 0x80, 0x05, 0x21, 0x00, 0x01, 0x00, 0x01});
+        constexpr auto ac3_header = std::to_array<std::uint8_t>({0x0B, 0x77, 0x00, 0x00, 0x1C, 0x40, 0x00});
+        auto pes = std::vector<std::uint8_t>(pes_header.begin(), pes_header.end());
+        pes.insert(pes.end(), ac3_header.begin(), ac3_header.end());
+        pes.insert(pes.end(), m_pes.begin(), m_pes.end());
+        m_pes.clear();
+        for(auto offset = 0uz; offset < pes.size(); offset += 184)
+        {
+            write_packet(DATA_PID, std::span(pes).subspan(offset, std::min(184uz, pes.size() - offset)), offset == 0);
+            for(auto i = 0uz; i < m_options.filler_per_data_packet; ++i) write_filler();
+        }
+    }
+
+    auto write_filler() -> void
+    {
+        auto payload = std::array<std::uint8_t, 184>();
+        std::ranges::generate(payload, [this]{return static_cast<std::uint8_t>(m_random());});
+        write_packet(FILLER_PID, payload, false);
+    }
+
+    auto write_packet(const int pid, const std::span<const std::uint8_t> payload, const bool unit_start) -> void
+    {
+        auto packet = std::array<std::uint8_t, 188>();
+        auto& cc = pid == DATA_PID? m_data_cc : m_filler_cc;
+        packet[0] = 0x47;
+        packet[1] = (unit_start? 0x40 : 0x00) | (pid >> 8);
+        packet[2] = pid & 0xFF;
+        auto offset = 4uz;
+        if(payload.size() < 184)
+        {
+            // Pad with an adaptation field
+            const auto af_length = 183 - payload.size();
+            packet[3] = 0x30 | cc;
+            packet[4] = af_length;
+            if(af_length > 0)
+            {
+                packet[5] = 0x00;
+                std::ranges::fill(std::span(packet).subspan(6, af_length - 1), 0xFF);
+            }
+            offset = 5 + af_length;
+        }
+        else packet[3] = 0x10 | cc;
+        cc = (cc + 1) & 0x0F;
+        std::ranges::copy(payload, packet.begin() + offset);
+        m_file.write(reinterpret_cast<const char*>(packet.data()), packet.size());
+    }
+
+    constexpr static auto DATA_PID = 6530;
+    constexpr static auto FILLER_PID = 0x100;
+    constexpr static auto PES_DATA_SIZE = 8uz * 184 - 14 - 7;
+    std::ofstream m_file;
+    synthetic_options m_options;
+    std::mt19937 m_random;
+    std::vector<std::uint8_t> m_pes;
+    int m_data_cc = 0;
+    int m_filler_cc = 0;
+};
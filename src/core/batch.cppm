@@ -0,0 +1,178 @@
+module;
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <functional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+export module rostam_batch;
+import rostam_filename;
+import rostam_storage;
+import rostam_writer;
+import rostam_verify;
+import rostam_quality;
+import rostam_trace;
+
+// Carousels are full of tiny files (thumbnails, subtitles, metadata) and for those opening, closing and renaming
+// costs more than the data. Small files are collected in one memory arena when they are done and written out in
+// bursts. On unix a burst goes through the directory fd with openat/renameat so no path is resolved per file.
+export class small_file_batch
+{
+    public:
+
+    // on_skip(name, pid, reason) is told about a file the batch couldn't write
+    using skip_callback = std::function<void(std::string_view, int, std::string)>;
+
+    // Completed files go to `verifier` if there is one, `keeper` gives them their name otherwise. A `resilient` batch
+    // skips the files it can't write and reports each of them to `on_skip` instead of throwing.
+    small_file_batch(const storage::output_directory& directory, const std::size_t flush_bytes, copy_keeper& keeper, file_verifier* verifier = nullptr, const bool resilient = false, skip_callback on_skip = {}):
+    m_directory(directory),
+    m_flush_bytes(flush_bytes),
+    m_resilient(resilient),
+    m_keeper(keeper),
+    m_verifier(verifier),
+    m_on_skip(std::move(on_skip))
+    {
+    }
+
+    small_file_batch(const small_file_batch&) = delete;
+    auto operator=(const small_file_batch&) -> small_file_batch& = delete;
+
+    ~small_file_batch()
+    {
+        // Errors can't be reported from here. extract() flushes before it returns anyway.
+        try { flush(); } catch(...) {}
+    }
+
+    // Queues a file for the next burst. Incomplete files are written as <name>.part and never renamed, like the ones on disk.
+    // `losses` is how many packets it missed, `pid` is where it came from and is only passed on to on_skip.
+    auto add(std::string_view name, const std::span<const std::uint8_t> data, const bool complete, const std::uint64_t losses, const int pid = 0) -> void
+    {
+        // Both keep their capacity between bursts
+        if(m_arena.capacity() == 0) m_arena.reserve(m_flush_bytes);
+        if(m_files.capacity() == 0) m_files.reserve(MAX_FILES);
+        name = name.substr(0, MAX_FILENAME_LENGTH);
+        auto& file = m_files.emplace_back();
+        file.name_offset = m_arena.size();
+        file.name_size = name.size();
+        m_arena.insert(m_arena.end(), name.begin(), name.end());
+        file.data_offset = m_arena.size();
+        file.data_size = data.size();
+        m_arena.insert(m_arena.end(), data.begin(), data.end());
+        file.complete = complete;
+        file.losses = losses;
+        file.pid = pid;
+        if(m_arena.size() >= m_flush_bytes or m_files.size() >= MAX_FILES) flush();
+    }
+
+    auto flush() -> void
+    {
+        if(m_files.empty()) return;
+        const auto zone = trace_zone("small files");
+        const auto clear = [this]{ m_files.clear(); m_arena.clear(); };
+        try
+        {
+            // One free space check for the whole burst instead of one per file. Only when there isn't enough for all of
+            // them every file is checked on its own, the ones that still fit are written and the others skipped.
+            const auto space_for_all = storage::has_free_space(m_directory.path(), m_arena.size());
+            if(not space_for_all and not m_resilient)
+                throw std::runtime_error(std::format("[Rostam Core Error] Not enough free space in {} for {} small files ({} bytes).", m_directory.path().string(), m_files.size(), m_arena.size()));
+            for(const auto& file : m_files)
+            {
+                if(space_for_all or storage::has_free_space(m_directory.path(), file.data_size)) write_file(file);
+                else skip(file, std::format("Not enough free space in {} for {} ({} bytes).", m_directory.path().string(), name_of(file), file.data_size));
+            }
+        }
+        catch(...)
+        {
+            clear();
+            throw;
+        }
+        clear();
+    }
+
+    private:
+
+    struct pending_file {
+        std::size_t name_offset = 0;
+        std::size_t name_size = 0;
+        std::size_t data_offset = 0;
+        std::size_t data_size = 0;
+        bool complete = false;
+        std::uint64_t losses = 0;
+        int pid = 0;
+    };
+
+    constexpr static auto MAX_FILES = 1024uz; // so a burst of empty-ish files doesn't wait forever
+
+    auto name_of(const pending_file& file) const -> std::string_view
+    {
+        return std::string_view(reinterpret_cast<const char*>(m_arena.data()) + file.name_offset, file.name_size);
+    }
+
+    auto skip(const pending_file& file, std::string reason) -> void
+    {
+        if(m_on_skip) m_on_skip(name_of(file), file.pid, std::move(reason));
+    }
+
+    auto write_file(const pending_file& file) -> void
+    {
+        const auto name = name_of(file);
+        // NUL terminated names on the stack, sanitized names always fit
+        constexpr auto part_suffix = std::string_view(".part");
+        auto final_name = std::array<char, MAX_FILENAME_LENGTH + 1>();
+        auto part_name = std::array<char, MAX_FILENAME_LENGTH + part_suffix.size() + 1>();
+        std::ranges::copy(name, final_name.begin());
+        std::ranges::copy(part_suffix, std::ranges::copy(name, part_name.begin()).out);
+
+        if(not m_writer.open(m_directory, part_name.data()))
+        {
+            if(not m_resilient) throw std::runtime_error("[Rostam Core Error] Could not open the output file. The program might opened a file twice(logical) or it's a premission problem(runtime).");
+            skip(file, std::format("Could not open the output file {}.", part_name.data()));
+            return;
+        }
+        try
+        {
+            m_writer.write(std::span(m_arena).subspan(file.data_offset, file.data_size));
+            m_writer.close();
+        }
+        catch(const std::system_error& error)
+        {
+            // What made it to the disk stays as its .part, like a large file that failed to write
+            if(not m_resilient) throw;
+            try { m_writer.close(); } catch(const std::system_error&) {}
+            skip(file, std::format("Could not write {}: {}", part_name.data(), error.what()));
+            return;
+        }
+        if(not file.complete) return;
+        const auto quality = copy_quality{file.losses, false, content_hash::of(std::span(m_arena).subspan(file.data_offset, file.data_size))};
+        try
+        {
+            if(m_verifier) m_verifier->submit(name, quality, file.pid);
+            else m_keeper.complete(part_name.data(), final_name.data(), quality);
+        }
+        catch(const std::system_error& error)
+        {
+            // It stays as its .part
+            if(not m_resilient) throw;
+            skip(file, std::format("Could not give {} its name: {}", name, error.what()));
+        }
+    }
+
+    const storage::output_directory& m_directory;
+    std::size_t m_flush_bytes;
+    bool m_resilient;
+    copy_keeper& m_keeper;
+    file_verifier* m_verifier;
+    skip_callback m_on_skip;
+    file_writer m_writer;
+    std::vector<std::uint8_t> m_arena; // names and data of all queued files back to back
+    std::vector<pending_file> m_files;
+};
@@ -0,0 +1,69 @@
+module;
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+export module rostam_carousel;
+
+// Rostam Media sends the same files over and over. Once every file of the carousel came through without losses the
+// rest of the recording only has copies of them. The tracker notices when a file that is already there cleanly starts
+// again while nothing else is missing, the carousel has gone round once and nothing more can be gained.
+export class carousel_tracker
+{
+    public:
+
+    // A file started. Returns true if the carousel is complete: this is a file that was already received cleanly and
+    // so was every other file seen so far.
+    auto started(const std::string_view name, const std::uint64_t size) -> bool
+    {
+        auto found = m_files.find(name);
+        if(found == m_files.end())
+        {
+            m_files.emplace(name, file{size, false});
+            ++m_missing;
+            return false;
+        }
+        // Same name, different size: the broadcaster updated the file, the new one is still missing
+        if(found->second.size != size)
+        {
+            if(found->second.clean) ++m_missing;
+            found->second = {size, false};
+            return false;
+        }
+        return found->second.clean and m_missing == 0;
+    }
+
+    // A file was received completely, `losses` packets went missing while it was
+    auto completed(const std::string_view name, const std::uint64_t size, const std::uint64_t losses) -> void
+    {
+        const auto found = m_files.find(name);
+        if(found == m_files.end() or found->second.size != size or found->second.clean or losses > 0) return;
+        found->second.clean = true;
+        --m_missing;
+    }
+
+    auto clear() -> void
+    {
+        m_files.clear();
+        m_missing = 0;
+    }
+
+    private:
+
+    struct file {
+        std::uint64_t size = 0;
+        bool clean = false;
+    };
+    struct name_hash {
+        using is_transparent = void;
+        auto operator()(const std::string_view name) const -> std::size_t
+        {
+            return std::hash<std::string_view>()(name);
+        }
+    };
+
+    std::unordered_map<std::string, file, name_hash, std::equal_to<>> m_files;
+    std::size_t m_missing = 0; // Files seen that didn't come through cleanly yet
+};
@@ -0,0 +1,303 @@
+module;
+#include <algorithm>
+#include <concepts>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+export module rostam_checkpoint;
+import rostam_pes;
+import rostam_filename;
+import rostam_quality;
+
+// Where an extraction was when it stopped, so a cancelled or crashed run continues from there instead of scanning a
+// recording of several hours from byte 0. It's a small sidecar file in the output directory that is replaced
+// every now and then while extracting. Integers are stored as 8 bytes little endian and bools as one byte whatever the
+// machine uses, so it doesn't matter where it's read back. Anything unexpected in it and it's ignored.
+export struct checkpoint {
+    struct stream {
+        int pid = 0;
+        std::size_t magic_index = 0; // How much of the magic bytes the last payload ended with
+        int active = -1;
+        int continuity = -1;
+        int transport_errors = 0;
+        pes_reassembler::snapshot pes;
+    };
+    struct file {
+        int pid = 0;
+        std::uint8_t state = 0;
+        std::array<std::uint8_t, 18> header {}; // The EQSat header without the magic bytes
+        std::size_t header_read = 0;
+        std::array<std::uint8_t, MAX_FILENAME_LENGTH> raw_filename {};
+        std::size_t filename_read = 0;
+        std::uint64_t data_read = 0; // Also how long the .part file is
+        bool in_memory = false;
+        int interrupted = -1;
+        std::size_t magic_written = 0; // How many of the magic bytes went to `interrupted` as data
+        std::uint64_t losses = 0;
+        content_hash::snapshot hash; // Of what the .part file has
+        std::vector<std::uint8_t> data; // What a small file received so far, empty otherwise
+    };
+
+    // The recording this is about. A different file (or the same one changed) starts from the beginning. One that is
+    // still being written only has to be at least `offset` long.
+    std::string input;
+    std::uint64_t input_size = 0;
+    std::int64_t input_time = 0;
+    std::uint64_t offset = 0; // Where to continue reading, the parser was done with everything before it
+    std::uint64_t archive_size = 0; // How much of the archive (extraction_options::archive) was written up to offset
+    std::vector<stream> streams;
+    std::vector<file> files;
+};
+
+constexpr auto CHECKPOINT_MAGIC = std::to_array<char>({'R','O','S','T','A','M','C','P'});
+constexpr auto CHECKPOINT_VERSION = std::uint32_t(7);
+
+export auto checkpoint_path(const std::filesystem::path& output) -> std::filesystem::path
+{
+    return output / ".rostam-checkpoint";
+}
+
+// Identifies the recording well enough to notice it was replaced
+export auto describe_input(const std::filesystem::path& input, checkpoint& into) -> void
+{
+    into.input = std::filesystem::absolute(input).string();
+    into.input_size = std::filesystem::file_size(input);
+    into.input_time = std::filesystem::last_write_time(input).time_since_epoch().count();
+}
+
+// An array of bytes is stored as it is
+template <class T>
+concept byte_array = std::same_as<T, std::array<typename T::value_type, std::tuple_size_v<T>>> and sizeof(typename T::value_type) == 1;
+
+class byte_writer
+{
+    public:
+
+    template <std::integral T>
+    auto put(const T value) -> void
+    {
+        if constexpr(std::same_as<T, bool>) m_bytes.push_back(value? 1 : 0);
+        else
+        {
+            // Signed values go as their two's complement
+            auto wide = static_cast<std::uint64_t>(value);
+            for(auto i = 0; i < 8; ++i, wide >>= 8) m_bytes.push_back(static_cast<char>(wide & 0xFF));
+        }
+    }
+
+    template <byte_array T>
+    auto put(const T& bytes) -> void
+    {
+        std::ranges::transform(bytes, std::back_inserter(m_bytes), [](const auto b){ return static_cast<char>(b); });
+    }
+
+    auto put_bytes(const std::span<const char> bytes) -> void
+    {
+        put(static_cast<std::uint64_t>(bytes.size()));
+        m_bytes.insert(m_bytes.end(), bytes.begin(), bytes.end());
+    }
+
+    auto bytes() const -> const std::vector<char>&
+    {
+        return m_bytes;
+    }
+
+    private:
+
+    std::vector<char> m_bytes;
+};
+
+class byte_reader
+{
+    public:
+
+    explicit byte_reader(const std::span<const char> bytes):
+    m_bytes(bytes)
+    {
+    }
+
+    // False at the end of the input, for a bool that isn't 0 or 1 and for a number that doesn't fit `value`
+    template <std::integral T>
+    auto get(T& value) -> bool
+    {
+        if constexpr(std::same_as<T, bool>)
+        {
+            if(m_bytes.empty() or static_cast<std::uint8_t>(m_bytes[0]) > 1) return false;
+            value = m_bytes[0] == 1;
+            m_bytes = m_bytes.subspan(1);
+            return true;
+        }
+        else
+        {
+            if(m_bytes.size() < 8) return false;
+            auto wide = std::uint64_t();
+            for(auto i = 0; i < 8; ++i) wide |= static_cast<std::uint64_t>(static_cast<std::uint8_t>(m_bytes[i])) << (8 * i);
+            m_bytes = m_bytes.subspan(8);
+            if constexpr(std::is_signed_v<T>)
+            {
+                const auto signed_wide = static_cast<std::int64_t>(wide);
+                if(not std::in_range<T>(signed_wide)) return false;
+                value = static_cast<T>(signed_wide);
+            }
+            else
+            {
+                if(not std::in_range<T>(wide)) return false;
+                value = static_cast<T>(wide);
+            }
+            return true;
+        }
+    }
+
+    template <byte_array T>
+    auto get(T& bytes) -> bool
+    {
+        if(m_bytes.size() < bytes.size()) return false;
+        std::ranges::transform(m_bytes.first(bytes.size()), bytes.begin(), [](const char b){ return static_cast<typename T::value_type>(b); });
+        m_bytes = m_bytes.subspan(bytes.size());
+        return true;
+    }
+
+    // `limit` keeps a broken size from allocating the world
+    template <class C>
+    auto get_bytes(C& into, const std::uint64_t limit) -> bool
+    {
+        auto size = std::uint64_t();
+        if(not get(size) or size > limit or size > m_bytes.size()) return false;
+        into.assign(m_bytes.begin(), m_bytes.begin() + size);
+        m_bytes = m_bytes.subspan(size);
+        return true;
+    }
+
+    auto done() const -> bool
+    {
+        return m_bytes.empty();
+    }
+
+    private:
+
+    std::span<const char> m_bytes;
+};
+
+auto put_pes(byte_writer& out, const pes_reassembler::snapshot& pes) -> void
+{
+    out.put(pes.state);
+    out.put(pes.header);
+    out.put(pes.collected);
+    out.put(pes.skip);
+    out.put(pes.pes_remaining);
+    out.put(pes.frame_remaining);
+    out.put(pes.frame_code);
+}
+
+auto get_pes(byte_reader& in, pes_reassembler::snapshot& pes) -> bool
+{
+    return in.get(pes.state) and in.get(pes.header) and in.get(pes.collected) and in.get(pes.skip) and in.get(pes.pes_remaining)
+       and in.get(pes.frame_remaining) and in.get(pes.frame_code) and pes_reassembler::is_valid(pes);
+}
+
+// Writes a temporary file next to the checkpoint and renames it over the old one, so there is always a whole
+// checkpoint on disk even if we die in the middle of this.
+export auto save_checkpoint(const std::filesystem::path& path, const checkpoint& state) -> void
+{
+    auto out = byte_writer();
+    out.put(CHECKPOINT_MAGIC);
+    out.put(CHECKPOINT_VERSION);
+    out.put_bytes(state.input);
+    out.put(state.input_size);
+    out.put(state.input_time);
+    out.put(state.offset);
+    out.put(state.archive_size);
+    out.put(static_cast<std::uint64_t>(state.streams.size()));
+    for(const auto& stream : state.streams)
+    {
+        out.put(stream.pid);
+        out.put(stream.magic_index);
+        out.put(stream.active);
+        out.put(stream.continuity);
+        out.put(stream.transport_errors);
+        put_pes(out, stream.pes);
+    }
+    out.put(static_cast<std::uint64_t>(state.files.size()));
+    for(const auto& file : state.files)
+    {
+        out.put(file.pid);
+        out.put(file.state);
+        out.put(file.header);
+        out.put(file.header_read);
+        out.put(file.raw_filename);
+        out.put(file.filename_read);
+        out.put(file.data_read);
+        out.put(file.in_memory);
+        out.put(file.interrupted);
+        out.put(file.magic_written);
+        out.put(file.losses);
+        out.put(file.hash.state);
+        out.put(file.hash.pending);
+        out.put(file.hash.size);
+        out.put_bytes(std::span(reinterpret_cast<const char*>(file.data.data()), file.data.size()));
+    }
+
+    auto temporary = path;
+    temporary += ".tmp";
+    {
+        auto file = std::ofstream(temporary, std::ios::binary | std::ios::trunc);
+        file.write(out.bytes().data(), out.bytes().size());
+        if(not file.flush()) throw std::runtime_error("[Rostam Core Error] Could not write the checkpoint file.");
+    }
+    std::filesystem::rename(temporary, path);
+}
+
+export auto load_checkpoint(const std::filesystem::path& path) -> std::optional<checkpoint>
+{
+    auto error = std::error_code();
+    if(not std::filesystem::is_regular_file(path, error)) return std::nullopt;
+    auto file = std::ifstream(path, std::ios::binary);
+    const auto bytes = std::vector<char>(std::istreambuf_iterator<char>(file), {});
+    auto in = byte_reader(bytes);
+
+    constexpr static auto MAX_COUNT = 1uz << 16; // way more PIDs and files than a recording has at once
+    auto magic = decltype(CHECKPOINT_MAGIC)();
+    auto version = std::uint32_t();
+    if(not in.get(magic) or magic != CHECKPOINT_MAGIC or not in.get(version) or version != CHECKPOINT_VERSION) return std::nullopt;
+    auto state = checkpoint();
+    auto count = std::uint64_t();
+    if(not in.get_bytes(state.input, 1 << 16) or not in.get(state.input_size) or not in.get(state.input_time) or not in.get(state.offset) or not in.get(state.archive_size)) return std::nullopt;
+    if(not in.get(count) or count > MAX_COUNT) return std::nullopt;
+    state.streams.resize(count);
+    for(auto& stream : state.streams)
+        if(not in.get(stream.pid) or not in.get(stream.magic_index) or not in.get(stream.active) or not in.get(stream.continuity) or not in.get(stream.transport_errors) or not get_pes(in, stream.pes)) return std::nullopt;
+    if(not in.get(count) or count > MAX_COUNT) return std::nullopt;
+    state.files.resize(count);
+    for(auto& file : state.files)
+    {
+        if(not in.get(file.pid) or not in.get(file.state) or not in.get(file.header) or not in.get(file.header_read)
+           or not in.get(file.raw_filename) or not in.get(file.filename_read) or not in.get(file.data_read)
+           or not in.get(file.in_memory) or not in.get(file.interrupted) or not in.get(file.magic_written) or not in.get(file.losses)
+           or not in.get(file.hash.state) or not in.get(file.hash.pending) or not in.get(file.hash.size) or not in.get_bytes(file.data, file.data_read)) return std::nullopt;
+        // Indices and sizes are used as they are, make sure they are in range. There are four rostam::STATEs.
+        if(file.state > 3 or file.header_read > file.header.size() or file.filename_read > file.raw_filename.size()) return std::nullopt;
+        if(file.interrupted >= static_cast<int>(count) or file.magic_written >= 12) return std::nullopt;
+    }
+    // 12 magic bytes, a partial match is shorter
+    for(const auto& stream : state.streams)
+        if(stream.active >= static_cast<int>(count) or stream.magic_index >= 12 or stream.continuity < -1 or stream.continuity > 0x0F or stream.transport_errors < 0) return std::nullopt;
+    if(not in.done()) return std::nullopt;
+    return state;
+}
+
+export auto remove_checkpoint(const std::filesystem::path& path) -> void
+{
+    auto error = std::error_code();
+    std::filesystem::remove(path, error);
+}
@@ -0,0 +1,89 @@
+module;
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <utility>
+export module rostam_filename;
+
+// EQSat headers with longer names are rejected as implausible, so a sanitized name always fits.
+export constexpr auto MAX_FILENAME_LENGTH = 255uz;
+
+// What every ASCII byte turns into, 0 means it's dropped. Control characters and '%' are dropped,
+// characters Windows doesn't allow in filenames become '-'.
+constexpr auto ASCII_MAP = []{
+    auto map = std::array<char, 128>();
+    for(auto c = 0x20; c < 0x7F; ++c) map[c] = static_cast<char>(c);
+    map['%'] = 0;
+    for(const auto c : std::string_view(":<>|*?\"\\/")) map[c] = '-';
+    return map;
+}();
+
+// Length of the UTF-8 sequence at the start of `bytes` and whether it's well formed. Ill-formed ones are as long as
+// their maximal subpart (Unicode 3.9 "U+FFFD Substitution of Maximal Subparts"), which is also how uni-algo decodes.
+auto utf8_sequence(const std::span<const std::uint8_t> bytes) -> std::pair<std::size_t, bool>
+{
+    const auto lead = bytes[0];
+    auto length = 0uz;
+    auto low = 0x80; // Allowed range of the second byte. Excludes overlong forms, surrogates and > U+10FFFF.
+    auto high = 0xBF;
+    if(lead >= 0xC2 and lead <= 0xDF) length = 2;
+    else if(lead >= 0xE0 and lead <= 0xEF)
+    {
+        length = 3;
+        if(lead == 0xE0) low = 0xA0;
+        if(lead == 0xED) high = 0x9F;
+    }
+    else if(lead >= 0xF0 and lead <= 0xF4)
+    {
+        length = 4;
+        if(lead == 0xF0) low = 0x90;
+        if(lead == 0xF4) high = 0x8F;
+    }
+    else return {1, false};
+
+    for(auto i = 1uz; i < length; ++i)
+    {
+        if(i >= bytes.size()) return {i, false};
+        const auto byte = bytes[i];
+        if(byte < (i == 1? low : 0x80) or byte > (i == 1? high : 0xBF)) return {i, false};
+    }
+    return {length, true};
+}
+
+// It seems like sometimes the EQHeader::filename_length returns wrong size thus the filenames can contain bytes
+// from the next(?) magic bytes. This drops leading dots, control characters, '%' and broken UTF-8 and replaces
+// characters that are illegal on Windows with '-'. Valid non-ASCII characters are kept as they are.
+// Single pass over the raw bytes into a fixed buffer, no allocations. Names longer than the buffer are cut short.
+export auto sanitize_filename(const std::span<const std::uint8_t> raw, std::array<char, MAX_FILENAME_LENGTH>& out) -> std::string_view
+{
+    auto size = 0uz;
+    auto offset = 0uz;
+    // Leading dots are dropped before anything else is filtered, so "\x01.name" keeps its dot.
+    while(offset < raw.size() and raw[offset] == '.') ++offset;
+
+    while(offset < raw.size())
+    {
+        // ASCII fast path
+        if(const auto byte = raw[offset]; byte < 0x80)
+        {
+            ++offset;
+            const auto c = ASCII_MAP[byte];
+            if(c == 0) continue;
+            if(size == out.size()) break;
+            out[size++] = c;
+            continue;
+        }
+        const auto [length, valid] = utf8_sequence(raw.subspan(offset));
+        const auto sequence = raw.subspan(offset, length);
+        offset += length;
+        // Broken sequences and U+FFFD in the name itself are dropped
+        if(not valid or std::ranges::equal(sequence, std::to_array<std::uint8_t>({0xEF, 0xBF, 0xBD}))) continue;
+        if(size + length > out.size()) break;
+        std::ranges::copy(sequence, out.begin() + size);
+        size += length;
+    }
+    return {out.data(), size};
+}
@@ -0,0 +1,261 @@
+module;
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#if __unix__
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+export module rostam_index;
+
+// Where the files of a recording are, without extracting them. The data of a file is scattered over the payloads
+// of thousands of TS packets. Extents say where in the recording the pieces are, one extent covers a run of pieces of
+// the same size the same distance apart (the payloads of a PID's packets that follow each other), so the index stays
+// small for large recordings. The few bytes that aren't in the recording as they are (a header the PES reassembler had to collect, magic bytes that turned out
+// to be file data) are kept in the index itself.
+export class recording_index
+{
+    public:
+
+    struct extent {
+        std::uint64_t file_offset = 0;
+        std::uint64_t source = 0; // Offset of the first piece in the recording, or in `inline_data` if it's not in_recording
+        std::uint32_t size = 0; // Of every piece
+        std::uint32_t count = 1; // Pieces, `stride` bytes apart in the recording. Always 1 for inline data.
+        std::uint32_t stride = 0;
+        bool in_recording = true;
+
+        // Bytes of the file it covers
+        auto length() const -> std::uint64_t
+        {
+            return std::uint64_t(size) * count;
+        }
+    };
+    struct file {
+        std::string name;
+        std::uint64_t size = 0;
+        std::uint64_t losses = 0; // Packets that went missing on the PID while it was received
+        std::vector<extent> extents; // Sorted by file_offset, back to back
+        std::vector<std::uint8_t> inline_data;
+
+        // The next `size` bytes of the file are at `offset` in the recording
+        auto append_recording(const std::uint64_t offset, const std::uint32_t size) -> void
+        {
+            if(size == 0) return;
+            if(not extents.empty() and extents.back().in_recording)
+            {
+                auto& last = extents.back();
+                // Right behind a single piece, it grows
+                if(last.count == 1 and last.source + last.size == offset)
+                {
+                    last.size += size;
+                    return;
+                }
+                // The second piece of a run sets the stride, the ones after it have to keep to it
+                if(last.size == size and offset >= last.source + last.size)
+                {
+                    if(last.count == 1 and offset - last.source <= std::numeric_limits<std::uint32_t>::max())
+                    {
+                        last.stride = static_cast<std::uint32_t>(offset - last.source);
+                        last.count = 2;
+                        return;
+                    }
+                    if(last.count > 1 and last.count < std::numeric_limits<std::uint32_t>::max() and offset == last.source + std::uint64_t(last.stride) * last.count)
+                    {
+                        ++last.count;
+                        return;
+                    }
+                }
+            }
+            extents.push_back({received(), offset, size, 1, 0, true});
+        }
+
+        // The next bytes of the file, they aren't anywhere in the recording as they are
+        auto append_inline(const std::span<const std::uint8_t> data) -> void
+        {
+            if(data.empty()) return;
+            if(not extents.empty() and not extents.back().in_recording and extents.back().source + extents.back().size == inline_data.size())
+                extents.back().size += data.size();
+            else extents.push_back({received(), inline_data.size(), static_cast<std::uint32_t>(data.size()), 1, 0, false});
+            inline_data.insert(inline_data.end(), data.begin(), data.end());
+        }
+
+        // How much of the file the extents cover
+        auto received() const -> std::uint64_t
+        {
+            return extents.empty()? 0 : extents.back().file_offset + extents.back().length();
+        }
+
+        auto clear() -> void
+        {
+            name.clear();
+            size = 0;
+            losses = 0;
+            extents.clear();
+            inline_data.clear();
+        }
+    };
+
+    // Carousels send the same file again and again. The copy with fewer losses is kept, the later one when they are
+    // equally good, like copy_keeper does for extracted files.
+    auto add(file&& received) -> void
+    {
+        const auto existing = std::ranges::find(m_files, received.name, &file::name);
+        if(existing == m_files.end()) m_files.push_back(std::move(received));
+        else if(received.losses <= existing->losses) *existing = std::move(received);
+    }
+
+    auto files() const -> std::span<const file>
+    {
+        return m_files;
+    }
+
+    auto find(const std::string_view name) const -> const file*
+    {
+        const auto found = std::ranges::find(m_files, name, &file::name);
+        return found == m_files.end()? nullptr : &*found;
+    }
+
+    private:
+
+    std::vector<file> m_files;
+};
+
+// Reads the files of a recording_index from the recording. Reads of neighbouring pieces hit the same blocks of the
+// recording, a few of them are cached. Can be used from several threads.
+export class recording_reader
+{
+    public:
+
+    explicit recording_reader(const std::filesystem::path& recording)
+    {
+        #if __unix__
+        m_fd = ::open(recording.c_str(), O_RDONLY | O_CLOEXEC);
+        if(m_fd < 0) throw std::runtime_error("[Rostam Core Error] Could not open the recording.");
+        #else
+        m_stream.open(recording, std::ios::binary);
+        if(not m_stream) throw std::runtime_error("[Rostam Core Error] Could not open the recording.");
+        #endif
+    }
+
+    recording_reader(const recording_reader&) = delete;
+    auto operator=(const recording_reader&) -> recording_reader& = delete;
+
+    ~recording_reader()
+    {
+        #if __unix__
+        if(m_fd >= 0) ::close(m_fd);
+        #endif
+    }
+
+    // Copies the bytes of `file` at `offset` into `into`. Returns how many there were, less than asked at the end of the
+    // file or where the recording is shorter than the index says.
+    auto read(const recording_index::file& file, const std::uint64_t offset, std::span<std::uint8_t> into) -> std::size_t
+    {
+        if(offset >= file.received()) return 0;
+        into = into.first(std::min<std::uint64_t>(into.size(), file.received() - offset));
+        // The last extent that starts at or before the offset
+        auto extent = std::ranges::upper_bound(file.extents, offset, std::less(), &recording_index::extent::file_offset) - 1;
+        auto position = offset;
+        auto copied = 0uz;
+        auto lock = std::scoped_lock(m_mutex);
+        while(copied < into.size() and extent != file.extents.end())
+        {
+            // The piece of the extent the position is in
+            const auto skip = position - extent->file_offset;
+            const auto piece = skip / extent->size;
+            const auto within = skip % extent->size;
+            const auto size = std::min<std::uint64_t>(extent->size - within, into.size() - copied);
+            const auto target = into.subspan(copied, size);
+            if(not extent->in_recording) std::ranges::copy_n(file.inline_data.begin() + extent->source + within, size, target.begin());
+            else if(copy_from_recording(extent->source + piece * extent->stride + within, target) < size) return copied;
+            copied += size;
+            position += size;
+            if(position == extent->file_offset + extent->length()) ++extent;
+        }
+        return copied;
+    }
+
+    private:
+
+    struct cached_block {
+        std::uint64_t number = std::numeric_limits<std::uint64_t>::max();
+        std::uint64_t last_used = 0;
+        std::size_t size = 0;
+        std::vector<std::uint8_t> data;
+    };
+
+    constexpr static auto BLOCK_SIZE = 256uz << 10;
+    constexpr static auto CACHED_BLOCKS = 16uz; // 4 MiB
+
+    // Pieces of a file are at most one TS payload long but may cross a block boundary
+    auto copy_from_recording(std::uint64_t offset, const std::span<std::uint8_t> into) -> std::size_t
+    {
+        auto copied = 0uz;
+        while(copied < into.size())
+        {
+            const auto& cached = block(offset / BLOCK_SIZE);
+            const auto in_block = offset % BLOCK_SIZE;
+            if(in_block >= cached.size) break;
+            const auto size = std::min(cached.size - in_block, into.size() - copied);
+            std::ranges::copy_n(cached.data.begin() + in_block, size, into.begin() + copied);
+            copied += size;
+            offset += size;
+        }
+        return copied;
+    }
+
+    auto block(const std::uint64_t number) -> const cached_block&
+    {
+        ++m_clock;
+        if(const auto hit = std::ranges::find(m_cache, number, &cached_block::number); hit != m_cache.end())
+        {
+            hit->last_used = m_clock;
+            return *hit;
+        }
+        auto& victim = *std::ranges::min_element(m_cache, std::less(), &cached_block::last_used);
+        victim.data.resize(BLOCK_SIZE);
+        victim.number = number;
+        victim.last_used = m_clock;
+        victim.size = read_block(number * BLOCK_SIZE, victim.data);
+        return victim;
+    }
+
+    auto read_block(const std::uint64_t offset, std::span<std::uint8_t> into) -> std::size_t
+    {
+        auto total = 0uz;
+        #if __unix__
+        while(total < into.size())
+        {
+            const auto result = ::pread(m_fd, into.data() + total, into.size() - total, static_cast<off_t>(offset + total));
+            if(result < 0 and errno == EINTR) continue;
+            if(result <= 0) break;
+            total += static_cast<std::size_t>(result);
+        }
+        #else
+        m_stream.clear();
+        m_stream.seekg(static_cast<std::streamoff>(offset));
+        m_stream.read(reinterpret_cast<char*>(into.data()), static_cast<std::streamsize>(into.size()));
+        total = static_cast<std::size_t>(m_stream.gcount());
+        #endif
+        return total;
+    }
+
+    std::mutex m_mutex;
+    std::array<cached_block, CACHED_BLOCKS> m_cache;
+    std::uint64_t m_clock = 0;
+    int m_fd = -1;
+    std::ifstream m_stream; // Only used where there is no fd
+};
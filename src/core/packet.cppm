@@ -0,0 +1,85 @@
+module;
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+export module rostam_packet;
+import rostam_reader;
+
+export enum class pid_kind : std::uint8_t {
+    IGNORED = 0,
+    PSI = 1,
+    EQSAT = 2
+};
+
+// PIDs are 13 bits so a flat table is cheap and branch free to look up
+export using pid_table = std::array<pid_kind, 8192>;
+
+// What the parser needs to know about a TS packet it keeps, in 8 bytes. The packet itself stays in the block.
+export struct packet_descriptor {
+    constexpr static std::uint8_t PUSI = 0x80;
+    constexpr static std::uint8_t TRANSPORT_ERROR = 0x40;
+
+    std::uint32_t offset = 0; // Of the packet in the run it was filtered from
+    std::uint16_t pid = 0;
+    std::uint8_t payload_offset = 0; // 0 if it has no payload, otherwise the payload is the rest of the packet
+    std::uint8_t flags = 0; // Continuity counter in the low 4 bits, PUSI, TRANSPORT_ERROR
+
+    auto continuity() const -> int
+    {
+        return flags & 0x0F;
+    }
+
+    auto pusi() const -> bool
+    {
+        return flags & PUSI;
+    }
+
+    // The transport_error_indicator, the demodulator couldn't correct the packet and nothing in it can be trusted
+    auto transport_error() const -> bool
+    {
+        return flags & TRANSPORT_ERROR;
+    }
+
+    auto payload(const std::span<const std::uint8_t> packets) const -> std::span<const std::uint8_t>
+    {
+        return packets.subspan(offset + payload_offset, TS_PACKET_SIZE - payload_offset);
+    }
+};
+static_assert(sizeof(packet_descriptor) == 8);
+
+export struct filter_result {
+    std::size_t count = 0; // Descriptors written
+    std::size_t out_of_sync = 0; // Packets that didn't start with the sync byte
+};
+
+// Describes the packets of `packets` (whole TS packets back to back) from byte `from` on whose PID isn't IGNORED.
+// `out` needs a slot for every packet. Packets without the sync byte and ones whose adaptation field is longer than
+// the packet are left out. Done for a run of packets at a time, so the parser only ever sees the few it needs.
+export auto filter_packets(const std::span<const std::uint8_t> packets, const std::size_t from, const pid_table& kinds, const std::span<packet_descriptor> out) -> filter_result
+{
+    auto result = filter_result();
+    for(auto offset = from; offset + TS_PACKET_SIZE <= packets.size(); offset += TS_PACKET_SIZE)
+    {
+        const auto* packet = packets.data() + offset;
+        if(packet[0] != 0x47)
+        {
+            ++result.out_of_sync;
+            continue;
+        }
+        const auto pid = static_cast<std::uint16_t>(((packet[1] & 0x1F) << 8) | packet[2]);
+        if(kinds[pid] == pid_kind::IGNORED) continue;
+        // Adaptation field control: 1 payload only, 3 adaptation field and payload, 0 and 2 no payload
+        const auto adaptation = (packet[3] >> 4) & 0x03;
+        auto payload_offset = 0uz;
+        if(adaptation == 1) payload_offset = 4;
+        else if(adaptation == 3) payload_offset = 5 + packet[4];
+        if(payload_offset > TS_PACKET_SIZE) continue;
+        auto& descriptor = out[result.count++];
+        descriptor.offset = static_cast<std::uint32_t>(offset);
+        descriptor.pid = pid;
+        descriptor.payload_offset = static_cast<std::uint8_t>(payload_offset);
+        descriptor.flags = static_cast<std::uint8_t>((packet[3] & 0x0F) | (packet[1] & 0x40? packet_descriptor::PUSI : 0) | (packet[1] & 0x80? packet_descriptor::TRANSPORT_ERROR : 0));
+    }
+    return result;
+}
@@ -0,0 +1,249 @@
+module;
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <utility>
+export module rostam_pes;
+
+// Streaming PES reassembler and AC-3 frame walker for one PID.
+// EQSat data is carried inside AC-3 frames (PES stream id 0xBD). This strips the PES headers and the 7 byte
+// AC-3 sync headers from the TS payloads and hands out only the data bytes. Headers may start anywhere and span
+// TS packets, and a PES can carry several AC-3 frames. In the common case (inside a frame) a TS payload is
+// handed out as a single span without copying anything.
+export class pes_reassembler
+{
+    public:
+
+    // Everything the reassembler knows about the stream, so an extraction can stop and continue later at the same byte
+    struct snapshot {
+        std::uint8_t state = 0;
+        std::array<std::uint8_t, 9> header {};
+        std::size_t collected = 0;
+        std::size_t skip = 0;
+        std::size_t pes_remaining = 0;
+        std::size_t frame_remaining = 0;
+        int frame_code = -1;
+    };
+
+    auto save() const -> snapshot
+    {
+        return {std::to_underlying(m_state), m_header, m_collected, m_skip, m_pes_remaining, m_frame_remaining, m_frame_code};
+    }
+
+    // False for a snapshot save() can't have made, e.g. one from a broken checkpoint
+    static auto is_valid(const snapshot& saved) -> bool
+    {
+        return saved.state <= std::to_underlying(state::DISCARD) and saved.collected <= saved.header.size() and saved.frame_code >= -1;
+    }
+
+    auto restore(const snapshot& saved) -> void
+    {
+        m_state = saved.state <= std::to_underlying(state::DISCARD)? static_cast<state>(saved.state) : state::DATA;
+        m_header = saved.header;
+        m_collected = std::min(saved.collected, m_header.size());
+        m_skip = saved.skip;
+        m_pes_remaining = saved.pes_remaining;
+        m_frame_remaining = saved.frame_remaining;
+        m_frame_code = saved.frame_code;
+    }
+
+    auto reset() -> void
+    {
+        m_state = state::DATA;
+        m_collected = 0;
+        m_skip = 0;
+        m_pes_remaining = UNBOUNDED;
+        m_frame_remaining = UNBOUNDED;
+        m_frame_code = -1;
+    }
+
+    // Calls on_data(std::span<const std::uint8_t>) for every piece of data in the payload, in order.
+    template <class F>
+    auto feed(const bool unit_start, std::span<const std::uint8_t> payload, F&& on_data) -> void
+    {
+        if(unit_start)
+        {
+            // Whatever we were collecting belongs to the previous PES. If it wasn't a header it was data.
+            if(m_state == state::AC3_HEADER and m_collected > 0) on_data(std::span<const std::uint8_t>(m_header.data(), m_collected));
+            m_state = state::PES_HEADER;
+            m_collected = 0;
+            m_pes_remaining = UNBOUNDED;
+            m_frame_remaining = UNBOUNDED;
+            m_frame_code = -1;
+        }
+        while(not payload.empty())
+        {
+            switch(m_state)
+            {
+                case state::PES_HEADER: payload = read_pes_header(payload, on_data); break;
+                case state::PES_HEADER_SKIP: payload = skip_pes_header(payload); break;
+                case state::AC3_HEADER: payload = read_ac3_header(payload, on_data); break;
+                case state::DATA: payload = read_data(payload, on_data); break;
+                case state::DISCARD: return; // past the end of the PES, nothing until the next unit start
+            }
+        }
+    }
+
+    private:
+
+    enum class state : std::uint8_t {
+        PES_HEADER = 0, // Reading the fixed part of the PES header
+        PES_HEADER_SKIP = 1, // Skipping the optional PES header fields (PTS etc.)
+        AC3_HEADER = 2, // At an AC-3 frame boundary, reading the sync header
+        DATA = 3, // Handing out data until the end of the frame or PES
+        DISCARD = 4 // PES_packet_length says the PES is over
+    };
+    constexpr static auto UNBOUNDED = std::numeric_limits<std::size_t>::max();
+    constexpr static auto AC3_HEADER_SIZE = 7uz;
+
+    // Consumes up to `needed` header bytes into m_header and returns how many it took
+    auto collect(const std::span<const std::uint8_t> payload, const std::size_t needed) -> std::size_t
+    {
+        const auto to_copy = std::min(payload.size(), needed - m_collected);
+        std::ranges::copy_n(payload.begin(), to_copy, m_header.begin() + m_collected);
+        m_collected += to_copy;
+        consume_pes(to_copy);
+        return to_copy;
+    }
+
+    auto consume_pes(const std::size_t bytes) -> void
+    {
+        if(m_pes_remaining == UNBOUNDED) return;
+        m_pes_remaining -= std::min(bytes, m_pes_remaining);
+    }
+
+    template <class F>
+    auto read_pes_header(const std::span<const std::uint8_t> payload, F& on_data) -> std::span<const std::uint8_t>
+    {
+        // packet_start_code_prefix(24) stream_id(8) PES_packet_length(16) flags(16) PES_header_data_length(8)
+        const auto needed = m_collected < 6? 6uz : 9uz;
+        const auto taken = collect(payload, needed);
+        if(m_collected >= 3 and not (m_header[0] == 0x00 and m_header[1] == 0x00 and m_header[2] == 0x01))
+        {
+            // Not a PES at all. Treat everything as data like we always did.
+            const auto collected = m_collected;
+            m_collected = 0;
+            m_state = state::DATA;
+            on_data(std::span<const std::uint8_t>(m_header.data(), collected));
+            return payload.subspan(taken);
+        }
+        if(m_collected < needed) return payload.subspan(taken);
+
+        const auto stream_id = m_header[3];
+        if(m_collected == 6)
+        {
+            // PES_packet_length counts everything after itself
+            if(const auto pes_length = static_cast<std::size_t>((m_header[4] << 8) | m_header[5]); pes_length != 0)
+                m_pes_remaining = pes_length;
+            // These stream ids don't have the optional header (ISO 13818-1 2.4.3.7)
+            if(stream_id == 0xBC or stream_id == 0xBE or stream_id == 0xBF or stream_id == 0xF0 or stream_id == 0xF1 or stream_id == 0xF2 or stream_id == 0xF8 or stream_id == 0xFF)
+            {
+                m_collected = 0;
+                m_state = stream_id == 0xBE? state::DISCARD : state::DATA; // padding stream
+                return payload.subspan(taken);
+            }
+            return payload.subspan(taken);
+        }
+        m_skip = m_header[8];
+        m_collected = 0;
+        m_state = state::PES_HEADER_SKIP;
+        return payload.subspan(taken);
+    }
+
+    auto skip_pes_header(const std::span<const std::uint8_t> payload) -> std::span<const std::uint8_t>
+    {
+        const auto skipped = std::min(payload.size(), m_skip);
+        m_skip -= skipped;
+        consume_pes(skipped);
+        if(m_skip == 0)
+        {
+            // The PES header is done. Private stream 1 (0xBD) is where DVB puts AC-3.
+            m_state = m_header[3] == 0xBD? state::AC3_HEADER : state::DATA;
+            if(m_pes_remaining == 0) m_state = state::DISCARD;
+        }
+        return payload.subspan(skipped);
+    }
+
+    template <class F>
+    auto read_ac3_header(const std::span<const std::uint8_t> payload, F& on_data) -> std::span<const std::uint8_t>
+    {
+        const auto taken = collect(payload, AC3_HEADER_SIZE);
+        const auto not_a_frame = [&]{
+            // No (consistent) sync frame at the frame boundary. The rest of the PES is plain data, like it always was.
+            const auto collected = m_collected;
+            m_collected = 0;
+            m_frame_remaining = UNBOUNDED;
+            m_state = state::DATA;
+            on_data(std::span<const std::uint8_t>(m_header.data(), collected));
+            return payload.subspan(taken);
+        };
+        if(m_collected >= 1 and m_header[0] != 0x0B) return not_a_frame();
+        if(m_collected >= 2 and m_header[1] != 0x77) return not_a_frame();
+        if(m_collected < AC3_HEADER_SIZE)
+        {
+            if(m_pes_remaining == 0) return not_a_frame();
+            return payload.subspan(taken);
+        }
+
+        // Frames after the first one in a PES must look like the first one, otherwise 0x0B77 at the
+        // boundary was just data that happened to look like a sync word.
+        const auto frame_code = m_header[4];
+        if(m_frame_code >= 0 and frame_code != m_frame_code) return not_a_frame();
+        m_frame_code = frame_code;
+        const auto frame_size = ac3_frame_size(m_header);
+        m_frame_remaining = frame_size > AC3_HEADER_SIZE? frame_size - AC3_HEADER_SIZE : UNBOUNDED;
+        m_collected = 0;
+        m_state = m_pes_remaining == 0? state::DISCARD : state::DATA;
+        return payload.subspan(taken);
+    }
+
+    template <class F>
+    auto read_data(const std::span<const std::uint8_t> payload, F& on_data) -> std::span<const std::uint8_t>
+    {
+        const auto length = std::min({payload.size(), m_frame_remaining, m_pes_remaining});
+        on_data(payload.first(length));
+        consume_pes(length);
+        if(m_frame_remaining != UNBOUNDED)
+        {
+            m_frame_remaining -= length;
+            if(m_frame_remaining == 0) m_state = state::AC3_HEADER;
+        }
+        if(m_pes_remaining == 0) m_state = state::DISCARD;
+        return payload.subspan(length);
+    }
+
+    // Size of a whole sync frame in bytes (A/52 table 5.18), 0 if unknown.
+    static auto ac3_frame_size(const std::array<std::uint8_t, 9>& header) -> std::size_t
+    {
+        const auto bsid = header[5] >> 3;
+        if(bsid > 10 and bsid <= 16)
+        {
+            // E-AC-3 has frmsiz right in the header
+            return (((header[2] & 0x07) << 8 | header[3]) + 1) * 2uz;
+        }
+        constexpr static auto words_48k = std::to_array<std::size_t>({64,80,96,112,128,160,192,224,256,320,384,448,512,640,768,896,1024,1152,1280});
+        constexpr static auto words_44k = std::to_array<std::size_t>({69,87,104,121,139,174,208,243,278,348,417,487,557,696,835,975,1114,1253,1393});
+        constexpr static auto words_32k = std::to_array<std::size_t>({96,120,144,168,192,240,288,336,384,480,576,672,768,960,1152,1344,1536,1728,1920});
+        const auto fscod = header[4] >> 6;
+        const auto frmsizecod = static_cast<std::size_t>(header[4] & 0x3F);
+        if(frmsizecod / 2 >= words_48k.size()) return 0;
+        switch(fscod)
+        {
+            case 0: return words_48k[frmsizecod / 2] * 2;
+            case 1: return (words_44k[frmsizecod / 2] + frmsizecod % 2) * 2;
+            case 2: return words_32k[frmsizecod / 2] * 2;
+            default: return 0;
+        }
+    }
+
+    state m_state = state::DATA; // Until we see the first unit start everything is data, like it always was
+    std::array<std::uint8_t, 9> m_header {}; // Header bytes collected so far (PES or AC-3, whichever we are reading)
+    std::size_t m_collected = 0;
+    std::size_t m_skip = 0;
+    std::size_t m_pes_remaining = UNBOUNDED;
+    std::size_t m_frame_remaining = UNBOUNDED;
+    int m_frame_code = -1;
+};
@@ -0,0 +1,171 @@
+module;
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+export module rostam_progress;
+
+// Progress of an extraction shared between the worker thread (writer) and the gui thread (reader).
+// The worker only does relaxed atomic stores so publishing costs next to nothing on the hot path,
+// and the gui takes a snapshot whenever it wants (once per frame) without ever locking the worker.
+export class extraction_progress
+{
+    public:
+
+    enum class status : std::uint8_t {
+        IDLE = 0,
+        RUNNING = 1,
+        FINISHED = 2
+    };
+
+    struct snapshot {
+        status state = status::IDLE;
+        bool cancelled = false;
+        std::uint64_t bytes_processed = 0;
+        std::uint64_t bytes_total = 0;
+        std::uint32_t files_done = 0;
+        std::uint64_t bytes_skipped = 0; // Left unread because every file of the carousel was already there
+        std::string current_file;
+        double mb_per_sec = 0.0;
+        std::optional<std::chrono::seconds> eta;
+
+        auto percent() const -> int
+        {
+            if(state == status::FINISHED) return 100;
+            if(bytes_total == 0) return 0;
+            // 100 is reserved for when the worker has actually finished.
+            return std::min<int>(bytes_processed * 100 / bytes_total, 99);
+        }
+    };
+
+    ////// writer side (worker thread) //////
+
+    // A resumed extraction starts at `bytes_resumed`. Those don't count towards the speed.
+    auto start(const std::uint64_t bytes_total, const std::uint64_t bytes_resumed = 0) -> void
+    {
+        m_bytes_total.store(bytes_total, std::memory_order_relaxed);
+        m_bytes_processed.store(bytes_resumed, std::memory_order_relaxed);
+        m_bytes_resumed.store(bytes_resumed, std::memory_order_relaxed);
+        m_files_done.store(0, std::memory_order_relaxed);
+        m_bytes_skipped.store(0, std::memory_order_relaxed);
+        m_cancelled.store(false, std::memory_order_relaxed);
+        m_error.clear();
+        m_start_time.store(clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+        set_current_file({});
+        m_state.store(status::RUNNING, std::memory_order_release);
+    }
+
+    auto set_bytes_processed(const std::uint64_t bytes) -> void
+    {
+        m_bytes_processed.store(bytes, std::memory_order_relaxed);
+    }
+
+    auto file_started(const std::string_view filename) -> void
+    {
+        set_current_file(filename);
+    }
+
+    auto file_completed() -> void
+    {
+        m_files_done.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    auto skipped(const std::uint64_t bytes) -> void
+    {
+        m_bytes_skipped.store(bytes, std::memory_order_relaxed);
+    }
+
+    // `error` is what stopped an extraction that threw, empty when it ended normally or was cancelled
+    auto finish(const bool cancelled, std::string error = {}) -> void
+    {
+        m_error = std::move(error);
+        m_cancelled.store(cancelled, std::memory_order_relaxed);
+        m_state.store(status::FINISHED, std::memory_order_release);
+    }
+
+    ////// reader side (gui thread) //////
+
+    auto read() const -> snapshot
+    {
+        auto snap = snapshot();
+        snap.state = m_state.load(std::memory_order_acquire);
+        snap.cancelled = m_cancelled.load(std::memory_order_relaxed);
+        snap.bytes_processed = m_bytes_processed.load(std::memory_order_relaxed);
+        snap.bytes_total = m_bytes_total.load(std::memory_order_relaxed);
+        snap.files_done = m_files_done.load(std::memory_order_relaxed);
+        snap.bytes_skipped = m_bytes_skipped.load(std::memory_order_relaxed);
+        snap.current_file = current_file();
+
+        const auto elapsed = std::chrono::duration<double>(clock::now() - clock::time_point(clock::duration(m_start_time.load(std::memory_order_relaxed))));
+        if(snap.state != status::IDLE and elapsed.count() > 0.0)
+        {
+            const auto bytes_per_sec = (snap.bytes_processed - std::min(snap.bytes_processed, m_bytes_resumed.load(std::memory_order_relaxed))) / elapsed.count();
+            snap.mb_per_sec = bytes_per_sec / (1024.0 * 1024.0);
+            if(bytes_per_sec > 0.0 and snap.bytes_total >= snap.bytes_processed)
+                snap.eta = std::chrono::seconds(static_cast<std::int64_t>((snap.bytes_total - snap.bytes_processed) / bytes_per_sec));
+        }
+        return snap;
+    }
+
+    // Returns true only once per finished run (it flips FINISHED back to IDLE) so the gui shows the result once.
+    auto consume_finished() -> bool
+    {
+        auto expected = status::FINISHED;
+        return m_state.compare_exchange_strong(expected, status::IDLE, std::memory_order_acq_rel);
+    }
+
+    // Why the last extraction failed, empty if it didn't. Only read it after consume_finished() returned true,
+    // the worker doesn't touch it again until the next extraction starts.
+    auto error() const -> const std::string&
+    {
+        return m_error;
+    }
+
+    private:
+
+    // A tiny seqlock. The filename only changes once per extracted file so the reader practically never retries.
+    auto set_current_file(const std::string_view filename) -> void
+    {
+        const auto seq = m_file_seq.load(std::memory_order_relaxed);
+        m_file_seq.store(seq + 1, std::memory_order_relaxed); // odd means a write is in progress
+        std::atomic_thread_fence(std::memory_order_release);
+        const auto length = std::min(filename.size(), m_file.size());
+        for(auto i = 0uz; i < length; ++i) m_file[i].store(filename[i], std::memory_order_relaxed);
+        m_file_length.store(length, std::memory_order_relaxed);
+        m_file_seq.store(seq + 2, std::memory_order_release);
+    }
+
+    auto current_file() const -> std::string
+    {
+        auto filename = std::string();
+        while(true)
+        {
+            const auto seq_before = m_file_seq.load(std::memory_order_acquire);
+            if(seq_before % 2 != 0) continue;
+            filename.resize(m_file_length.load(std::memory_order_relaxed));
+            for(auto i = 0uz; i < filename.size(); ++i) filename[i] = m_file[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(m_file_seq.load(std::memory_order_relaxed) == seq_before) return filename;
+        }
+    }
+
+    using clock = std::chrono::steady_clock;
+    std::atomic<status> m_state = status::IDLE;
+    std::atomic_bool m_cancelled = false;
+    std::atomic_uint64_t m_bytes_processed = 0;
+    std::atomic_uint64_t m_bytes_total = 0;
+    std::atomic_uint64_t m_bytes_resumed = 0;
+    std::atomic_uint32_t m_files_done = 0;
+    std::atomic_uint64_t m_bytes_skipped = 0;
+    std::atomic<clock::rep> m_start_time = 0;
+    std::atomic_uint32_t m_file_seq = 0;
+    std::atomic_size_t m_file_length = 0;
+    std::array<std::atomic<char>, 255> m_file {}; // filenames are capped at 255 bytes by the core
+    std::string m_error; // Published by the release store of FINISHED in finish()
+};
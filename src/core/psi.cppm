@@ -0,0 +1,209 @@
+module;
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <print>
+#include <ranges>
+#include <span>
+#include <utility>
+#include <vector>
+export module rostam_psi;
+
+// Minimal MPEG-TS PSI (PAT/PMT) parser. It is only used to find out on which PIDs the
+// AC-3 elementary streams live, so the broadcaster can move the EQSat service around without us noticing.
+export class psi_parser
+{
+    public:
+
+    struct elementary_stream {
+        int pid = 0;
+        int stream_type = 0;
+        int program_number = 0;
+    };
+
+    constexpr static auto PAT_PID = 0;
+
+    auto reset() -> void
+    {
+        m_sections.clear();
+        m_sections.emplace_back().pid = PAT_PID;
+        m_pmt_versions.clear();
+        m_pat_version = -1;
+        m_streams.clear();
+        m_new_streams.clear();
+    }
+
+    psi_parser()
+    {
+        reset();
+    }
+
+    auto is_psi_pid(const int pid) const -> bool
+    {
+        return std::ranges::contains(m_sections, pid, &section_buffer::pid);
+    }
+
+    auto psi_pids() const
+    {
+        return m_sections | std::views::transform(&section_buffer::pid);
+    }
+
+    // Feed the payload of a TS packet that belongs to a PSI pid (see is_psi_pid)
+    auto feed(const int pid, const bool unit_start, const std::span<const std::uint8_t> payload) -> void
+    {
+        const auto section = std::ranges::find(m_sections, pid, &section_buffer::pid);
+        if(section == m_sections.end() or payload.empty()) return;
+        // Keep the index. Parsing a PAT can add more section buffers and invalidate the iterator.
+        const auto index = std::distance(m_sections.begin(), section);
+
+        auto data = payload;
+        if(unit_start)
+        {
+            const auto pointer_field = static_cast<std::size_t>(data[0]);
+            if(pointer_field + 1 > data.size()) return;
+            // The bytes before the pointer finish the section that was started in previous packets
+            append_and_parse(index, data.subspan(1, pointer_field));
+            m_sections[index].bytes.clear();
+            m_sections[index].collecting = true;
+            data = data.subspan(1 + pointer_field);
+        }
+        if(not m_sections[index].collecting) return; // we joined in the middle of a section
+        append_and_parse(index, data);
+    }
+
+    auto streams() const -> const std::vector<elementary_stream>&
+    {
+        return m_streams;
+    }
+
+    // Streams discovered since the last call
+    auto take_new_streams() -> std::vector<elementary_stream>
+    {
+        return std::exchange(m_new_streams, {});
+    }
+
+    private:
+
+    struct section_buffer {
+        int pid = 0;
+        bool collecting = false;
+        std::vector<std::uint8_t> bytes;
+    };
+
+    auto append_and_parse(const std::size_t index, const std::span<const std::uint8_t> data) -> void
+    {
+        if(not m_sections[index].collecting) return;
+        m_sections[index].bytes.insert(m_sections[index].bytes.end(), data.begin(), data.end());
+        // A packet can carry several sections back to back. 0xFF is stuffing until the end of the packet.
+        // Don't hold a reference to the buffer here, parsing a PAT adds section buffers.
+        while(m_sections[index].bytes.size() >= 3 and m_sections[index].bytes[0] != 0xFF)
+        {
+            auto& bytes = m_sections[index].bytes;
+            const auto section_length = 3uz + (((bytes[1] & 0x0F) << 8) | bytes[2]);
+            if(bytes.size() < section_length) return;
+            // The scratch copy keeps its capacity, PAT and PMT repeat several times a second
+            m_section.assign(bytes.begin(), bytes.begin() + section_length);
+            bytes.erase(bytes.begin(), bytes.begin() + section_length);
+            parse_section(m_sections[index].pid, m_section);
+        }
+        if(auto& bytes = m_sections[index].bytes; not bytes.empty() and bytes[0] == 0xFF)
+        {
+            bytes.clear();
+            m_sections[index].collecting = false;
+        }
+    }
+
+    auto parse_section(const int pid, const std::span<const std::uint8_t> section) -> void
+    {
+        // table_id(8) + flags/length(16) + id(16) + version(8) + section numbers(16) + CRC(32)
+        if(section.size() < 12 or crc32(section) != 0) return;
+        const auto table_id = section[0];
+        const auto version = (section[5] >> 1) & 0x1F;
+        const auto current_next = section[5] & 0x01;
+        if(not current_next) return;
+        const auto body = section.subspan(8, section.size() - 8 - 4);
+
+        if(pid == PAT_PID and table_id == 0x00)
+        {
+            if(version == m_pat_version) return;
+            m_pat_version = version;
+            for(auto i = 0uz; i + 4 <= body.size(); i += 4)
+            {
+                const auto program_number = (body[i] << 8) | body[i+1];
+                const auto pmt_pid = ((body[i+2] & 0x1F) << 8) | body[i+3];
+                if(program_number == 0) continue; // That's the NIT
+                if(is_psi_pid(pmt_pid)) continue;
+                m_sections.emplace_back().pid = pmt_pid;
+            }
+        }
+        else if(table_id == 0x02)
+        {
+            const auto program_number = (section[3] << 8) | section[4];
+            const auto known_version = std::ranges::find(m_pmt_versions, pid, &std::pair<int,int>::first);
+            if(known_version != m_pmt_versions.end())
+            {
+                if(known_version->second == version) return;
+                known_version->second = version;
+            }
+            else m_pmt_versions.emplace_back(pid, version);
+
+            if(body.size() < 4) return;
+            const auto program_info_length = ((body[2] & 0x0F) << 8) | body[3];
+            for(auto i = 4uz + program_info_length; i + 5 <= body.size();)
+            {
+                const auto stream_type = body[i];
+                const auto es_pid = ((body[i+1] & 0x1F) << 8) | body[i+2];
+                const auto es_info_length = static_cast<std::size_t>(((body[i+3] & 0x0F) << 8) | body[i+4]);
+                const auto descriptors = body.subspan(i + 5, std::min(es_info_length, body.size() - i - 5));
+                if(carries_eqsat(stream_type, descriptors) and not std::ranges::contains(m_streams, es_pid, &elementary_stream::pid))
+                {
+                    std::println("Found an AC-3 stream on PID {} (stream type 0x{:X}, program {})", es_pid, stream_type, program_number);
+                    m_streams.push_back({es_pid, stream_type, program_number});
+                    m_new_streams.push_back(m_streams.back());
+                }
+                i += 5 + es_info_length;
+            }
+        }
+    }
+
+    // EQSat rides on AC-3 PES packets (stream id 0xBD). DVB announces those as private PES data (0x06) with an AC-3
+    // descriptor, ATSC style muxers use 0x81 directly. Other private PES data (teletext, subtitles, whatever a muxer
+    // didn't describe) isn't AC-3.
+    static auto carries_eqsat(const int stream_type, const std::span<const std::uint8_t> descriptors) -> bool
+    {
+        if(stream_type == 0x81 or stream_type == 0x87) return true; // AC-3, E-AC-3
+        if(stream_type != 0x06) return false;
+        for(auto i = 0uz; i + 2 <= descriptors.size(); i += 2 + descriptors[i+1])
+        {
+            const auto tag = descriptors[i];
+            if(tag == 0x6A or tag == 0x7A) return true; // AC-3 and enhanced AC-3 descriptors
+        }
+        return false;
+    }
+
+    // CRC-32/MPEG-2. Running it over a whole section including its CRC field yields 0.
+    static auto crc32(const std::span<const std::uint8_t> data) -> std::uint32_t
+    {
+        constexpr static auto table = []{
+            auto t = std::array<std::uint32_t, 256>();
+            for(auto i = 0u; i < 256; ++i)
+            {
+                auto crc = i << 24;
+                for(auto bit = 0; bit < 8; ++bit) crc = (crc & 0x80000000u) ? (crc << 1) ^ 0x04C11DB7u : crc << 1;
+                t[i] = crc;
+            }
+            return t;
+        }();
+        auto crc = 0xFFFFFFFFu;
+        for(const auto byte : data) crc = (crc << 8) ^ table[((crc >> 24) ^ byte) & 0xFF];
+        return crc;
+    }
+
+    std::vector<section_buffer> m_sections;
+    std::vector<std::uint8_t> m_section; // The section being parsed
+    std::vector<std::pair<int,int>> m_pmt_versions; // pid, version
+    int m_pat_version = -1;
+    std::vector<elementary_stream> m_streams;
+    std::vector<elementary_stream> m_new_streams;
+};
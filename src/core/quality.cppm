@@ -0,0 +1,253 @@
+module;
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <print>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+export module rostam_quality;
+import rostam_storage;
+
+// Same workaround as in rostam.cppm, std::println throws on windows when the console is disabled.
+#if _WIN32
+#define println _dummy_println_win_
+namespace std {
+    template <class... T>
+    void _dummy_println_win_ ([[maybe_unused]] const T&... _)
+    {
+        // Do nothing
+    }
+};
+#endif
+
+// Carousels send the same files over and over, and a later pass can come through worse than an earlier one
+// (a few packets lost to a weak signal). How a copy came through is remembered for every file in the output
+// directory, and a new copy only takes the name of the old one if it's at least as good.
+
+// Tells copies of a file apart without keeping them around. Not cryptographic, just cheap enough to run over everything
+// that is written (one multiply per 8 bytes), and the same bytes give the same value on every machine.
+export class content_hash
+{
+    public:
+
+    // What a checkpoint keeps of a hash that is still being computed
+    struct snapshot {
+        std::uint64_t state = SEED;
+        std::uint64_t pending = 0;
+        std::uint64_t size = 0;
+    };
+
+    auto update(std::span<const std::uint8_t> data) -> void
+    {
+        // Finish the word the last piece ended in
+        while(m_size % 8 != 0 and not data.empty())
+        {
+            m_pending |= static_cast<std::uint64_t>(data.front()) << (8 * (m_size % 8));
+            data = data.subspan(1);
+            if(++m_size % 8 == 0) m_state = mix(m_state, std::exchange(m_pending, 0));
+        }
+        for(; data.size() >= 8; data = data.subspan(8), m_size += 8)
+        {
+            auto word = std::uint64_t();
+            std::memcpy(&word, data.data(), sizeof(word));
+            if constexpr(std::endian::native == std::endian::big) word = std::byteswap(word);
+            m_state = mix(m_state, word);
+        }
+        for(const auto byte : data) m_pending |= static_cast<std::uint64_t>(byte) << (8 * (m_size++ % 8));
+    }
+
+    // Never 0, that stands for a copy whose hash isn't known
+    auto value() const -> std::uint64_t
+    {
+        auto state = m_size % 8 != 0? mix(m_state, m_pending) : m_state;
+        // The length goes in last, so trailing zeros make a difference
+        state = mix(state, m_size);
+        return state != 0? state : 1;
+    }
+
+    auto save() const -> snapshot
+    {
+        return {m_state, m_pending, m_size};
+    }
+
+    auto restore(const snapshot& saved) -> void
+    {
+        m_state = saved.state;
+        m_pending = saved.pending;
+        m_size = saved.size;
+    }
+
+    static auto of(const std::span<const std::uint8_t> data) -> std::uint64_t
+    {
+        auto hash = content_hash();
+        hash.update(data);
+        return hash.value();
+    }
+
+    private:
+
+    constexpr static std::uint64_t SEED = 0x243F6A8885A308D3;
+
+    static auto mix(std::uint64_t state, const std::uint64_t word) -> std::uint64_t
+    {
+        state = (state ^ word) * 0x9E3779B97F4A7C15;
+        return state ^ (state >> 32);
+    }
+
+    std::uint64_t m_state = SEED;
+    std::uint64_t m_pending = 0; // The bytes of the last, incomplete word
+    std::uint64_t m_size = 0;
+};
+
+export struct copy_quality {
+    std::uint64_t losses = 0; // Packets missing on its PID (continuity counter gaps) while it was received
+    bool verified = false; // file_verifier knew the format and the structure was fine
+    std::uint64_t hash = 0; // content_hash of the copy, 0 if it isn't known
+};
+
+// Fewer losses first, a verified copy wins over one that wasn't checked. Equally good copies are replaced, the
+// broadcaster may have updated the file. Copies with the same content never get here, see copy_keeper::complete.
+auto is_worse(const copy_quality& copy, const copy_quality& than) -> bool
+{
+    if(copy.losses != than.losses) return copy.losses > than.losses;
+    return not copy.verified and than.verified;
+}
+
+// Decides which copy of a file keeps its name. Used from the parser, the small file batch and the verifier threads.
+export class copy_keeper
+{
+    public:
+
+    copy_keeper(const storage::output_directory& directory, const bool keep_better):
+    m_directory(directory),
+    m_keep_better(keep_better)
+    {
+    }
+
+    copy_keeper(const copy_keeper&) = delete;
+    auto operator=(const copy_keeper&) -> copy_keeper& = delete;
+
+    // Reads what is known about the files in the output directory. A missing or unreadable index is just empty.
+    auto load() -> void
+    {
+        auto lock = std::scoped_lock(m_mutex);
+        m_kept.clear();
+        m_changed = false;
+        if(not m_keep_better) return;
+        auto file = std::ifstream(index_path());
+        // "<losses> <verified> <hash> <name>" per line after INDEX_HEADER, sanitized names never contain a line break.
+        // An index without the header was written before there were hashes, has no <hash> and starts with an entry.
+        auto line = std::string();
+        const auto hashes = std::getline(file, line) and line == INDEX_HEADER;
+        for(auto first = not hashes; first or std::getline(file, line); first = false)
+        {
+            auto quality = copy_quality();
+            auto verified = 0;
+            const auto end = std::as_const(line).data() + line.size();
+            const auto [losses_end, losses_error] = std::from_chars(line.data(), end, quality.losses);
+            if(losses_error != std::errc() or losses_end == end) continue;
+            auto [name, verified_error] = std::from_chars(losses_end + 1, end, verified);
+            if(verified_error != std::errc() or name == end) continue;
+            if(hashes)
+            {
+                const auto [hash_end, hash_error] = std::from_chars(name + 1, end, quality.hash, 16);
+                if(hash_error != std::errc() or hash_end == end) continue;
+                name = hash_end;
+            }
+            if(name + 1 == end) continue;
+            quality.verified = verified != 0;
+            m_kept.insert_or_assign(std::string(name + 1, end), quality);
+        }
+    }
+
+    // Written next to the old index and renamed over it, like the checkpoint
+    auto save() -> void
+    {
+        auto lock = std::scoped_lock(m_mutex);
+        if(not m_keep_better or not m_changed) return;
+        auto temporary = index_path();
+        temporary += ".tmp";
+        {
+            auto file = std::ofstream(temporary, std::ios::trunc);
+            file << INDEX_HEADER << '\n';
+            for(const auto& [name, quality] : m_kept)
+                file << quality.losses << ' ' << (quality.verified? 1 : 0) << ' ' << std::hex << quality.hash << std::dec << ' ' << name << '\n';
+            if(not file.flush()) throw std::runtime_error("[Rostam Core Error] Could not write the file index.");
+        }
+        std::filesystem::rename(temporary, index_path());
+        m_changed = false;
+    }
+
+    // Gives the completed copy in `from` the name `name`, unless the file that already has that name came through
+    // better. The worse copy is removed. A file that is there but unknown to the index (extracted by an older version
+    // or copied in) counts as one without losses.
+    auto complete(const char* from, const char* name, const copy_quality quality) -> bool
+    {
+        if(not m_keep_better)
+        {
+            m_directory.rename(from, name);
+            return true;
+        }
+        auto lock = std::scoped_lock(m_mutex);
+        // Carousels repeat the same names, looking one up doesn't allocate
+        const auto known = m_kept.find(std::string_view(name));
+        if(m_directory.exists(name))
+        {
+            const auto existing = known != m_kept.end()? known->second : copy_quality();
+            // The same bytes again. The file stays as it is and is as good as the better of the two copies.
+            if(quality.hash != 0 and quality.hash == existing.hash)
+            {
+                m_directory.remove(from);
+                known->second.losses = std::min(existing.losses, quality.losses);
+                known->second.verified = existing.verified or quality.verified;
+                m_changed = true;
+                return false;
+            }
+            if(is_worse(quality, existing))
+            {
+                std::println("Keeping the earlier copy of {} ({} packets lost), this one lost {}", name, existing.losses, quality.losses);
+                m_directory.remove(from);
+                return false;
+            }
+        }
+        m_directory.rename(from, name);
+        if(known != m_kept.end()) known->second = quality;
+        else m_kept.emplace(name, quality);
+        m_changed = true;
+        return true;
+    }
+
+    private:
+
+    struct name_hash {
+        using is_transparent = void;
+        auto operator()(const std::string_view name) const -> std::size_t
+        {
+            return std::hash<std::string_view>()(name);
+        }
+    };
+
+    constexpr static auto INDEX_HEADER = std::string_view("rostam-files 2");
+
+    auto index_path() const -> std::filesystem::path
+    {
+        return m_directory.path() / ".rostam-files";
+    }
+
+    const storage::output_directory& m_directory;
+    bool m_keep_better;
+    bool m_changed = false;
+    std::mutex m_mutex;
+    std::unordered_map<std::string, copy_quality, name_hash, std::equal_to<>> m_kept;
+};
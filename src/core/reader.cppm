@@ -0,0 +1,587 @@
+module;
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <stop_token>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+#if __unix__
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+export module rostam_reader;
+import rostam_uring;
+import rostam_trace;
+
+export constexpr auto TS_PACKET_SIZE = 188uz;
+// O_DIRECT wants buffers, offsets and lengths aligned to the logical block size of the disk. 4 KiB covers all of them.
+export constexpr auto DIRECT_IO_ALIGNMENT = 4096uz;
+
+// What reading the recording does to the page cache. Every byte of a recording is read exactly once, so caching it
+// only evicts things other programs on the machine still need.
+export enum class cache_mode : std::uint8_t {
+    CACHED = 0, // Let the kernel do what it wants
+    DROP_BEHIND = 1, // posix_fadvise(DONTNEED) every block once the parser is done with it
+    DIRECT = 2 // O_DIRECT, bypass the page cache completely. Falls back to DROP_BEHIND where the filesystem can't do it.
+};
+
+// Where the core gets the recording from. Readers hand out big blocks instead of bytes so the parser
+// can run over them without touching the reader in between.
+export class ts_reader
+{
+    public:
+
+    virtual ~ts_reader() = default;
+
+    // The next block of the recording, empty at the end. Blocks are a multiple of TS_PACKET_SIZE except maybe the last one.
+    // The span stays valid until the next call.
+    virtual auto next() -> std::span<const std::uint8_t> = 0;
+
+    // Size of the whole input in bytes, for progress reporting
+    virtual auto size() const -> std::uint64_t = 0;
+
+    // The input ended because nothing came in for a while, not at its real end. More of it may show up later.
+    virtual auto timed_out() const -> bool
+    {
+        return false;
+    }
+};
+
+// Heap buffer for the readers, aligned so it can be used with O_DIRECT
+class aligned_buffer
+{
+    public:
+
+    explicit aligned_buffer(const std::size_t size):
+    m_data(static_cast<std::uint8_t*>(::operator new[](size, std::align_val_t(DIRECT_IO_ALIGNMENT)))),
+    m_size(size)
+    {
+    }
+
+    auto span() -> std::span<std::uint8_t>
+    {
+        return {m_data.get(), m_size};
+    }
+
+    private:
+
+    struct deleter {
+        auto operator()(std::uint8_t* data) const -> void
+        {
+            ::operator delete[](data, std::align_val_t(DIRECT_IO_ALIGNMENT));
+        }
+    };
+    std::unique_ptr<std::uint8_t[], deleter> m_data;
+    std::size_t m_size;
+};
+
+#if __unix__
+// Opens the recording for one of the fd based readers. `direct` tells if O_DIRECT is actually in effect.
+auto open_input(const std::filesystem::path& input, const cache_mode mode, bool& direct, const std::uint64_t start) -> int
+{
+    direct = false;
+    auto fd = -1;
+    #ifdef O_DIRECT
+    // A resumed extraction may start at an offset O_DIRECT can't read from
+    if(mode == cache_mode::DIRECT and start % DIRECT_IO_ALIGNMENT == 0)
+    {
+        fd = ::open(input.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+        direct = fd >= 0;
+    }
+    #endif
+    // tmpfs and some FUSE filesystems refuse O_DIRECT
+    if(fd < 0) fd = ::open(input.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) throw std::runtime_error("[Rostam Core Error] Could not open the input file.");
+    // Doubles the readahead window on Linux. Harmless everywhere else.
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return fd;
+}
+
+// Some filesystems accept O_DIRECT in open() and only fail the reads with EINVAL. Turn it off and read normally.
+auto disable_direct(const int fd) -> void
+{
+    #ifdef O_DIRECT
+    ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) & ~O_DIRECT);
+    #endif
+}
+
+auto drop_behind(const int fd, const std::uint64_t offset, const std::size_t length) -> void
+{
+    if(length > 0) ::posix_fadvise(fd, static_cast<off_t>(offset), static_cast<off_t>(length), POSIX_FADV_DONTNEED);
+}
+
+auto round_up(const std::size_t length) -> std::size_t
+{
+    return (length + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+}
+
+// Fills `buffer` with the input from `offset` on, as far as the input goes (`size`). Returns how much was read.
+auto read_at(const int fd, const std::span<std::uint8_t> buffer, const std::uint64_t offset, const std::uint64_t size, bool& direct) -> std::size_t
+{
+    auto read = 0uz;
+    while(read < buffer.size() and offset + read < size)
+    {
+        // With O_DIRECT the length must be aligned too. Reading past the end is fine, it just comes back short.
+        const auto wanted = direct? buffer.size() - read : std::min<std::uint64_t>(buffer.size() - read, size - offset - read);
+        const auto result = ::pread(fd, buffer.data() + read, wanted, static_cast<off_t>(offset + read));
+        if(result < 0 and errno == EINTR) continue;
+        if(result < 0 and errno == EINVAL and direct)
+        {
+            disable_direct(fd);
+            direct = false;
+            continue;
+        }
+        if(result < 0) throw std::system_error(errno, std::system_category(), "[Rostam Core Error] Reading the input failed");
+        if(result == 0) break;
+        read += result;
+    }
+    return std::min<std::uint64_t>(read, size - offset);
+}
+#endif
+
+// The portable reader. Plain std::ifstream, works everywhere.
+export class stream_reader
+:public ts_reader
+{
+    public:
+
+    stream_reader(const std::filesystem::path& input, const std::size_t block_size, const std::uint64_t start = 0):
+    m_file(input, std::ios::binary),
+    m_size(std::filesystem::file_size(input)),
+    m_buffer(block_size)
+    {
+        if(not m_file) throw std::runtime_error("[Rostam Core Error] Could not open the input file.");
+        m_file.seekg(static_cast<std::streamoff>(start));
+    }
+
+    auto next() -> std::span<const std::uint8_t> override
+    {
+        m_file.read(reinterpret_cast<char*>(m_buffer.data()), m_buffer.size());
+        return std::span(m_buffer).first(m_file.gcount());
+    }
+
+    auto size() const -> std::uint64_t override
+    {
+        return m_size;
+    }
+
+    private:
+
+    std::ifstream m_file;
+    std::uint64_t m_size;
+    std::vector<std::uint8_t> m_buffer;
+};
+
+#if __unix__
+// Synchronous pread() reader for when we care about the page cache but don't have io_uring.
+export class pread_reader
+:public ts_reader
+{
+    public:
+
+    pread_reader(const std::filesystem::path& input, const std::size_t block_size, const cache_mode mode, const std::uint64_t start = 0):
+    m_mode(mode),
+    m_size(std::filesystem::file_size(input)),
+    m_offset(start),
+    m_buffer(block_size)
+    {
+        m_fd = open_input(input, mode, m_direct, start);
+    }
+
+    ~pread_reader() override
+    {
+        ::close(m_fd);
+    }
+
+    auto next() -> std::span<const std::uint8_t> override
+    {
+        // The parser is done with the last block
+        if(m_mode != cache_mode::CACHED and not m_direct) drop_behind(m_fd, m_offset - m_last, m_last);
+        const auto buffer = m_buffer.span();
+        const auto read = read_at(m_fd, buffer, m_offset, m_size, m_direct);
+        m_offset += read;
+        m_last = read;
+        return buffer.first(read);
+    }
+
+    auto size() const -> std::uint64_t override
+    {
+        return m_size;
+    }
+
+    private:
+
+    cache_mode m_mode;
+    int m_fd = -1;
+    bool m_direct = false;
+    std::uint64_t m_size;
+    std::uint64_t m_offset = 0;
+    std::size_t m_last = 0;
+    aligned_buffer m_buffer;
+};
+#endif
+
+// Reads the next blocks on a thread of its own while the parser works on the current one, so reading and parsing
+// overlap without io_uring. `depth` buffers go around between the two threads, in order.
+export class prefetch_reader
+:public ts_reader
+{
+    public:
+
+    prefetch_reader(const std::filesystem::path& input, const std::size_t block_size, const std::size_t depth, const cache_mode mode, const std::uint64_t start = 0):
+    m_mode(mode),
+    m_size(std::filesystem::file_size(input)),
+    m_offset(start)
+    {
+        #if __unix__
+        m_fd = open_input(input, mode, m_direct, start);
+        #else
+        m_file.open(input, std::ios::binary);
+        if(not m_file) throw std::runtime_error("[Rostam Core Error] Could not open the input file.");
+        m_file.seekg(static_cast<std::streamoff>(start));
+        #endif
+        m_blocks.reserve(std::max(depth, 2uz));
+        for(auto i = 0uz; i < std::max(depth, 2uz); ++i) m_blocks.emplace_back(block_size);
+        m_thread = std::jthread([this](const std::stop_token stop){ produce(stop); });
+    }
+
+    ~prefetch_reader() override
+    {
+        // The thread may be in the middle of a read into our buffers
+        m_thread.request_stop();
+        m_thread.join();
+        #if __unix__
+        ::close(m_fd);
+        #endif
+    }
+
+    auto next() -> std::span<const std::uint8_t> override
+    {
+        auto lock = std::unique_lock(m_mutex);
+        // The block handed out last time can be read into again
+        if(m_taken > m_released)
+        {
+            ++m_released;
+            m_changed.notify_all();
+        }
+        m_changed.wait(lock, [this]{ return m_filled > m_taken or m_done; });
+        if(m_filled > m_taken)
+        {
+            auto& block = m_blocks[m_taken++ % m_blocks.size()];
+            return block.data.span().first(block.length);
+        }
+        if(m_error) std::rethrow_exception(std::exchange(m_error, nullptr));
+        return {};
+    }
+
+    auto size() const -> std::uint64_t override
+    {
+        return m_size;
+    }
+
+    private:
+
+    struct block {
+        explicit block(const std::size_t size): data(size) {}
+        aligned_buffer data;
+        std::uint64_t offset = 0;
+        std::size_t length = 0;
+    };
+
+    // The reading thread. Blocks are filled in the same order next() hands them out.
+    auto produce(const std::stop_token stop) -> void
+    {
+        trace_thread_name("prefetch");
+        auto lock = std::unique_lock(m_mutex);
+        try
+        {
+            while(m_changed.wait(lock, stop, [this]{ return m_filled - m_released < m_blocks.size(); }))
+            {
+                auto& block = m_blocks[m_filled % m_blocks.size()];
+                lock.unlock();
+                const auto zone = trace_zone("read ahead");
+                #if __unix__
+                // The parser is done with what this buffer had before
+                if(m_mode != cache_mode::CACHED and not m_direct) drop_behind(m_fd, block.offset, block.length);
+                block.offset = m_offset;
+                block.length = read_at(m_fd, block.data.span(), m_offset, m_size, m_direct);
+                #else
+                block.offset = m_offset;
+                m_file.read(reinterpret_cast<char*>(block.data.span().data()), block.data.span().size());
+                block.length = m_file.gcount();
+                #endif
+                m_offset += block.length;
+                lock.lock();
+                if(block.length == 0) break;
+                ++m_filled;
+                m_changed.notify_all();
+            }
+        }
+        catch(...)
+        {
+            if(not lock.owns_lock()) lock.lock();
+            m_error = std::current_exception();
+        }
+        m_done = true;
+        m_changed.notify_all();
+    }
+
+    cache_mode m_mode;
+    int m_fd = -1;
+    bool m_direct = false;
+    std::ifstream m_file; // Only used where there is no fd
+    std::uint64_t m_size;
+    std::uint64_t m_offset; // Only touched by the reading thread
+    std::vector<block> m_blocks;
+    std::mutex m_mutex;
+    std::condition_variable_any m_changed;
+    std::uint64_t m_filled = 0; // Blocks the thread has read
+    std::uint64_t m_taken = 0; // Blocks next() has handed out
+    std::uint64_t m_released = 0; // Blocks the parser is done with
+    bool m_done = false;
+    std::exception_ptr m_error;
+    std::jthread m_thread;
+};
+
+// Keeps `depth` reads of the recording in flight through io_uring, so the disk is already busy
+// with the next blocks while the parser works on the current one.
+export class uring_reader
+:public ts_reader
+{
+    public:
+
+    uring_reader(const std::filesystem::path& input, const std::size_t block_size, const std::size_t depth, const cache_mode mode, uring_queue& queue, const std::uint64_t start = 0):
+    m_queue(queue),
+    m_mode(mode),
+    m_size(std::filesystem::file_size(input)),
+    m_next_offset(start)
+    {
+        #if __unix__
+        m_fd = open_input(input, mode, m_direct, start);
+        #endif
+        if(m_fd < 0) throw std::runtime_error("[Rostam Core Error] Could not open the input file.");
+        m_blocks.reserve(std::max(depth, 2uz));
+        for(auto i = 0uz; i < std::max(depth, 2uz); ++i) submit(m_blocks.emplace_back(block_size));
+    }
+
+    ~uring_reader() override
+    {
+        // The kernel may still be writing into our buffers
+        for(auto& block : m_blocks) if(block.req.pending) m_queue.wait(block.req);
+        #if __unix__
+        if(m_fd >= 0) ::close(m_fd);
+        #endif
+    }
+
+    auto next() -> std::span<const std::uint8_t> override
+    {
+        // The block handed out last time is free again, queue the next read into it.
+        if(m_returned)
+        {
+            #if __unix__
+            if(m_mode != cache_mode::CACHED and not m_direct) drop_behind(m_fd, m_returned->offset, m_returned->length);
+            #endif
+            submit(*m_returned);
+        }
+        auto& block = m_blocks[m_head];
+        m_head = (m_head + 1) % m_blocks.size();
+        m_returned = &block;
+
+        if(not block.req.pending and block.length == 0) return {}; // past the end
+        auto result = m_queue.wait(block.req);
+        #if __unix__
+        if(result == -EINVAL and block.direct)
+        {
+            // O_DIRECT was accepted by open() but not by the filesystem. Finish this block below without it. The
+            // blocks that were already in flight with it fail the same way after the first one turned it off.
+            if(m_direct) disable_direct(m_fd);
+            m_direct = false;
+            result = 0;
+        }
+        #endif
+        if(result < 0) throw std::system_error(-result, std::system_category(), "[Rostam Core Error] Reading the input failed");
+        auto read = std::min(static_cast<std::size_t>(result), block.length);
+        // Short reads only happen at the end of regular files but be nice and finish the block anyway
+        while(read < block.length)
+        {
+            const auto rest = pread_some(block.data.span().subspan(read, block.length - read), block.offset + read, block.direct);
+            if(rest == 0) break;
+            read += rest;
+        }
+        return block.data.span().first(read);
+    }
+
+    auto size() const -> std::uint64_t override
+    {
+        return m_size;
+    }
+
+    private:
+
+    struct block {
+        explicit block(const std::size_t size): data(size) {}
+        aligned_buffer data;
+        std::uint64_t offset = 0;
+        std::size_t length = 0;
+        bool direct = false; // Read with O_DIRECT
+        uring_queue::request req;
+    };
+
+    auto submit(block& b) -> void
+    {
+        const auto capacity = b.data.span().size();
+        b.offset = m_next_offset;
+        b.length = m_next_offset < m_size? std::min<std::uint64_t>(capacity, m_size - m_next_offset) : 0;
+        m_next_offset += b.length;
+        if(b.length == 0) return;
+        // With O_DIRECT the last block is read with an aligned length, the kernel stops at the end of the file
+        #if __unix__
+        b.direct = m_direct;
+        const auto length = m_direct? std::min(round_up(b.length), capacity) : b.length;
+        #else
+        const auto length = b.length;
+        #endif
+        m_queue.read(m_fd, b.data.span().first(length), b.offset, b.req);
+        m_queue.submit();
+    }
+
+    // `direct` is whether the block was read with O_DIRECT
+    auto pread_some([[maybe_unused]] const std::span<std::uint8_t> buffer, [[maybe_unused]] const std::uint64_t offset, [[maybe_unused]] const bool direct) -> std::size_t
+    {
+        #if __unix__
+        if(direct and m_direct)
+        {
+            // The rest of a short O_DIRECT read is not aligned anymore
+            disable_direct(m_fd);
+            m_direct = false;
+        }
+        auto result = ::pread(m_fd, buffer.data(), buffer.size(), static_cast<off_t>(offset));
+        while(result < 0 and errno == EINTR) result = ::pread(m_fd, buffer.data(), buffer.size(), static_cast<off_t>(offset));
+        if(result < 0) throw std::system_error(errno, std::system_category(), "[Rostam Core Error] Reading the input failed");
+        return static_cast<std::size_t>(result);
+        #else
+        return 0;
+        #endif
+    }
+
+    uring_queue& m_queue;
+    cache_mode m_mode;
+    int m_fd = -1;
+    bool m_direct = false;
+    std::uint64_t m_size;
+    std::uint64_t m_next_offset = 0;
+    std::vector<block> m_blocks;
+    std::size_t m_head = 0;
+    block* m_returned = nullptr;
+};
+
+// Reads a recording that is still being written. At the end of what is there it waits for more, until `growing` says
+// the writer is done or nothing was added for `timeout`. While it grows only whole packets are handed out, the rest
+// of the last one is read again with the next block. After a timeout it ends at the last whole packet.
+export class growing_reader
+:public ts_reader
+{
+    public:
+
+    growing_reader(const std::filesystem::path& input, const std::size_t block_size, std::function<bool()> growing, const std::chrono::milliseconds timeout, const std::uint64_t start = 0):
+    m_input(input),
+    m_file(input, std::ios::binary),
+    m_growing(std::move(growing)),
+    m_timeout(timeout),
+    m_offset(start),
+    m_buffer(block_size)
+    {
+        if(not m_file) throw std::runtime_error("[Rostam Core Error] Could not open the input file.");
+    }
+
+    auto next() -> std::span<const std::uint8_t> override
+    {
+        auto idle_since = std::chrono::steady_clock::now();
+        while(true)
+        {
+            // The end of the file moves, a stream that hit it once has to be told to look again
+            m_file.clear();
+            m_file.seekg(static_cast<std::streamoff>(m_offset));
+            m_file.read(reinterpret_cast<char*>(m_buffer.data()), m_buffer.size());
+            auto read = static_cast<std::size_t>(m_file.gcount());
+            if(not m_done) read -= read % TS_PACKET_SIZE;
+            if(read > 0 or m_done)
+            {
+                m_offset += read;
+                return std::span(m_buffer).first(read);
+            }
+            // One more read after the writer is done, for what is left of the last packet
+            if(not m_growing()) m_done = true;
+            else if(std::chrono::steady_clock::now() - idle_since >= m_timeout)
+            {
+                m_timed_out = true;
+                return {};
+            }
+            else std::this_thread::sleep_for(POLL_INTERVAL);
+        }
+    }
+
+    // What is there so far
+    auto size() const -> std::uint64_t override
+    {
+        auto error = std::error_code();
+        const auto size = std::filesystem::file_size(m_input, error);
+        return error? m_offset : std::max<std::uint64_t>(size, m_offset);
+    }
+
+    auto timed_out() const -> bool override
+    {
+        return m_timed_out;
+    }
+
+    private:
+
+    constexpr static auto POLL_INTERVAL = std::chrono::milliseconds(200);
+    std::filesystem::path m_input;
+    std::ifstream m_file;
+    std::function<bool()> m_growing;
+    std::chrono::milliseconds m_timeout;
+    std::uint64_t m_offset;
+    bool m_done = false;
+    bool m_timed_out = false;
+    std::vector<std::uint8_t> m_buffer;
+};
+
+export struct reader_options {
+    std::size_t block_size = TS_PACKET_SIZE * 2048; // ~376 KiB, a whole number of packets
+    std::size_t depth = 4; // reads in flight for the io_uring reader, blocks read ahead by the prefetch thread
+    // Without io_uring, read on a separate thread so the disk and the parser work at the same time
+    bool prefetch = true;
+    // The block size is a multiple of DIRECT_IO_ALIGNMENT too so DIRECT works without bounce buffers.
+    cache_mode cache = cache_mode::DROP_BEHIND;
+    // Set for a recording that is still being written. At its end the reader waits for more while this returns true,
+    // or until nothing was added for growing_timeout. After a timeout the extraction keeps its checkpoint.
+    std::function<bool()> growing;
+    std::chrono::milliseconds growing_timeout = std::chrono::minutes(2);
+};
+
+// Follows a growing recording if it is one. Otherwise picks the io_uring reader when we have a queue, the prefetching one or a synchronous one otherwise. Reading starts at byte `start`.
+export auto open_reader(const std::filesystem::path& input, const reader_options& options, uring_queue* queue, const std::uint64_t start = 0) -> std::unique_ptr<ts_reader>
+{
+    if(options.growing) return std::make_unique<growing_reader>(input, options.block_size, options.growing, options.growing_timeout, start);
+    if(queue) return std::make_unique<uring_reader>(input, options.block_size, options.depth, options.cache, *queue, start);
+    if(options.prefetch) return std::make_unique<prefetch_reader>(input, options.block_size, options.depth, options.cache, start);
+    #if __unix__
+    if(options.cache != cache_mode::CACHED) return std::make_unique<pread_reader>(input, options.block_size, options.cache, start);
+    #endif
+    return std::make_unique<stream_reader>(input, options.block_size, start);
+}
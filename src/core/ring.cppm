@@ -0,0 +1,375 @@
+module;
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#if __linux__
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <ctime>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+export module rostam_ring;
+import rostam_reader;
+
+// A capture process hands its TS packets to the extraction through a ring buffer in POSIX shared memory, so a live
+// extraction never goes through the disk. The capture is the producer (ring_producer), it creates the ring and writes
+// what it receives. The extraction is the consumer (ring_reader), it parses the packets right where they are in the
+// ring and only hands the space back once it's done with them. Either side sleeps on a futex in the ring while the
+// other one has nothing for it. Linux only.
+
+// The first page of the shared memory, the packets follow it. Both processes see the same bytes, so everything here
+// has a fixed layout and the counters are lock free atomics.
+struct ring_header {
+    constexpr static std::uint64_t MAGIC = 0x474E4952'4D545352; // "RSTMRING"
+    constexpr static std::uint32_t VERSION = 1;
+
+    std::uint64_t magic = 0; // Written last by the producer, the ring is ready once it's there
+    std::uint32_t version = VERSION;
+    std::int32_t producer = 0; // pid, the consumer stops waiting when it's gone
+    std::uint64_t capacity = 0; // Bytes of packets, a multiple of TS_PACKET_SIZE
+    // Bytes written and read since the ring was created. They only grow, the position in the ring is them % capacity.
+    alignas(64) std::atomic<std::uint64_t> written = 0;
+    std::atomic<std::uint32_t> data_changed = 0; // Futex the consumer sleeps on, bumped with every write and at close
+    std::atomic<std::uint32_t> consumer_waiting = 0;
+    std::atomic<std::uint32_t> closed = 0;
+    alignas(64) std::atomic<std::uint64_t> read = 0;
+    std::atomic<std::uint32_t> space_changed = 0; // Futex the producer sleeps on, bumped whenever space is handed back
+    std::atomic<std::uint32_t> producer_waiting = 0;
+};
+constexpr auto RING_HEADER_SIZE = 4096uz;
+static_assert(sizeof(ring_header) <= RING_HEADER_SIZE);
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free and std::atomic<std::uint32_t>::is_always_lock_free);
+
+#if __linux__
+// Sleeps while `word` is still `expected`, at most `timeout`. Not FUTEX_PRIVATE, the other side is another process.
+auto futex_wait(std::atomic<std::uint32_t>& word, const std::uint32_t expected, const std::chrono::milliseconds timeout) -> void
+{
+    const auto seconds = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+    const auto time = timespec{static_cast<time_t>(seconds.count()), static_cast<long>(std::chrono::nanoseconds(timeout - seconds).count())};
+    ::syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAIT, expected, &time, nullptr, 0);
+}
+
+// Bumps `word` and wakes the other side if it's sleeping on it. Together with the waiting flag, which the sleeper
+// sets before it looks at `word`, either the sleeper sees the new value or we see the flag.
+auto futex_wake(std::atomic<std::uint32_t>& word, const std::atomic<std::uint32_t>& waiting) -> void
+{
+    word.fetch_add(1);
+    if(waiting.load()) ::syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+// The shared memory of a ring, mapped
+class ring_mapping
+{
+    public:
+
+    ring_mapping() = default;
+
+    ring_mapping(const int fd, const std::size_t size):
+    m_size(size)
+    {
+        const auto data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(data == MAP_FAILED) throw std::runtime_error("[Rostam Core Error] Could not map the shared memory ring.");
+        m_data = static_cast<std::uint8_t*>(data);
+    }
+
+    ring_mapping(ring_mapping&& other) noexcept:
+    m_data(std::exchange(other.m_data, nullptr)),
+    m_size(std::exchange(other.m_size, 0))
+    {
+    }
+
+    auto operator=(ring_mapping&& other) noexcept -> ring_mapping&
+    {
+        std::swap(m_data, other.m_data);
+        std::swap(m_size, other.m_size);
+        return *this;
+    }
+
+    ~ring_mapping()
+    {
+        if(m_data) ::munmap(m_data, m_size);
+    }
+
+    auto header() const -> ring_header&
+    {
+        return *std::launder(reinterpret_cast<ring_header*>(m_data));
+    }
+
+    auto packets() const -> std::span<std::uint8_t>
+    {
+        return {m_data + RING_HEADER_SIZE, m_size - RING_HEADER_SIZE};
+    }
+
+    private:
+
+    std::uint8_t* m_data = nullptr;
+    std::size_t m_size = 0;
+};
+#endif
+
+// Creates the ring `name` ("/something", like shm_open wants it) with room for `capacity` bytes of packets and writes
+// to it. The ring goes away with the producer, keep it until drained() says the consumer got everything.
+export class ring_producer
+{
+    public:
+
+    ring_producer(const std::string& name, [[maybe_unused]] const std::size_t capacity):
+    m_name(name)
+    {
+        #if __linux__
+        const auto packets = std::max<std::size_t>((capacity + TS_PACKET_SIZE - 1) / TS_PACKET_SIZE, 1);
+        const auto size = RING_HEADER_SIZE + packets * TS_PACKET_SIZE;
+        m_fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if(m_fd < 0) throw std::runtime_error("[Rostam Core Error] Could not create the shared memory ring " + name + ": " + std::strerror(errno));
+        if(::ftruncate(m_fd, static_cast<off_t>(size)) != 0)
+        {
+            release();
+            throw std::runtime_error("[Rostam Core Error] Could not size the shared memory ring.");
+        }
+        try
+        {
+            m_mapping = ring_mapping(m_fd, size);
+        }
+        catch(...)
+        {
+            release();
+            throw;
+        }
+        auto& header = *new(&m_mapping.header()) ring_header();
+        header.producer = ::getpid();
+        header.capacity = packets * TS_PACKET_SIZE;
+        std::atomic_ref(header.magic).store(ring_header::MAGIC, std::memory_order_release);
+        #else
+        throw std::runtime_error("[Rostam Core Error] Shared memory rings need Linux.");
+        #endif
+    }
+
+    ring_producer(const ring_producer&) = delete;
+    auto operator=(const ring_producer&) -> ring_producer& = delete;
+
+    ~ring_producer()
+    {
+        #if __linux__
+        close();
+        release();
+        #endif
+    }
+
+    // Where the consumer opens the ring (POSIX shared memory is a file in /dev/shm on Linux)
+    auto path() const -> std::filesystem::path
+    {
+        return std::filesystem::path("/dev/shm") / m_name.substr(m_name.find_first_not_of('/'));
+    }
+
+    // Copies `data` into the ring, waits for the consumer while it's full. Whole packets are best, the consumer only
+    // takes whole packets until the ring is closed.
+    auto write([[maybe_unused]] std::span<const std::uint8_t> data) -> void
+    {
+        #if __linux__
+        auto& header = m_mapping.header();
+        const auto ring = m_mapping.packets().first(header.capacity);
+        while(not data.empty())
+        {
+            const auto written = header.written.load(std::memory_order_relaxed);
+            const auto free = header.capacity - (written - header.read.load(std::memory_order_acquire));
+            if(free == 0)
+            {
+                wait_for_space(written);
+                continue;
+            }
+            // Up to the end of the ring, the rest goes to its start in the next round
+            const auto position = written % header.capacity;
+            const auto size = std::min({data.size(), free, header.capacity - position});
+            std::ranges::copy(data.first(size), ring.begin() + position);
+            header.written.store(written + size, std::memory_order_release);
+            futex_wake(header.data_changed, header.consumer_waiting);
+            data = data.subspan(size);
+        }
+        #endif
+    }
+
+    // No more packets, the consumer ends its extraction once it read what is in the ring
+    auto close() -> void
+    {
+        #if __linux__
+        auto& header = m_mapping.header();
+        if(header.closed.exchange(1) == 0) futex_wake(header.data_changed, header.consumer_waiting);
+        #endif
+    }
+
+    // Everything written was read
+    auto drained() const -> bool
+    {
+        #if __linux__
+        const auto& header = m_mapping.header();
+        return header.read.load(std::memory_order_acquire) == header.written.load(std::memory_order_relaxed);
+        #else
+        return true;
+        #endif
+    }
+
+    private:
+
+    #if __linux__
+    auto wait_for_space(const std::uint64_t written) -> void
+    {
+        auto& header = m_mapping.header();
+        header.producer_waiting.store(1);
+        const auto changed = header.space_changed.load();
+        if(header.read.load() + header.capacity == written) futex_wait(header.space_changed, changed, WAIT_SLICE);
+        header.producer_waiting.store(0);
+    }
+
+    auto release() -> void
+    {
+        if(m_fd < 0) return;
+        ::close(std::exchange(m_fd, -1));
+        ::shm_unlink(m_name.c_str());
+    }
+
+    constexpr static auto WAIT_SLICE = std::chrono::milliseconds(100);
+    ring_mapping m_mapping;
+    int m_fd = -1;
+    #endif
+    std::string m_name;
+};
+
+// Reads the packets of a ring straight from the shared memory, the blocks it hands out are in the ring. The space of
+// a block goes back to the producer with the next call. The reader ends when the producer closed the ring and
+// everything was read, when the producer is gone, when nothing came for `timeout` or when `keep_waiting` says so.
+export class ring_reader
+:public ts_reader
+{
+    public:
+
+    ring_reader([[maybe_unused]] const std::filesystem::path& ring, const std::size_t block_size, std::function<bool()> keep_waiting, const std::chrono::milliseconds timeout):
+    m_block_size(block_size - block_size % TS_PACKET_SIZE),
+    m_keep_waiting(std::move(keep_waiting)),
+    m_timeout(timeout)
+    {
+        #if __linux__
+        const auto fd = ::open(ring.c_str(), O_RDWR | O_CLOEXEC);
+        if(fd < 0) throw std::runtime_error("[Rostam Core Error] Could not open the shared memory ring.");
+        struct stat status {};
+        const auto size = ::fstat(fd, &status) == 0? static_cast<std::size_t>(status.st_size) : 0uz;
+        try
+        {
+            if(size <= RING_HEADER_SIZE) throw std::runtime_error("[Rostam Core Error] Not a shared memory ring (or its producer is still setting it up).");
+            m_mapping = ring_mapping(fd, size);
+        }
+        catch(...)
+        {
+            ::close(fd);
+            throw;
+        }
+        // The mapping stays valid without the fd
+        ::close(fd);
+        auto& header = m_mapping.header();
+        if(std::atomic_ref(header.magic).load(std::memory_order_acquire) != ring_header::MAGIC or header.version != ring_header::VERSION
+            or header.capacity == 0 or header.capacity % TS_PACKET_SIZE != 0 or header.capacity > size - RING_HEADER_SIZE)
+            throw std::runtime_error("[Rostam Core Error] Not a shared memory ring (or its producer is still setting it up).");
+        // A ring that is read for the second time continues at a packet boundary
+        m_read = header.read.load(std::memory_order_acquire);
+        m_read += (TS_PACKET_SIZE - m_read % TS_PACKET_SIZE) % TS_PACKET_SIZE;
+        #else
+        throw std::runtime_error("[Rostam Core Error] Shared memory rings need Linux.");
+        #endif
+    }
+
+    ~ring_reader() override
+    {
+        #if __linux__
+        release_block();
+        #endif
+    }
+
+    auto next() -> std::span<const std::uint8_t> override
+    {
+        #if __linux__
+        release_block();
+        auto& header = m_mapping.header();
+        auto idle_since = std::chrono::steady_clock::now();
+        while(true)
+        {
+            const auto closed = header.closed.load(std::memory_order_acquire) != 0;
+            const auto written = header.written.load(std::memory_order_acquire);
+            if(written < m_read) return {}; // Only a broken producer does that
+            const auto position = m_read % header.capacity;
+            auto available = std::min({written - m_read, header.capacity - position, std::uint64_t(m_block_size)});
+            // Whole packets while the producer is there, the rest of the last one once it's done
+            if(not closed or written - m_read > available) available -= available % TS_PACKET_SIZE;
+            if(available > 0 or (closed and written == m_read))
+            {
+                m_block = available;
+                return m_mapping.packets().subspan(position, available);
+            }
+            if(closed or gone(header) or not m_keep_waiting() or std::chrono::steady_clock::now() - idle_since >= m_timeout) return {};
+            wait_for_data(written);
+        }
+        #else
+        return {};
+        #endif
+    }
+
+    // What came through the ring so far
+    auto size() const -> std::uint64_t override
+    {
+        #if __linux__
+        return m_mapping.header().written.load(std::memory_order_relaxed);
+        #else
+        return 0;
+        #endif
+    }
+
+    private:
+
+    #if __linux__
+    // The parser is done with the last block, the producer can have its space
+    auto release_block() -> void
+    {
+        if(m_block == 0) return;
+        m_read += std::exchange(m_block, 0);
+        auto& header = m_mapping.header();
+        header.read.store(m_read, std::memory_order_release);
+        futex_wake(header.space_changed, header.producer_waiting);
+    }
+
+    auto wait_for_data(const std::uint64_t written) -> void
+    {
+        auto& header = m_mapping.header();
+        header.consumer_waiting.store(1);
+        const auto changed = header.data_changed.load();
+        if(header.written.load() == written and not header.closed.load()) futex_wait(header.data_changed, changed, WAIT_SLICE);
+        header.consumer_waiting.store(0);
+    }
+
+    static auto gone(const ring_header& header) -> bool
+    {
+        return ::kill(header.producer, 0) != 0 and errno == ESRCH;
+    }
+
+    constexpr static auto WAIT_SLICE = std::chrono::milliseconds(100);
+    ring_mapping m_mapping;
+    std::uint64_t m_read = 0;
+    std::size_t m_block = 0;
+    #endif
+    std::size_t m_block_size;
+    std::function<bool()> m_keep_waiting;
+    std::chrono::milliseconds m_timeout;
+};
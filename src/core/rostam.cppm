@@ -4,19 +4,39 @@ module;
 #include <cstddef>
 #include <filesystem>
 #include <functional>
+#include <system_error>
 #include <iterator>
 #include <limits>
+#include <memory>
 #include <print>
-#include <fstream>
 #include <span>
 #include <stdexcept>
-#include <optional>
+#include <string_view>
 #include <vector>
 #include <ranges>
 #include <cstdint>
 #include <atomic>
-#include "uni_algo/ranges_conv.h"
+#include <stop_token>
+#include <utility>
 export module rostam;
+export import rostam_progress;
+import rostam_psi;
+import rostam_pes;
+import rostam_storage;
+export import rostam_reader;
+export import rostam_ring;
+import rostam_writer;
+import rostam_uring;
+import rostam_filename;
+import rostam_batch;
+import rostam_checkpoint;
+import rostam_verify;
+import rostam_quality;
+import rostam_carousel;
+export import rostam_index;
+import rostam_packet;
+export import rostam_sink;
+export import rostam_trace;
 
 // Disgusting workaround for windows. This will fully nuke std::println only on windows because for some reason, std::println throws after some time when console is disabled.
 // It's still a part of stdc++exp on windows and maybe it's still not yet ready.
@@ -31,20 +51,60 @@ namespace std {
 };
 #endif
 
+export struct extraction_options {
+    // PIDs that are always demuxed. Rostam Media has been broadcasting on 6530 so far.
+    std::vector<int> pids = {6530};
+    // Parse PAT/PMT and also demux every AC-3 elementary stream they announce, in the same pass. Off by default, in a
+    // multiplex that is every AC-3 audio track. The gui and the tools turn it on.
+    bool discover_pids = false;
+    // Reserve the declared size of every file on disk before writing it (fallocate on Linux, where the filesystem supports it)
+    bool preallocate = true;
+    // Read the recording and write the files through io_uring when it was compiled in and the kernel lets us.
+    // Falls back to the portable std::ifstream/std::ofstream path otherwise.
+    bool io_uring = true;
+    reader_options reader;
+    // Files up to this size are kept in memory and written out in batches, 0 turns it off.
+    std::size_t small_file_limit = 256 << 10;
+    // A batch is written out once it holds this many bytes
+    std::size_t small_file_batch = 8 << 20;
+    // Save where the extraction is to a checkpoint in the output directory after this many bytes of the recording,
+    // and when it's cancelled. 0 turns checkpoints off.
+    std::uint64_t checkpoint_interval = 256ull << 20;
+    // Continue from the checkpoint if the output directory has one for this recording
+    bool resume = true;
+    // Check the structure of completed files (MP4, ZIP, JPEG, PNG, MKV) on a few worker threads and only rename the
+    // ones that pass. The others are kept as <name>.broken.
+    bool verify = false;
+    std::size_t verify_threads = 2;
+    // A new copy of a file that is already in the output directory only replaces it if it lost no more packets (and
+    // verified no worse) than the one that's there. How every file came through is kept in <output>/.rostam-files.
+    bool keep_better_copies = true;
+    // Give the disk space of the recording back while it's extracted and remove it once it's done. The space is released
+    // after every checkpoint, a cancelled extraction can only be continued from its checkpoint. Without checkpoints
+    // (or with a sink) the recording is only removed at the end. When stop_after_cycle ends the extraction early, the
+    // part that wasn't read stays.
+    bool release_input = false;
+    // Also write the packets the extraction looks at (the demuxed PIDs and PAT/PMT) to this file, empty for none.
+    // It's a regular TS, a small part of the recording, that extracts to the same files. Keep it instead of the recording.
+    std::filesystem::path archive;
+    // Stop once the carousel has gone round and every file in it came through without losses, instead of reading the
+    // rest of the recording for copies of them. A resumed extraction has to see the carousel go round again.
+    bool stop_after_cycle = false;
+    // Hand the files to this instead of writing them to the output directory (which isn't touched then). Checkpoints,
+    // resuming, verification, the small file batch and keeping the better copy only apply to the output directory.
+    std::shared_ptr<output_sink> sink;
+    // A file that can't be written (its output file can't be opened, there isn't enough space for it, writing it
+    // fails or it can't be renamed once it's complete) is skipped and the extraction goes on with the next one. What was written of it stays as its .part.
+    // Otherwise the extraction stops with an exception.
+    bool resilient = true;
+    // `input` is the shared memory ring of a capture process (see rostam_ring), not a recording. The packets are parsed
+    // in the ring until the capture closes it, nothing goes through the disk. A ring can't be resumed or released,
+    // so there are no checkpoints. reader.growing_timeout is how long it waits for a capture that stopped sending.
+    bool shared_memory = false;
+};
+
 export class rostam{
     ////////////
-    struct TSHeader {
-        bool syncByte = true;
-        bool TEI = false; // Transport Error Indicator
-        int PID = 0;
-        int TSC = 0;
-        int AFC = 0;
-        int  CC = 0;
-        bool hasPayload = 0;
-        int payloadOffset = 0;
-        int payloadLength = 0;
-        std::span<const int> payload;
-    };
     struct EQHeader{
         int version=0;
         int flags=0;
@@ -57,44 +117,92 @@ export class rostam{
         READING_FILENAME = 2, // Done reading header, now reading filename
         READING_FILE = 3 // Done reading filename, now reading file
     };
+    // One file that is being received. They live in a small flat table (m_contexts) and a free slot is one that is
+    // SEARCHING_FOR_HEADER, so a new transmission can start on a PID while the previous one is still open.
+    struct file_context {
+        int pid = 0;
+        STATE state = STATE::SEARCHING_FOR_HEADER;
+        EQHeader eQHeader;
+        std::vector<unsigned char> buffer; // Data of a small file (in_memory). Keeps its capacity between files.
+        std::array<std::uint8_t, 18> currentEQHeader {}; // The header without the magic bytes
+        std::array<std::uint8_t, MAX_FILENAME_LENGTH> raw_filename {}; // The filename as it was received
+        std::size_t currentEQHeaderBytesRead = 0;
+        file_writer output_file;
+        std::string filename;
+        std::array<char, MAX_FILENAME_LENGTH + 6> part_name {}; // <filename>.part, NUL terminated for openat
+        std::size_t bufferLength = 0; // How much of the filename was received
+        std::size_t file_data_read = 0;
+        bool in_memory = false; // Small file, the data is collected in `buffer` and goes to the batch when it's done
+        bool to_sink = false; // The data goes to extraction_options::sink, the context's index is its id there
+        std::uint64_t losses = 0; // Packets that went missing on the PID while this file was received
+        content_hash hash; // Of what was written to output_file, only with extraction_options::keep_better_copies
+        int interrupted = -1; // The context that was receiving data when the magic bytes of this one showed up
+        std::size_t magic_written = 0; // How many of the magic bytes went to `interrupted` as data before they were recognized
+        recording_index::file indexed; // Where the data is in the recording, only while indexing
+    };
+    // Every demuxed PID has its own magic byte search and points at the context that currently receives its payload.
+    struct eqsat_stream {
+        int pid = 0;
+        std::size_t previousPacketMagicBytePatternIndex = 0;
+        int active = -1;
+        int continuity = -1; // Continuity counter of the last packet with a payload
+        int transport_errors = 0; // Packets with the transport_error_indicator since that one, they were counted as losses
+        pes_reassembler pes;
+    };
     ////////////
 
     public:
 
-    rostam(const std::function<void (int)> progress_callback = nullptr):
-    m_state(STATE::SEARCHING_FOR_HEADER),
-    currentEQHeaderBytesRead(0),
-    previousPacketMagicBytePatternIndex(0),
-    bufferLength(0),
-    m_file_data_read(0),
+    // A header that was skipped, a false magic byte match or a file that couldn't be written
+    struct skipped_header {
+        std::uint64_t offset = 0; // Of the TS packet in which the header was complete. For a small file that couldn't be
+                                  // written, of the packet the extraction was at when its batch was written. For a
+                                  // verified file that couldn't be renamed, when the extraction waited for the verifier.
+        int pid = 0;
+        std::string reason;
+        std::array<std::uint8_t, 30> raw {}; // Magic bytes and header as they were received, zero for small files
+    };
+
+    rostam(extraction_options options = {}):
+    m_options(std::move(options)),
     m_cancel_flag(false),
     m_debug(true),
-    m_progress_callback(progress_callback)
+    m_keeper(m_output_directory, m_options.keep_better_copies),
+    m_verifier(m_output_directory, m_keeper, m_options.verify_threads),
+    m_small_files(m_output_directory, m_options.small_file_batch, m_keeper, m_options.verify? &m_verifier : nullptr, m_options.resilient,
+        [this](const std::string_view name, const int pid, std::string reason){ skip_small_file(name, pid, std::move(reason)); })
     {
-        
+        setup_pids();
     }
     
-    void extract (const std::filesystem::path& input, const std::filesystem::path& output)
+    // Does nothing. The default progress callback of extract().
+    struct ignore_progress {
+        constexpr auto operator()(std::uint64_t, std::uint64_t) const noexcept -> void {}
+    };
+
+    // Extracts everything in `input` to `output` until the end of the input or until `stop` (or request_cancel) asks it
+    // to stop. on_progress(bytes_processed, bytes_total) runs on the extracting thread. Both are looked at every
+    // POLL_PACKETS packets, so how quickly they react doesn't depend on the reader's block size. on_progress is a
+    // template parameter and gets inlined, the default one costs nothing.
+    template <class F = ignore_progress>
+    void extract (const std::filesystem::path& input, const std::filesystem::path& output, const std::stop_token stop = {}, F&& on_progress = {})
     {
-        constexpr static auto ts_packet_size = 188uz;
-        if(m_cancel_flag) reset_state(true);
-        m_output_path = output;
-        const auto input_ts_size = std::filesystem::file_size(input);
-        std::ifstream input_ts_file (input,std::ios::binary);
-        std::array <int,ts_packet_size*20> input_chunk; //lets get 20 packets at once
-        for(auto i = 0uz ; i < input_ts_size / (ts_packet_size*20) ; i++)
-        {
-            std::ranges::generate (input_chunk,[&input_ts_file]{return input_ts_file.get();});
-            std::ranges::for_each(input_chunk|std::views::chunk(ts_packet_size),std::bind_front(
-                &rostam::parse_ts_packets,this));
-            if(i%20 == 0)
-            {
-                // get percent value and force it to be 99 after the extraction we call the callback with 100.
-                if(m_progress_callback)m_progress_callback(std::min<int>(i*100/(input_ts_size / (ts_packet_size*20)),99));
-            }
-            if(m_cancel_flag) break; // This will cancel the extraction operation upon request.
+        // The gui waits for the progress to finish, it has to even when the extraction throws
+        try
+        {
+            extract_recording(input, output, stop, on_progress);
+        }
+        catch(const std::exception& error)
+        {
+            m_progress.finish(m_cancel_flag, error.what());
+            throw;
+        }
+        catch(...)
+        {
+            m_progress.finish(m_cancel_flag, "Unknown error");
+            throw;
         }
-        if(m_progress_callback)m_progress_callback(100);
+        m_progress.finish(m_cancel_flag);
     }
 
     void request_cancel ()
@@ -107,174 +215,526 @@ export class rostam{
         return m_cancel_flag;
     }
 
-    private:
-
-    auto reset_state(const bool no_log = true) -> void
+    // Finds the files in `input` without extracting anything. The index says where in the recording the data of every
+    // complete file is, a recording_reader reads them from there.
+    auto index(const std::filesystem::path& input, const std::stop_token stop = {}) -> recording_index
     {
-        if(m_debug) std::println("Reset Called");
-        if(m_current_output_file) m_current_output_file.close();
-        if(!no_log) 
+        auto result = recording_index();
+        reset_state(true);
+        setup_pids();
+        m_skipped_headers.clear();
+        m_skipped_header_count = 0;
+        m_index = &result;
+        const auto zone = trace_zone("index");
+        try
         {
-           std::println("Scanning for files to extract...");
+            const auto reader = open_reader(input, m_options.reader, nullptr);
+            auto bytes_processed = 0ull;
+            for(auto block = reader->next(); not block.empty() and not stop.stop_requested(); block = reader->next())
+            {
+                const auto packets_end = block.size() - block.size() % TS_PACKET_SIZE;
+                for(auto offset = 0uz; offset < packets_end; offset += POLL_PACKETS * TS_PACKET_SIZE)
+                {
+                    const auto run = std::min(packets_end - offset, POLL_PACKETS * TS_PACKET_SIZE);
+                    parse_packets(block.subspan(offset, run), bytes_processed + offset);
+                }
+                bytes_processed += block.size();
+            }
         }
-        m_state = rostam::STATE::SEARCHING_FOR_HEADER;
-        this->eQHeader = {0,0,0,0};
-        m_buffer.erase(m_buffer.begin(),m_buffer.end());
-        this->bufferLength = 0; // How much has been read into the buffer
-        this->filename.erase(0); // Filename of current file being extracted (if any)
-        // this.fileData = []; // Data that has been read for current file. Array of Uint8Arrays (I think its never used)
-        m_file_data_read = 0uz; // How much file data has been read so far
-        currentEQHeader.erase(currentEQHeader.begin(),currentEQHeader.end());
-        currentEQHeaderBytesRead = 0;
-        previousPacketMagicBytePatternIndex = 0;
-        m_cancel_flag.store(false);
+        catch(...)
+        {
+            m_index = nullptr;
+            reset_state(true);
+            throw;
+        }
+        m_index = nullptr;
+        m_packet = {};
+        // The next extraction starts from scratch, not with what was discovered here
+        reset_state(true);
+        setup_pids();
+        return result;
     }
 
-    auto parseEQHeader(const std::span<const int> eq_header) const -> EQHeader //OK, Works properly
+    // The first MAX_SKIPPED_HEADERS headers the last extraction skipped, skipped_header_count() has all of them
+    auto skipped_headers() const -> std::span<const skipped_header>
     {
-        // this was from the js file this.currentEQHeader = Buffer.alloc(EQSAT_HEADER_SIZE_WITHOUT_MAGIC_BYTES);
-        // which then will be passed to this function. buffer is part of the Buffer from nodejs.
-        // std::println("parseEQheader called");
-        const auto bytes_to_uint64 = [](const std::span<const int> byte_span, const std::size_t offset){
-            const static auto shift_left_full64 = 56;
-            auto value = std::uint64_t();
-            for(int i = 0; i < 8; ++i) 
-            {
-                value = (value >> 8) | (static_cast<std::uint64_t>(byte_span[i+offset]) << shift_left_full64);
-                // std::print("{:X} - ",buffer[i + offset]);
-            }
-            // std::println("\n-> so the value is: 0x{0:X} ({0})",value);
-            return value;
-        };
+        return m_skipped_headers;
+    }
 
-        return {
-            eq_header[0], // The first 12 bytes are the magic bytes
-            eq_header[1], // flags
-            bytes_to_uint64(eq_header,2),
-            bytes_to_uint64(eq_header,10) 
-        };
+    auto skipped_header_count() const -> std::uint64_t
+    {
+        return m_skipped_header_count;
     }
 
-    auto getPESAndAC3HeaderSize(const std::span<const int> packet, const TSHeader& header) const -> std::size_t
+    // Turns extraction_options::release_input on or off for the next extraction
+    void set_release_input (const bool release)
     {
-        const auto payloadSize = header.payloadLength;
-        
-        // TODO
-        // Note that we are cheating here.
-        // PES headers don't have to be aligned with the start of the MPEG-TS packet payloads
-        // but in the streams we generate with ffmpeg they are always aligned
-        if(payloadSize < 6) return 0;
-        
-        const auto offset = header.payloadOffset;
-        
-        // Check for PES start code prefix
-        if(packet[offset] == 0x00 and packet[offset+1] == 0x00 and packet[offset+2] == 0x01) 
+        m_options.release_input = release;
+    }
+
+    // Turns extraction_options::discover_pids on or off for the next extraction
+    void set_discover_pids (const bool discover)
+    {
+        m_options.discover_pids = discover;
+    }
+
+    // Turns extraction_options::stop_after_cycle on or off for the next extraction
+    void set_stop_after_cycle (const bool stop)
+    {
+        m_options.stop_after_cycle = stop;
+    }
+
+    auto progress () -> extraction_progress&
+    {
+        return m_progress;
+    }
+
+    private:
+
+    template <class F>
+    auto extract_recording(const std::filesystem::path& input, const std::filesystem::path& output, const std::stop_token stop, F& on_progress) -> void
+    {
+        const auto zone = trace_zone("extract");
+        if(m_cancel_flag) reset_state(true);
+        // The hot loop only looks at one flag, whichever way the cancellation comes in
+        const auto on_stop = std::stop_callback(stop, [this]{ m_cancel_flag.store(true, std::memory_order_relaxed); });
+        m_output_path = output;
+        m_small_files.flush();
+        m_verifier.wait();
+        if(not m_options.sink)
+        {
+            m_output_directory.open(output);
+            m_keeper.load();
+        }
+        m_carousel.clear();
+        m_verifier.report_passed(m_options.stop_after_cycle);
+        m_cycle_complete = false;
+        m_skipped_headers.clear();
+        m_skipped_header_count = 0;
+        if(m_options.io_uring and not m_uring)
+        {
+            m_uring = uring_queue::create();
+            if(not m_uring and m_debug) std::println("io_uring is not available. Using the portable reader and writer.");
+        }
+        // How far a file that starts can get at most. A recording that is still being written has no end yet.
+        auto size_error = std::error_code();
+        const auto input_size = m_options.shared_memory or m_options.reader.growing? 0 : std::filesystem::file_size(input, size_error);
+        m_input_end = m_options.shared_memory or m_options.reader.growing or size_error? std::numeric_limits<std::uint64_t>::max() : input_size;
+        m_packet_offset = 0;
+        // A sink or a ring has nothing to continue from
+        const auto resumable = not m_options.sink and not m_options.shared_memory;
+        const auto checkpoints = resumable? m_options.checkpoint_interval : 0;
+        auto bytes_processed = m_options.resume and resumable? resume(input) : 0ull;
+        auto reader = m_options.shared_memory? open_ring(input) : open_reader(input, reader_settings(), m_uring.get(), bytes_processed);
+        open_archive(input, bytes_processed > 0);
+        m_progress.start(reader->size(), bytes_processed);
+        auto released = storage::input_releaser();
+        const auto release_input = m_options.release_input and not m_options.shared_memory;
+        if(release_input and checkpoints > 0 and not released.open(input))
+            std::println("Can't release the disk space of {} while extracting it. It's removed once it's done.", input.string());
+        auto next_checkpoint = bytes_processed + checkpoints;
+        const auto bytes_total = reader->size();
+        const auto next_block = [&reader]{ const auto zone = trace_zone("read"); return reader->next(); };
+        for(auto block = next_block(); not block.empty(); block = next_block())
         {
-            // This is the PES Stream ID used for DVB type AC-3 streams
-            if(const auto stream_id = packet[offset + 3]; 
-            stream_id != 0xbd) 
+            // Readers only hand out whole packets. A truncated packet at the very end is ignored.
+            const auto packets_end = block.size() - block.size() % TS_PACKET_SIZE;
+            auto offset = 0uz;
+            while(offset < packets_end and not m_cancel_flag.load(std::memory_order_relaxed) and not m_cycle_complete)
             {
-                return 0;
+                const auto poll_at = std::min(packets_end, offset + POLL_PACKETS * TS_PACKET_SIZE);
+                parse_packets(block.subspan(offset, poll_at - offset), bytes_processed + offset);
+                offset = poll_at;
+                // Just a relaxed atomic store. The gui polls it whenever it draws a frame.
+                m_progress.set_bytes_processed(bytes_processed + offset);
+                on_progress(bytes_processed + offset, bytes_total);
             }
-    
-            // Audio streams have at least 9 bytes of header
-            if(payloadSize < 9) 
+            // A cancelled block stops at a packet boundary, that's where a resumed extraction continues
+            bytes_processed += offset == packets_end? block.size() : offset;
+            m_progress.set_bytes_processed(bytes_processed);
+            if(checkpoints > 0 and bytes_processed >= next_checkpoint)
             {
-                return 0;
+                const auto zone = trace_zone("checkpoint");
+                save_state(input, bytes_processed);
+                // Everything before the checkpoint is on disk, a resumed extraction never reads it again
+                if(released.is_open() and not released.release(bytes_processed))
+                    std::println("The filesystem doesn't release parts of a file. {} is removed once it's done.", input.string());
+                next_checkpoint = bytes_processed + checkpoints;
             }
-            
-            // How many more bytes of optional PES header are still left
-            const auto pesHeaderLeft = packet[offset + 8];
-            const auto pesHeaderSize = 9 + pesHeaderLeft;
-            
-            if(pesHeaderSize > payloadSize) 
-            {
-                return 0;
-            } 
-            else 
+            if(m_cancel_flag) break; // This will cancel the extraction operation upon request.
+            if(m_cycle_complete)
             {
-                if(packet[offset + pesHeaderSize] == 0x0B and packet[offset + pesHeaderSize + 1] == 0x77) 
-                {
-                    if(pesHeaderSize + 7 > payloadSize) 
-                        return 0;
-                    return pesHeaderSize + 7; // AC-3 header is always 7 bytes
-                }
-            return 0;
+                const auto skipped = std::max<std::uint64_t>(reader->size(), bytes_processed) - bytes_processed;
+                std::println("Every file of the carousel came through cleanly. Skipped the last {} of {} bytes.", skipped, bytes_processed + skipped);
+                m_progress.skipped(skipped);
+                discard_repeats();
+                break;
             }
         }
-        return 0;
-    } // getPESAndAC3HeaderSize(packet, header)
+        // A finished recording has nothing left to resume. One that stopped growing for a while but wasn't closed
+        // continues from here, like a cancelled one.
+        const auto stopped = m_cancel_flag or reader->timed_out();
+        if(m_options.sink)
+        {
+            // Files that are still being received end cut off, like the .part files in the output directory
+            for(auto& context : m_contexts) if(context.to_sink) release_context(context);
+            m_options.sink->finish();
+        }
+        else if(not stopped) remove_checkpoint(checkpoint_path(m_output_path));
+        else if(checkpoints > 0) save_state(input, bytes_processed);
+        // Small files that are still being received are left as .part, like the ones on disk
+        for(const auto& context : m_contexts)
+            if(context.in_memory and context.state == STATE::READING_FILE) m_small_files.add(context.filename, context.buffer, false, context.losses, context.pid);
+        m_small_files.flush();
+        m_verifier.wait();
+        skip_unnamed_copies();
+        m_keeper.save();
+        if(m_archive.is_open()) m_archive.close();
+        if(release_input and m_cycle_complete)
+        {
+            // Only what was read is done with
+            if(checkpoints > 0 and released.is_open()) released.release(bytes_processed);
+            std::println("Kept {}, the end of it wasn't read.", input.string());
+        }
+        else if(release_input and not stopped)
+        {
+            // Windows doesn't remove files that are still open
+            released.close();
+            reader.reset();
+            auto error = std::error_code();
+            if(not std::filesystem::remove(input, error)) std::println("Could not remove {}: {}", input.string(), error.message());
+        }
+    }
 
+    auto reset_state(const bool no_log = true) -> void
+    {
+        if(m_debug) std::println("Reset Called");
+        // The files are given up on, a write error doesn't matter anymore
+        for(auto& context : m_contexts) if(context.output_file.is_open()) abandon_output(context);
+        m_contexts.clear();
+        for(auto& stream : m_streams)
+        {
+            stream.active = -1;
+            stream.previousPacketMagicBytePatternIndex = 0;
+            stream.continuity = -1;
+            stream.transport_errors = 0;
+            stream.pes.reset();
+        }
+        if(!no_log) 
+        {
+           std::println("Scanning for files to extract...");
+        }
+        m_cancel_flag.store(false);
+    }
 
-    auto parse_ts_header(const std::span<const int> packet) const -> std::optional<TSHeader> 
+    // Writes everything the parser knows about the recording up to `offset` to the checkpoint. Buffered output is
+    // handed to the OS first so the .part files are at least as long as the checkpoint says.
+    auto save_state(const std::filesystem::path& input, const std::uint64_t offset) -> void
     {
-        constexpr auto static this_pid = 6530;
-        TSHeader header;
-        
-        if(packet[0] != 0x47) {
-            header.syncByte = false;
-            return header;
+        for(auto& context : m_contexts)
+        {
+            if(not context.output_file.is_open()) continue;
+            try { context.output_file.sync(); }
+            catch(const std::system_error& error) { fail_file(context, error); }
+        }
+        if(m_archive.is_open()) m_archive.sync();
+        // Small files that are done are only in the batch, they would be lost otherwise
+        m_small_files.flush();
+        // Files waiting for verification are before the checkpoint, nothing would verify them after a crash
+        m_verifier.wait();
+        skip_unnamed_copies();
+        // The files that were completed so far have their name, what is known about them has to survive as well
+        m_keeper.save();
+        auto state = checkpoint();
+        describe_input(input, state);
+        state.offset = offset;
+        state.archive_size = m_archive_size;
+        for(const auto& stream : m_streams)
+            state.streams.push_back({stream.pid, stream.previousPacketMagicBytePatternIndex, stream.active, stream.continuity, stream.transport_errors, stream.pes.save()});
+        for(const auto& context : m_contexts)
+        {
+            auto& file = state.files.emplace_back();
+            file.pid = context.pid;
+            file.state = std::to_underlying(context.state);
+            file.header = context.currentEQHeader;
+            file.header_read = context.currentEQHeaderBytesRead;
+            file.raw_filename = context.raw_filename;
+            file.filename_read = context.bufferLength;
+            file.data_read = context.file_data_read;
+            file.in_memory = context.in_memory;
+            file.interrupted = context.interrupted;
+            file.magic_written = context.magic_written;
+            file.losses = context.losses;
+            file.hash = context.hash.save();
+            if(context.in_memory) file.data.assign(context.buffer.begin(), context.buffer.end());
         }
+        save_checkpoint(checkpoint_path(m_output_path), state);
+        if(m_debug) std::println("Saved a checkpoint at byte {}", offset);
+    }
 
-        // Packet corrupted (FEC unable to correct)
-	    // packet[1].bit[15] == 1 means error (but packet[1] can only contain 8 bits. What is this?)
-        if(packet[1] & (1 << 15)) //this looks weired I predict that it would never run. I'll keep it there for now.
+    // Restores the parser from the checkpoint in the output directory if it was saved for this recording.
+    // Returns where to continue reading, 0 if there is nothing to continue.
+    auto resume(const std::filesystem::path& input) -> std::uint64_t
+    {
+        const auto saved = load_checkpoint(checkpoint_path(m_output_path));
+        if(not saved) return 0;
+        auto current = checkpoint();
+        describe_input(input, current);
+        // A recording that is still being written (reader_options::growing) grew since the checkpoint, its size and
+        // modification time changed. It only has to be the same file and still have everything the checkpoint read.
+        const auto growing = static_cast<bool>(m_options.reader.growing);
+        const auto unchanged = saved->input_size == current.input_size and saved->input_time == current.input_time;
+        if(saved->input != current.input or saved->offset > current.input_size or not (growing or unchanged))
         {
-            header.TEI = true;
-            return header;
+            std::println("Ignoring the checkpoint in {}, it was saved for another recording.", m_output_path.string());
+            return 0;
         }
 
-        header.PID = ((0b00011111 & packet[1]) << 8) | packet[2];
-        // std::println("byte[1] is: 0x{0:x} (0b{0:B}) and byte[2] is: 0x{1:x} (0b{1:B}) so header.PID = {2} ({2:B})",packet[1],packet[2],header.PID);
+        reset_state(true);
+        setup_pids();
+        m_packet_offset = saved->offset;
+        m_archive_size = saved->archive_size;
+        m_contexts.resize(saved->files.size());
+        for(auto i = 0uz; i < m_contexts.size(); ++i)
+        {
+            const auto& file = saved->files[i];
+            auto& context = m_contexts[i];
+            context.filename.reserve(MAX_FILENAME_LENGTH);
+            context.pid = file.pid;
+            context.state = file.state <= std::to_underlying(STATE::READING_FILE)? static_cast<STATE>(file.state) : STATE::SEARCHING_FOR_HEADER;
+            context.currentEQHeader = file.header;
+            context.currentEQHeaderBytesRead = file.header_read;
+            context.raw_filename = file.raw_filename;
+            context.bufferLength = file.filename_read;
+            context.file_data_read = file.data_read;
+            context.interrupted = file.interrupted;
+            context.magic_written = file.magic_written;
+            context.losses = file.losses;
+            context.hash.restore(file.hash);
+            if(context.state == STATE::READING_FILENAME or context.state == STATE::READING_FILE)
+            {
+                context.eQHeader = parseEQHeader(context.currentEQHeader);
+                if(not isPlausibleEQHeader(context.eQHeader) or context.bufferLength > context.eQHeader.filename_length)
+                {
+                    release_context(context);
+                    continue;
+                }
+            }
+            if(context.state != STATE::READING_FILE) continue;
+            context.filename.assign(sanitize_filename(std::span(context.raw_filename).first(context.bufferLength), m_filename_scratch));
+            if(not resume_file(context, file))
+            {
+                // The rest of it is skipped like data in front of a header
+                std::println("Could not continue {}, starting over with the next file on PID {}.", context.filename, context.pid);
+                release_context(context);
+            }
+            else if(m_options.stop_after_cycle) m_carousel.started(context.filename, context.eQHeader.file_size);
+        }
+        for(const auto& saved_stream : saved->streams)
+        {
+            add_stream(saved_stream.pid);
+            if(saved_stream.pid < 0 or saved_stream.pid >= static_cast<int>(m_pid_kinds.size())) continue;
+            auto& stream = find_stream(saved_stream.pid);
+            stream.previousPacketMagicBytePatternIndex = saved_stream.magic_index;
+            stream.active = saved_stream.active;
+            stream.continuity = saved_stream.continuity;
+            stream.transport_errors = saved_stream.transport_errors;
+            if(stream.active >= 0 and m_contexts[stream.active].state == STATE::SEARCHING_FOR_HEADER) stream.active = -1;
+            stream.pes.restore(saved_stream.pes);
+        }
+        std::println("Resuming the extraction at byte {} of {}.", saved->offset, current.input_size);
+        return saved->offset;
+    }
 
-        if(header.PID != this_pid) return std::nullopt; //PID didn't match so nothing will be parsed
+    // Small files get back what they had received. Files on disk continue their .part file, which may be gone
+    // if the file was completed after the checkpoint was saved.
+    auto resume_file(file_context& context, const checkpoint::file& file) -> bool
+    {
+        if(context.file_data_read > context.eQHeader.file_size) return false;
+        context.in_memory = file.in_memory;
+        if(context.in_memory)
+        {
+            context.buffer.assign(file.data.begin(), file.data.end());
+            if(context.buffer.size() == context.file_data_read) return true;
+            context.in_memory = false;
+            return false;
+        }
+        *std::ranges::copy(std::string_view(".part"), std::ranges::copy(context.filename, context.part_name.begin()).out).out = '\0';
+        if(not context.output_file.reopen(m_output_directory, context.part_name.data(), context.file_data_read, m_uring.get())) return false;
+        // Truncating it may have given back what was reserved
+        preallocate(context);
+        return true;
+    }
 
-        // Transport Scrambling Control (non-zero means scrambled)
-        header.TSC = (packet[3] & 0b11000000) >> 6;
+    // extraction_options::reader, with the wait for a growing recording cut short by cancelling the extraction like the
+    // wait for a ring. Otherwise a cancel only acts once the writer is done or growing_timeout passed.
+    auto reader_settings() const -> reader_options
+    {
+        auto options = m_options.reader;
+        if(options.growing) options.growing = [growing = options.growing, this]{ return not m_cancel_flag.load(std::memory_order_relaxed) and growing(); };
+        return options;
+    }
 
-        // Adaptation field control
-        header.AFC = (packet[3] & 0b00110000) >> 4;
+    // Reads extraction_options::shared_memory input. Cancelling the extraction stops the wait for more packets.
+    auto open_ring(const std::filesystem::path& ring) -> std::unique_ptr<ts_reader>
+    {
+        const auto keep_waiting = [this]{ return not m_cancel_flag.load(std::memory_order_relaxed); };
+        return std::make_unique<ring_reader>(ring, m_options.reader.block_size, keep_waiting, m_options.reader.growing_timeout);
+    }
 
-        // Continuity counter
-        header.CC = packet[3] & 0b00001111;
+    // Opens extraction_options::archive, or continues it where the checkpoint says when the extraction was resumed
+    auto open_archive(const std::filesystem::path& input, const bool resumed) -> void
+    {
+        if(m_archive.is_open()) m_archive.close();
+        if(m_options.archive.empty()) return;
+        auto error = std::error_code();
+        if(std::filesystem::equivalent(input, m_options.archive, error))
+            throw std::runtime_error("[Rostam Core Error] The archive can't be the recording it's made from.");
+        const auto directory = m_options.archive.parent_path();
+        const auto name = m_options.archive.filename().string();
+        m_archive_directory.open(directory.empty()? std::filesystem::path(".") : directory);
+        if(resumed and m_archive.reopen(m_archive_directory, name.c_str(), m_archive_size, m_uring.get())) return;
+        if(resumed) std::println("Could not continue the archive {}, it only has the rest of the recording.", m_options.archive.string());
+        m_archive_size = 0;
+        if(not m_archive.open(m_archive_directory, name.c_str(), m_uring.get()))
+            throw std::runtime_error("[Rostam Core Error] Could not open the archive file.");
+    }
 
-        if(header.AFC == 1 and packet.size() > 4) 
-        {
-            header.hasPayload = true;
-            header.payloadOffset = 4;
-        } 
-        else if(header.AFC == 3 && packet.size() > 5) 
+    // Takes a free slot in the context table or grows it. Returns the index since the table may reallocate.
+    auto acquire_context(const int pid) -> int
+    {
+        auto free_slot = std::ranges::find(m_contexts, STATE::SEARCHING_FOR_HEADER, &file_context::state);
+        if(free_slot == m_contexts.end())
         {
-            header.hasPayload = true;
-            header.payloadOffset = 4 + 1 + packet[4];
-        } 
-        else 
+            free_slot = m_contexts.emplace(m_contexts.end());
+            free_slot->filename.reserve(MAX_FILENAME_LENGTH);
+        }
+        free_slot->pid = pid;
+        free_slot->state = STATE::READING_HEADER;
+        free_slot->currentEQHeaderBytesRead = 0;
+        free_slot->interrupted = -1;
+        free_slot->magic_written = 0;
+        free_slot->losses = 0;
+        return std::distance(m_contexts.begin(), free_slot);
+    }
+
+    auto release_context(file_context& context, const bool no_log = true) -> void
+    {
+        if(context.output_file.is_open()) close_output(context);
+        if(context.to_sink) m_options.sink->end_file(sink_id(context), false, context.losses);
+        context.to_sink = false;
+        if(context.in_memory and context.state == STATE::READING_FILE)
+            m_small_files.add(context.filename, context.buffer, context.file_data_read >= context.eQHeader.file_size, context.losses, context.pid);
+        context.in_memory = false;
+        if(!no_log) 
         {
-            header.hasPayload = false;
+           std::println("Scanning for files to extract on PID {}...", context.pid);
         }
-        if(header.hasPayload) 
+        context.state = rostam::STATE::SEARCHING_FOR_HEADER;
+        context.eQHeader = {0,0,0,0};
+        context.buffer.clear();
+        context.bufferLength = 0;
+        context.filename.erase(0); // Filename of current file being extracted (if any)
+        // this.fileData = []; // Data that has been read for current file. Array of Uint8Arrays (I think its never used)
+        context.file_data_read = 0uz; // How much file data has been read so far
+        context.currentEQHeaderBytesRead = 0;
+        context.interrupted = -1;
+        context.magic_written = 0;
+        context.losses = 0;
+    }
+
+    // The files that are still being received when the carousel is complete are copies of ones that are already there
+    auto discard_repeats() -> void
+    {
+        for(auto& context : m_contexts)
         {
-            header.payloadLength = 188 - header.payloadOffset;
+            if(context.state != STATE::READING_FILE) continue;
+            if(context.output_file.is_open())
+            {
+                // It's removed, what didn't make it to the disk doesn't matter
+                try { context.output_file.close(); } catch(const std::system_error&) {}
+                m_output_directory.remove(context.part_name.data());
+            }
+            // A sink drops them too
+            if(context.to_sink) m_options.sink->abandon_file(sink_id(context));
+            context.in_memory = false;
+            context.to_sink = false;
+            release_context(context);
+        }
+        for(auto& stream : m_streams) stream.active = -1;
+    }
 
-            const auto pesAndAC3HeaderSize = getPESAndAC3HeaderSize(packet, header);
-            // TODO not the prettiest to pretend the PES and AC-3 headers
-            // are part of the MPEG-TS header but it prevents us modifying a bunch of code
-            header.payloadOffset += pesAndAC3HeaderSize;
-            header.payloadLength -= pesAndAC3HeaderSize;
+    // Builds the PID lookup table from the options. Discovered PIDs are added on the fly by add_stream.
+    auto setup_pids() -> void
+    {
+        m_pid_kinds.fill(pid_kind::IGNORED);
+        m_streams.clear();
+        m_psi.reset();
+        if(m_options.discover_pids) m_pid_kinds[psi_parser::PAT_PID] = pid_kind::PSI;
+        for(const auto pid : m_options.pids) add_stream(pid);
+    }
 
-            // Creates a view on the packet buffer 
-            if(header.payloadLength < 0) return std::nullopt; // Sometimes the algorithm returns negative values as length! The original doesn't do anything for it but I beleive that it will be rejected somewhere in the code. Let's ignore those packets.
-            header.payload = packet.subspan(header.payloadOffset, header.payloadLength);
+    auto add_stream(const int pid) -> void
+    {
+        if(pid < 0 or pid >= static_cast<int>(m_pid_kinds.size()) or m_pid_kinds[pid] == pid_kind::EQSAT) return;
+        if(m_debug) std::println("Demuxing PID {}", pid);
+        m_pid_kinds[pid] = pid_kind::EQSAT;
+        m_pids_changed = true;
+        m_streams.emplace_back().pid = pid;
+    }
+
+    auto find_stream(const int pid) -> eqsat_stream&
+    {
+        // There are only a handful of streams. A linear search beats anything fancier here.
+        return *std::ranges::find(m_streams, pid, &eqsat_stream::pid);
+    }
+
+    // Feeds PAT/PMT packets to the psi parser and starts demuxing the streams it finds
+    auto parse_psi(const packet_descriptor& descriptor) -> void
+    {
+        if(descriptor.payload_offset == 0 or descriptor.transport_error()) return;
+        m_psi.feed(descriptor.pid, descriptor.pusi(), m_packet.subspan(descriptor.payload_offset));
+        // PMT pids that the PAT pointed to need to go through the psi parser as well.
+        for(const auto pid : m_psi.psi_pids())
+        {
+            if(m_pid_kinds[pid] != pid_kind::IGNORED) continue;
+            m_pid_kinds[pid] = pid_kind::PSI;
+            m_pids_changed = true;
         }
-        // if(m_debug)std::println("header TSC : {}\nheader AFC: {}\nhreader CC: {}\nheader:payload:\n{}",header.TSC,header.AFC,header.CC,header.payload|std::views::transform([](const auto v){return std::format("{:0>2x}",v);}));
-        return header;
-    } // parse_ts_header(packet) 
+        for(const auto& es : m_psi.take_new_streams()) add_stream(es.pid);
+    }
+
+    auto parseEQHeader(const std::span<const std::uint8_t> eq_header) const -> EQHeader //OK, Works properly
+    {
+        // this was from the js file this.currentEQHeader = Buffer.alloc(EQSAT_HEADER_SIZE_WITHOUT_MAGIC_BYTES);
+        // which then will be passed to this function. buffer is part of the Buffer from nodejs.
+        // std::println("parseEQheader called");
+        const auto bytes_to_uint64 = [](const std::span<const std::uint8_t> byte_span, const std::size_t offset){
+            const static auto shift_left_full64 = 56;
+            auto value = std::uint64_t();
+            for(int i = 0; i < 8; ++i) 
+            {
+                value = (value >> 8) | (static_cast<std::uint64_t>(byte_span[i+offset]) << shift_left_full64);
+                // std::print("{:X} - ",buffer[i + offset]);
+            }
+            // std::println("\n-> so the value is: 0x{0:X} ({0})",value);
+            return value;
+        };
 
+        return {
+            eq_header[0], // The first 12 bytes are the magic bytes
+            eq_header[1], // flags
+            bytes_to_uint64(eq_header,2),
+            bytes_to_uint64(eq_header,10) 
+        };
+    }
 
     //searches for cafec0def00d aka EQSAT_MAGIC_BYTES
-    auto findMagicBytes(const std::span<const int> payload) -> long long 
+    auto findMagicBytes(eqsat_stream& stream, const std::span<const std::uint8_t> payload) -> long long 
     {
-        if(payload.size() >= 12) 
+        // The fast search can't continue a pattern that started in the previous payload. With tiny files
+        // that happens a lot and it would skip right to the next file's magic bytes.
+        if(payload.size() >= 12 and stream.previousPacketMagicBytePatternIndex == 0) 
         {
             const auto magic_bytes_search = std::ranges::search(payload,EQSAT_MAGIC_BYTES);
             const auto magicBytesOffset = std::distance(payload.cbegin(),magic_bytes_search.cbegin());
@@ -283,13 +743,13 @@ export class rostam{
             {
                 std::println("found magic bytes in offset: {}", magicBytesOffset);
                 // printHex("Payload: ", payload.subarray(magicBytesOffset, magicBytesOffset+16), 16);
-                previousPacketMagicBytePatternIndex = 0;
+                stream.previousPacketMagicBytePatternIndex = 0;
                 return magicBytesOffset + EQSAT_MAGIC_BYTES.size();
             }
         }
 
-        auto patternIndex = previousPacketMagicBytePatternIndex;// || 0;
-        previousPacketMagicBytePatternIndex = 0;
+        auto patternIndex = stream.previousPacketMagicBytePatternIndex;// || 0;
+        stream.previousPacketMagicBytePatternIndex = 0;
         
         for(auto searchIndex=0uz; searchIndex < payload.size(); searchIndex++) 
         {
@@ -314,199 +774,470 @@ export class rostam{
                 patternIndex = 0;
             }
         }
-        previousPacketMagicBytePatternIndex = patternIndex;
+        stream.previousPacketMagicBytePatternIndex = patternIndex;
 
         return -1;
     }
 
-    //changes currentEQHeader
-    auto checkForEQHeader(const TSHeader& ts_header) -> long long 
+    // A magic byte match is only a candidate. Reject headers that can't describe a real file before we
+    // abandon a file that is in progress because of them. Random bytes after a false match almost never make
+    // a known version and a size below MAX_FILE_SIZE.
+    auto isPlausibleEQHeader(const EQHeader& header) const -> bool
+    {
+        return header.version == EQSAT_VERSION
+           and header.filename_length > 0
+           and header.filename_length < std::numeric_limits<std::uint8_t>::max()
+           and header.file_size > 0
+           and header.file_size <= MAX_FILE_SIZE;
+    }
+
+    // Counts the skip and keeps it in m_skipped_headers if there is room. Returns where it was kept.
+    auto record_skip(const int pid, std::string reason) -> skipped_header*
+    {
+        ++m_skipped_header_count;
+        if(m_skipped_headers.size() >= MAX_SKIPPED_HEADERS) return nullptr;
+        return &m_skipped_headers.emplace_back(m_packet_offset, pid, std::move(reason));
+    }
+
+    // Keeps the header in m_skipped_headers, the context is left as it is
+    auto skip_header(const eqsat_stream& stream, const file_context& context, std::string reason) -> void
     {
-        constexpr auto EQSAT_HEADER_SIZE = 30; // eQsat v2 header is 30 bytes long
-        constexpr auto EQSAT_HEADER_SIZE_WITHOUT_MAGIC_BYTES = EQSAT_HEADER_SIZE - EQSAT_MAGIC_BYTES.size(); 
-        if(not ts_header.hasPayload) return -1;
-        const auto& payload = ts_header.payload;
+        std::println("Skipping a header on PID {} at byte {}: {}", stream.pid, m_packet_offset, reason);
+        if(auto* skipped = record_skip(stream.pid, std::move(reason)))
+            std::ranges::copy(context.currentEQHeader, std::ranges::copy(EQSAT_MAGIC_BYTES, skipped->raw.begin()).out);
+    }
+
+    // The magic bytes were a false match, the header or the filename after them can't be real. If they showed up in the
+    // data of a file that was being received, the bytes taken for them were its data and go back to it. Magic bytes that
+    // came in an earlier payload were already written to it, and nothing goes past its declared size.
+    auto reject_header(eqsat_stream& stream, file_context& context, std::string reason, const std::span<const std::uint8_t> filename) -> void
+    {
+        skip_header(stream, context, std::move(reason));
+        const auto interrupted = context.interrupted;
+        if(interrupted >= 0)
+        {
+            auto& file = m_contexts[interrupted];
+            const auto handback = std::span(EQSAT_MAGIC_BYTES).subspan(context.magic_written);
+            for(const auto data : {handback, std::span<const std::uint8_t>(context.currentEQHeader), filename})
+                write_file_data(file, data.first(std::min(data.size(), file.eQHeader.file_size - file.file_data_read)));
+        }
+        release_context(context);
+        // Unless writing them failed and the interrupted file was skipped
+        stream.active = interrupted >= 0 and m_contexts[interrupted].state == STATE::READING_FILE? interrupted : -1;
+    }
 
+    // The small file batch couldn't write a file. It's kept with the other skipped files, only without its header.
+    auto skip_small_file(const std::string_view name, const int pid, std::string reason) -> void
+    {
+        std::println("Skipping {} from PID {}: {}", name, pid, reason);
+        record_skip(pid, std::move(reason));
+    }
+
+    // Files the verifier couldn't rename once they were checked are kept like the ones of the batch
+    auto skip_unnamed_copies() -> void
+    {
+        for(auto& copy : m_verifier.take_unnamed()) skip_small_file(copy.name, copy.pid, std::move(copy.reason));
+    }
+
+    // The header was fine but its file can't be written. Its data is skipped like anything in front of a header.
+    auto skip_file(eqsat_stream& stream, file_context& context, std::string reason) -> void
+    {
+        if(not m_options.resilient) throw std::runtime_error(std::format("[Rostam Core Error] {}", reason));
+        skip_header(stream, context, std::move(reason));
+        // A file that failed to write may fail again while it's closed. It's closed either way.
+        if(context.output_file.is_open()) abandon_output(context);
+        release_context(context);
+        stream.active = -1;
+    }
+
+    // Writing a file failed (disk full, I/O error). What made it to the disk stays as its .part and the rest of the file
+    // is skipped. The file doesn't have to be the one its stream is receiving, e.g. when it was interrupted.
+    auto fail_file(file_context& context, const std::system_error& error) -> void
+    {
+        auto& stream = find_stream(context.pid);
+        const auto active = stream.active;
+        const auto failed = static_cast<int>(&context - m_contexts.data());
+        skip_file(stream, context, std::format("Could not write {}: {}", context.filename, error.what()));
+        if(active != failed) stream.active = active;
+    }
+
+    // Writes out what is buffered and closes the file. False if that failed and the file was skipped.
+    auto close_output(file_context& context) -> bool
+    {
+        try
+        {
+            if(context.file_data_read < context.eQHeader.file_size) release_preallocated(context);
+            context.output_file.close();
+        }
+        catch(const std::system_error& error)
+        {
+            fail_file(context, error);
+            return false;
+        }
+        return true;
+    }
+
+    // Closes a file that is given up on, a write error doesn't matter anymore
+    auto abandon_output(file_context& context) -> void
+    {
+        try { release_preallocated(context); } catch(const std::system_error&) {}
+        try { context.output_file.close(); } catch(const std::system_error&) {}
+    }
+
+    // Reserves the rest of the file (extraction_options::preallocate), but no more than is left of the input: a file
+    // never gets more data than that. The header may be a false match that announces tens of GB.
+    auto preallocate(file_context& context) -> bool
+    {
+        if(not m_options.preallocate) return false;
+        const auto left = m_input_end - std::min(m_input_end, m_packet_offset);
+        const auto size = std::min<std::uint64_t>(context.eQHeader.file_size, context.file_data_read + left);
+        return storage::preallocate(context.output_file.native_handle(), size);
+    }
+
+    // A file that ends before its declared size gives back the disk space reserved for the rest of it. What is buffered
+    // is written first, the file keeps the size it has.
+    auto release_preallocated(file_context& context) -> void
+    {
+        if(not m_options.preallocate or not context.output_file.is_open()) return;
+        context.output_file.sync();
+        storage::release_preallocated(context.output_file.native_handle());
+    }
+
+    // Hands the completed .part to the verifier or gives it its name. False if renaming it failed (e.g. the filesystem
+    // doesn't take the name) and the file was skipped, it stays as its .part then.
+    auto complete_output(eqsat_stream& stream, file_context& context) -> bool
+    {
+        try
+        {
+            if(m_options.verify) m_verifier.submit(context.filename, {context.losses, false, context.hash.value()}, context.pid);
+            else m_keeper.complete(context.part_name.data(), context.filename.c_str(), {context.losses, false, context.hash.value()});
+        }
+        catch(const std::system_error& error)
+        {
+            skip_file(stream, context, std::format("Could not give {} its name: {}", context.filename, error.what()));
+            return false;
+        }
+        return true;
+    }
+
+    // Each of the functions below consumes the start of the payload and returns how many bytes it used.
+    // parse_eqsat keeps calling them until the whole payload is used, so a file that ends in the middle
+    // of a packet doesn't swallow the beginning of the next one.
+
+    auto search_for_header(eqsat_stream& stream, const std::span<const std::uint8_t> payload) -> std::size_t
+    {
+        const auto zone = trace_zone("magic search");
+        const auto header_offset = findMagicBytes(stream, payload);
+        if(header_offset < 0) return payload.size();
+        stream.active = acquire_context(stream.pid);
+        return header_offset;
+    }
+
+    //changes currentEQHeader
+    auto read_eq_header(eqsat_stream& stream, const std::span<const std::uint8_t> payload) -> std::size_t
+    {
+        auto& context = m_contexts[stream.active];
         // If we already read some of the header bytes from the previous packet
         // then try to read the rest, or at least some more header bytes from this packet
-        if(not this->currentEQHeader.empty()) 
-        {
-            const auto remaining_bytes = EQSAT_HEADER_SIZE_WITHOUT_MAGIC_BYTES - currentEQHeaderBytesRead;
-            const auto to_copy = std::min(payload.size(), remaining_bytes);
-            std::println("trying to copy from payload to currentEQHeader in checkForEQHeader() in the first if-statement to_copy is: {} and payload.size() is: {}",to_copy,payload.size());
-            if(to_copy > payload.size())throw std::logic_error("to_copy > payload.size()");
-            if(to_copy > currentEQHeader.size() - currentEQHeaderBytesRead)throw std::logic_error("currentEQHeader buffer overflow");
-            std::ranges::copy_n(payload.begin(), to_copy, currentEQHeader.begin() + currentEQHeaderBytesRead);
-            // buffer.copy (target              , targetStart                  , sourceStart, sourceEnd);
-            // payload.copy(this.currentEQHeader, this.currentEQHeaderBytesRead, 0, to_copy);
-            if(to_copy < remaining_bytes) return -1;
+        const auto remaining_bytes = context.currentEQHeader.size() - context.currentEQHeaderBytesRead;
+        const auto to_copy = std::min(payload.size(), remaining_bytes);
+        std::ranges::copy_n(payload.begin(), to_copy, context.currentEQHeader.begin() + context.currentEQHeaderBytesRead);
+        context.currentEQHeaderBytesRead += to_copy;
+        if(to_copy < remaining_bytes) return to_copy;
+
+        if(m_debug) std::println("currenteqheader={::X}",context.currentEQHeader);
+        context.eQHeader = parseEQHeader(context.currentEQHeader);
+        if(m_debug) {
+            std::println("Header file size: {}", context.eQHeader.file_size);
+        }
+
+        if(not isPlausibleEQHeader(context.eQHeader))
+        {
+            reject_header(stream, context, std::format("magic bytes followed by an implausible header (version {}, filename length {}, file size {})",
+                context.eQHeader.version, context.eQHeader.filename_length, context.eQHeader.file_size), {});
             return to_copy;
         }
+
+        // An interrupted file is only given up once the filename turned out fine as well
+        context.bufferLength = 0;
+        if(m_debug) std::println("Changed the state-machine to STATE_READING_FILENAME");
+        context.state = rostam::STATE::READING_FILENAME;
+        return to_copy;
+    }
+
+    auto read_filename(eqsat_stream& stream, const std::span<const std::uint8_t> payload) -> std::size_t
+    {
+        auto& context = m_contexts[stream.active];
+        // isPlausibleEQHeader made sure the filename fits
+        const auto toCopyMax = context.eQHeader.filename_length - context.bufferLength;
+        const auto toCopy = std::min(payload.size(), toCopyMax);
+        
+        std::ranges::copy_n(payload.begin(),toCopy,context.raw_filename.begin()+context.bufferLength);
+
+        //tsHeader->payload.copy(this.buffer, this.bufferLength, curPayloadOffset, curPayloadOffset + toCopy);
+        context.bufferLength += toCopy;
+        if(context.bufferLength < context.eQHeader.filename_length) return toCopy;
+
+        // Avoid illigal, OS-reserved or corrupted charachters. The filename keeps its capacity between files.
+        {
+            const auto zone = trace_zone("sanitize filename");
+            context.filename.assign(sanitize_filename(std::span(context.raw_filename).first(context.bufferLength), m_filename_scratch));
+        }
+        // Nothing of it was usable (only dots, control characters or broken UTF-8), a real file always has a name
+        if(context.filename.empty())
+        {
+            reject_header(stream, context, "magic bytes followed by a filename that is empty once it's sanitized",
+                std::span(context.raw_filename).first(context.bufferLength));
+            return toCopy;
+        }
+
+        if(context.interrupted >= 0)
+        {
+            auto& interrupted = m_contexts[context.interrupted];
+            std::println("Warning: {} was interrupted by a new transmission on PID {} after {} of {} bytes. Keeping it as {}.part",
+                interrupted.filename, stream.pid, interrupted.file_data_read, interrupted.eQHeader.file_size, interrupted.filename);
+            release_context(interrupted);
+            context.interrupted = -1;
+        }
+        context.state = rostam::STATE::READING_FILE;
+
+        // Once the carousel is complete nothing new is opened, the packets up to the next poll are only parsed.
+        // Verified files only count once they passed.
+        if(m_options.stop_after_cycle and not m_index)
+            for(const auto& copy : m_verifier.take_passed()) m_carousel.completed(copy.name, copy.size, copy.quality.losses);
+        if(m_options.stop_after_cycle and not m_index and (m_cycle_complete or m_carousel.started(context.filename, context.eQHeader.file_size)))
+        {
+            m_cycle_complete = true;
+            release_context(context);
+            stream.active = -1;
+            return toCopy;
+        }
+
+        std::println("Extracting file: {}", context.filename);
+        m_progress.file_started(context.filename);
+
+        if(m_index)
+        {
+            context.in_memory = false;
+            context.indexed.clear();
+            context.indexed.name = context.filename;
+            context.indexed.size = context.eQHeader.file_size;
+            return toCopy;
+        }
+        if(m_options.sink)
+        {
+            context.in_memory = false;
+            context.to_sink = true;
+            m_options.sink->begin_file(sink_id(context), context.filename, context.eQHeader.file_size);
+            return toCopy;
+        }
+
+        // Small files stay in memory until they are done. The batch checks the free space and opens them later.
+        context.in_memory = context.eQHeader.file_size <= m_options.small_file_limit;
+        if(context.in_memory)
+        {
+            context.buffer.clear();
+            return toCopy;
+        }
+        // then write files to the dir as they are extracted
+        const auto zone = trace_zone("open file");
+        // Files are created relative to the output directory, no path is built per file
+        *std::ranges::copy(std::string_view(".part"), std::ranges::copy(context.filename, context.part_name.begin()).out).out = '\0';
+        // Fail right away instead of filling up the disk and dying in the middle of a huge file
+        if(not storage::has_free_space(m_output_path, context.eQHeader.file_size))
+        {
+            skip_file(stream, context, std::format("Not enough free space in {} for {} ({} bytes).", m_output_path.string(), context.filename, context.eQHeader.file_size));
+            return toCopy;
+        }
         
-        const auto header_offset = findMagicBytes(payload);
-        if(header_offset < 0) return -1;
-
-        this->currentEQHeader = std::vector<int>(EQSAT_HEADER_SIZE_WITHOUT_MAGIC_BYTES);
-
-        // If the beginning of the header (after the magic bytes) was found
-        // but the header is bigger than the remaining payload of the packet
-        // meaning that the header spans into the next packet
-        if(header_offset + EQSAT_HEADER_SIZE_WITHOUT_MAGIC_BYTES + 1 > payload.size()) {
-            const auto to_read = payload.size() - header_offset;
-            // Copy the bytes beginning at the header offset in the payload to this.currentEQHeader
-            if(m_debug)
+        // Open file for writing
+        // TODO change to async open call
+        if(std::ranges::any_of(m_contexts, [&](const auto& other){return &other != &context and other.state == STATE::READING_FILE and other.filename == context.filename;}))
+            std::println("Warning: {} is already being received on another stream. Opening it anyway :/", context.filename);
+        context.output_file.open(m_output_directory, context.part_name.data(), m_uring.get());
+        context.hash = {};
+        if(!context.output_file)
+        {
+            skip_file(stream, context, std::format("Could not open the output file {}. The program might opened a file twice(logical) or it's a premission problem(runtime).", context.filename));
+            return toCopy;
+        }
+        if(not preallocate(context) and m_options.preallocate and m_debug)
+            std::println("Could not preallocate {} bytes for {}. Writing it without preallocation.", context.eQHeader.file_size, context.filename);
+        return toCopy;
+    }
+
+    auto read_file(eqsat_stream& stream, const std::span<const std::uint8_t> payload) -> std::size_t
+    {
+        auto& context = m_contexts[stream.active];
+        const auto to_read = std::min(payload.size(), context.eQHeader.file_size - context.file_data_read);
+
+        // subspan makes a span, not a copy
+        const auto chunk = payload.first(to_read);
+
+        // A new header inside the file data means the broadcaster started another transmission before this one was done.
+        // The bytes before the magic still belong to this file, the rest goes to a new context.
+        if(const auto magic_end = findMagicBytes(stream, chunk); magic_end >= 0)
+        {
+            const auto data_before_magic = std::max(magic_end - static_cast<long long>(EQSAT_MAGIC_BYTES.size()), 0ll);
+            write_file_data(context, chunk.first(data_before_magic));
+            const auto interrupted = stream.active;
+            stream.active = acquire_context(stream.pid);
+            m_contexts[stream.active].interrupted = interrupted;
+            // The magic bytes began in an earlier payload, that part was written to this file
+            m_contexts[stream.active].magic_written = EQSAT_MAGIC_BYTES.size() - std::min<std::size_t>(magic_end, EQSAT_MAGIC_BYTES.size());
+            return magic_end;
+        }
+        write_file_data(context, chunk);
+        // Writing it failed, it was skipped
+        if(context.state != STATE::READING_FILE) return to_read;
+
+        if(context.file_data_read >= context.eQHeader.file_size) 
+        {
+            // Sometimes a healthy file gets overritten by a broken one. This usually happens with heavier files like videos. 
+            // Rostam Media does not provide a proper way to handle these types of errors so we have to verify the files on our own.
+            // With options.verify the file_verifier checks their structure before they get their real name.
+            // The copy_keeper makes sure a copy that lost packets doesn't replace one that came through better.
+            if(not close_output(context)) return to_read;
+            // The verifier reports these to the carousel tracker once they passed
+            const auto verifying = m_options.verify and not m_index and not context.to_sink;
+            if(m_index)
             {
-            std::println("trying to copy data in checkForEQHeader() second if-statement");
-                std::println("payload to copy={}",std::span(payload.cbegin()+header_offset,payload.cend())|std::views::transform([](const auto val){return std::format("{:X}",val);}));
+                context.indexed.losses = context.losses;
+                m_index->add(std::move(context.indexed));
             }
-            std::ranges::copy(payload.cbegin()+header_offset,payload.cend(),currentEQHeader.begin());
-            if(m_debug) std::println("currenteqheader={}",currentEQHeader|std::views::transform([](const auto val){return std::format("{:X}",val);}));
-            // buffer.copy (target,         targetStart , sourceStart);
-            // payload.copy(this.currentEQHeader, 0     , headerOffset);
-            currentEQHeaderBytesRead = to_read;
-            return -1;
-        }
-        if(m_debug) std::println("trying to copy data in checkForEQHeader() no cond");
-        std::ranges::copy_n(payload.cbegin()+header_offset,EQSAT_HEADER_SIZE_WITHOUT_MAGIC_BYTES,currentEQHeader.begin());
-        //buffer. copy( target,        targetStart, sourceStart, sourceEnd )
-        //payload.copy(this.currentEQHeader, 0, headerOffset, headerOffset + EQSAT_HEADER_SIZE_WITHOUT_MAGIC_BYTES);
-        return header_offset + EQSAT_HEADER_SIZE_WITHOUT_MAGIC_BYTES;
-    } 
-
-
-    auto parse_ts_packets(const std::span<const int> packet) -> void
-    {
-        // constexpr auto packet_size = 188uz;
-        if(packet.at(0) != 0x47) std::println("WARNING: Out of sync detected: 0x{:X}", packet.at(0));
-        // If the packet is smaller than the MPEG-TS packet header, skip
-        if(packet.size() < 4) return;
-
-        const auto ts_header = parse_ts_header(packet); // parse MPEG-TS header
-        //if(tsHeader.has_value())std::println("{}",tsHeader->payload);
-        // If parseTSHeader() returns false then the PID didn't match
-        // or the header failed to parse so skip the packet
-        if(!ts_header) return;
-
-        // This is incremented every time some of the current packet is consumed
-        // e.g. by reading the header or filename
-        auto curPayloadOffset = 0ll;
+            else if(context.to_sink)
+            {
+                context.to_sink = false;
+                m_options.sink->end_file(sink_id(context), true, context.losses);
+            }
+            else if(context.in_memory) {}
+            else if(not complete_output(stream, context)) return to_read;
+            if(m_options.stop_after_cycle and not verifying) m_carousel.completed(context.filename, context.eQHeader.file_size, context.losses);
+            std::println("Completed extraction of file:\n  {}", context.filename);
+            m_progress.file_completed();
+            release_context(context, false);
+            stream.active = -1;
+            stream.previousPacketMagicBytePatternIndex = 0;
+        }
+        return to_read;
+    }
 
-        if(m_state == rostam::STATE::SEARCHING_FOR_HEADER) 
+    auto write_file_data(file_context& context, const std::span<const std::uint8_t> chunk) -> void
+    {
+        const auto zone = trace_zone("write");
+        if(m_index) index_file_data(context, chunk);
+        else if(context.to_sink) m_options.sink->write(sink_id(context), chunk);
+        else if(context.in_memory) context.buffer.insert(context.buffer.end(), chunk.begin(), chunk.end());
+        else if(context.output_file)
         {
-            curPayloadOffset = this->checkForEQHeader(*ts_header);
-            if(curPayloadOffset >= 0) 
+            if(m_options.keep_better_copies) context.hash.update(chunk);
+            try { context.output_file.write(chunk); }
+            catch(const std::system_error& error)
             {
-                std::println("in SEARCHING_FOR_HEADER: Found beginning of new file in offset {}\nand currentEQHeader is={}",curPayloadOffset,currentEQHeader|std::views::transform([](const auto val){return std::format("{:X}",val);}));
-                
-                this->eQHeader = parseEQHeader(this->currentEQHeader);
-                this->currentEQHeader = {}; //set to undefined {} is the closest
-                
-                if(m_debug) {
-                    std::println("Header file size: {}", this->eQHeader.file_size);
-                }
-                if(eQHeader.filename_length >= std::numeric_limits<std::uint8_t>::max()) throw std::logic_error(std::format("too many allocations in state SEARCHING_FOR_HEADERS = {}",eQHeader.filename_length));
-                m_buffer = std::vector<unsigned char>(eQHeader.filename_length); 
-                bufferLength = 0;
-                
-                //this->bufferLength = 0;
-                // tsHeader.payloadOffset += EQSAT_HEADER_SIZE;
-                // tsHeader.payloadLength -= EQSAT_HEADER_SIZE;
-                if(m_debug) std::println("Changed the state-machine to STATE_READING_FILENAME");
-                m_state = rostam::STATE::READING_FILENAME;
+                fail_file(context, error);
+                return;
             }
         }
-        if(m_state == rostam::STATE::READING_FILENAME) 
-        {   
-            //std::println("parse_ts_packets() -> state machine changed to: STATE_READING_FILENAME");
-            if(!ts_header->hasPayload) return;
-            //std::println("we have payload!");
-            const auto toCopyMax = m_buffer.size() - this->bufferLength;
-            const auto toCopy = std::min(ts_header->payload.size() - static_cast<std::size_t>(curPayloadOffset), toCopyMax);
-            
-            std::ranges::copy_n(ts_header->payload.begin()+curPayloadOffset,toCopy,m_buffer.begin()+bufferLength);
+        context.file_data_read += chunk.size();
+    }
 
-            //tsHeader->payload.copy(this.buffer, this.bufferLength, curPayloadOffset, curPayloadOffset + toCopy);
-            this->bufferLength += toCopy;
-            curPayloadOffset += toCopy;
 
-            if(this->bufferLength >= m_buffer.size())
-            {
-                m_state = rostam::STATE::READING_FILE;
-
-                // It seems like sometimes the EQHeader::filename_length returns wrong size thus
-                // the filenames can contain bytes from the next(?) magic bytes.
-                // This is a uncode aware filter to avoid illigal, OS-reserved or corrupted charachters
-                filename = m_buffer
-                | una::views::utf8
-                | std::views::drop_while([](const auto c){return c == '.';}) // removes the first '.' if exists
-                | std::views::filter([](const auto c){const auto ascii_c = std::min<char32_t>(c,128);return not(isascii(ascii_c) and std::iscntrl(ascii_c))
-                                                                                                            and c != 0xfffd 
-                                                                                                            and c != U'%';}) // avoid utf-8 currupted chars
-                | std::views::transform ([windows_illigal=std::u32string_view(U":<>|*?\"\\/")](const auto c){return windows_illigal.contains(c)?U'-':c;}) // replace illigal chars
-                | una::ranges::to_utf8<std::string>();
-
-                std::println("Extracting file: {}", filename);
-                // TODO is Number big enough?
-                m_buffer = std::vector<unsigned char>(this->eQHeader.file_size);
-                bufferLength = 0;
-
-                // then write files to the dir as they are extracted
-                const auto output_file_path = m_output_path/(filename + ".part");
-                
-                //try {
-                // Open file for writing
-                // TODO change to async open call
-                if(m_current_output_file.is_open())std::println("Warning: another file is already open. Opening another one anyway :/");
-                m_current_output_file.open(output_file_path,std::ios::binary);
-                if(!m_current_output_file)throw std::runtime_error("[Rostam Core Error] Could not open the output file. The program might opened a file twice(logical) or it's a premission problem(runtime).");
-                // this.curOutFile = fs.openSync(filePath, 'w', 0o640);
-                //} 
-                // catch(...) {std::println("error");}
-            }        
-        } 
-        if(m_state == rostam::STATE::READING_FILE) 
-        {
-            if(!ts_header->hasPayload) return;
-            
-            const auto to_read = std::min(ts_header->payload.size() - static_cast<std::size_t>(curPayloadOffset), this->eQHeader.file_size - m_file_data_read);
+    auto sink_id(const file_context& context) const -> std::uint32_t
+    {
+        return static_cast<std::uint32_t>(&context - m_contexts.data());
+    }
 
-            // subspan makes a span, not a copy
-            // but since that's just the payload + 4 bytes 
-            // it seems like a good trade-off to avoid an extra copy operation
-            
-            // MY TODO : FIGURE THIS OUT
-            const auto chunk = ts_header->payload.subspan(curPayloadOffset, to_read);
-            
-            if(m_current_output_file) 
+    // Pieces that point into the packet are in the recording, the others were put together by the parser
+    auto index_file_data(file_context& context, const std::span<const std::uint8_t> chunk) -> void
+    {
+        if(chunk.empty()) return;
+        const auto in_packet = std::less_equal()(m_packet.data(), chunk.data()) and std::less_equal()(chunk.data() + chunk.size(), m_packet.data() + m_packet.size());
+        if(in_packet) context.indexed.append_recording(m_packet_offset + (chunk.data() - m_packet.data()), chunk.size());
+        else context.indexed.append_inline(chunk);
+    }
+
+    // Parses a run of at most POLL_PACKETS whole packets that starts at byte `offset` of the recording. The packets
+    // that matter are picked out first, then each goes to the parser of its PID kind.
+    auto parse_packets(const std::span<const std::uint8_t> packets, const std::uint64_t offset) -> void
+    {
+        const auto zone = trace_zone("parse packets");
+        auto filtered = filter_result();
+        {
+            const auto filter_zone = trace_zone("filter packets");
+            filtered = filter_packets(packets, 0, m_pid_kinds, m_descriptors);
+        }
+        if(filtered.out_of_sync > 0) std::println("WARNING: Out of sync detected in {} packets", filtered.out_of_sync);
+        for(auto i = 0uz; i < filtered.count; ++i)
+        {
+            const auto& descriptor = m_descriptors[i];
+            m_packet = packets.subspan(descriptor.offset, TS_PACKET_SIZE);
+            m_packet_offset = offset + descriptor.offset;
+            // Everything that gets past the PID lookup is what the extraction needs, the archive is just that
+            if(m_archive.is_open())
             {
-                // MY TODO: this is really inefficent I need to rip a lot of things to convert the payload to unsigned char
-                // It's safe at least
-                for(const auto s : chunk)m_current_output_file.put(s);
-                // fs.writeSync(this->m_current_output_file, chunk);
-                
-                //}catch(...) {
-                
-                   //return cb(err); 
-                //}
+                m_archive.write(m_packet);
+                m_archive_size += m_packet.size();
             }
-            /*else 
+            switch(m_pid_kinds[descriptor.pid])
             {
-                //MY TODO: MAKE IT WORK AND WHY DO WE NEED THIS
-                // this.buffer.set(this.fileDataRead, chunk);
-            }*/
-            
-            m_file_data_read += to_read;
-            
-            if(m_file_data_read >= this->eQHeader.file_size) 
+                case pid_kind::EQSAT: parse_eqsat(descriptor); break;
+                case pid_kind::PSI: parse_psi(descriptor); break;
+                case pid_kind::IGNORED: break;
+            }
+            if(not m_pids_changed) continue;
+            // The PAT or a PMT announced new PIDs, the rest of the run may have packets of them
+            m_pids_changed = false;
+            const auto next = descriptor.offset + TS_PACKET_SIZE;
+            filtered.count = filter_packets(packets, next, m_pid_kinds, m_descriptors).count;
+            i = -1uz;
+        }
+        m_packet = {};
+    }
+
+    auto parse_eqsat(const packet_descriptor& descriptor) -> void
+    {
+        auto& stream = find_stream(descriptor.pid);
+        // A packet the demodulator couldn't correct is a lost packet. Its counter can't be trusted either, the gap the
+        // next good packet leaves already includes it.
+        if(descriptor.transport_error())
+        {
+            if(stream.active >= 0) ++m_contexts[stream.active].losses;
+            ++stream.transport_errors;
+            return;
+        }
+        if(descriptor.payload_offset == 0) return;
+        // The counter goes up by one for every packet with a payload. Sent twice is allowed and the copy is dropped,
+        // anything else means packets were lost and the file that is being received has a hole (or garbage) in it.
+        const auto continuity = descriptor.continuity();
+        if(stream.continuity >= 0)
+        {
+            if(continuity == stream.continuity) return;
+            const auto missing = (continuity - stream.continuity - 1) & 0x0F;
+            const auto uncounted = missing - std::min(missing, stream.transport_errors);
+            if(uncounted > 0 and stream.active >= 0) m_contexts[stream.active].losses += uncounted;
+        }
+        stream.continuity = continuity;
+        stream.transport_errors = 0;
+        stream.pes.feed(descriptor.pusi(), m_packet.subspan(descriptor.payload_offset), [this, &stream](const auto data){consume_payload(stream, data);});
+    }
+
+    // Runs the EQSat state machine of a stream over a piece of data coming out of its pes_reassembler
+    auto consume_payload(eqsat_stream& stream, std::span<const std::uint8_t> payload) -> void
+    {
+        // The payload shrinks every time some of it is consumed
+        // e.g. by reading the header or filename
+        while(not payload.empty())
+        {
+            const auto state = stream.active < 0? STATE::SEARCHING_FOR_HEADER : m_contexts[stream.active].state;
+            auto consumed = 0uz;
+            switch(state)
             {
-                // MY TODO: Sometimes a healthy file gets overritten by a broken one. This usually happens with heavier files like videos. 
-                // Rostam Media does not provide a proper way to handle these types of errors so we have to verify the files on our own. 
-                // We can check the structure of certain files like videos or...
-                m_current_output_file.close();
-                std::filesystem::rename(m_output_path/(filename+".part"),m_output_path/filename);
-                std::println("Completed extraction of file:\n  {}", this->filename);
-                reset_state(false);
+                case STATE::SEARCHING_FOR_HEADER: consumed = search_for_header(stream, payload); break;
+                case STATE::READING_HEADER: consumed = read_eq_header(stream, payload); break;
+                case STATE::READING_FILENAME: consumed = read_filename(stream, payload); break;
+                case STATE::READING_FILE: consumed = read_file(stream, payload); break;
             }
+            payload = payload.subspan(consumed);
         }
     }
     
@@ -514,20 +1245,40 @@ export class rostam{
     private:
 
     std::filesystem::path m_output_path;
-    STATE m_state;
-    EQHeader eQHeader;
-    std::vector<unsigned char> m_buffer; // This is the final container for the output file. 
-    std::vector<int> currentEQHeader;
-    std::size_t currentEQHeaderBytesRead;
-    std::size_t previousPacketMagicBytePatternIndex;
-    std::ofstream m_current_output_file;
-    std::string filename;
-    std::size_t bufferLength;
-    std::size_t m_file_data_read;
+    extraction_options m_options;
+    pid_table m_pid_kinds;
+    bool m_pids_changed = false; // Set when the table gets a new PID, parse_packets filters the rest of its run again
+    std::vector<eqsat_stream> m_streams;
+    std::vector<file_context> m_contexts;
+    std::unique_ptr<uring_queue> m_uring;
+    psi_parser m_psi;
     std::atomic_bool m_cancel_flag;
     const bool m_debug;
-    static constexpr auto EQSAT_MAGIC_BYTES = std::to_array({0xCA, 0xFE, 0xC0, 0xDE, 0xF0, 0x0D, 0xCA, 0xFE, 0xC0, 0xDE, 0xF0, 0x0D});
+    static constexpr auto EQSAT_MAGIC_BYTES = std::to_array<std::uint8_t>({0xCA, 0xFE, 0xC0, 0xDE, 0xF0, 0x0D, 0xCA, 0xFE, 0xC0, 0xDE, 0xF0, 0x0D});
     static constexpr auto EQSAT_HEADER_SIZE = 30uz; // EQSat v2 header is 30 bytes long ; 
-    const std::function<void(int)> m_progress_callback;
+    static constexpr auto EQSAT_VERSION = 2;
+    static constexpr auto MAX_FILE_SIZE = std::size_t(64) << 30; // Far beyond anything broadcast
+    static constexpr auto MAX_SKIPPED_HEADERS = 1000uz;
+    static constexpr auto POLL_PACKETS = 256uz; // ~47 KiB, well under a millisecond of parsing
+    static_assert(std::tuple_size_v<decltype(file_context::currentEQHeader)> == EQSAT_HEADER_SIZE - EQSAT_MAGIC_BYTES.size());
+    static_assert(std::tuple_size_v<decltype(skipped_header::raw)> == EQSAT_HEADER_SIZE);
+    std::array<packet_descriptor, POLL_PACKETS> m_descriptors; // The packets of the run parse_packets is parsing
+    extraction_progress m_progress;
+    std::array<char, MAX_FILENAME_LENGTH> m_filename_scratch; // sanitize_filename writes here before it's copied into the context
+    storage::output_directory m_output_directory;
+    storage::output_directory m_archive_directory;
+    file_writer m_archive;
+    std::uint64_t m_archive_size = 0; // What was written to m_archive, it's part of the checkpoint
+    recording_index* m_index = nullptr; // Set while index() runs, files are only looked at then
+    std::span<const std::uint8_t> m_packet; // The packet parse_packets is parsing and where it is in the recording
+    std::uint64_t m_packet_offset = 0;
+    std::uint64_t m_input_end = 0; // Size of the recording, the maximum while it can still grow
+    std::vector<skipped_header> m_skipped_headers;
+    std::uint64_t m_skipped_header_count = 0;
+    carousel_tracker m_carousel; // Only used with extraction_options::stop_after_cycle
+    bool m_cycle_complete = false;
+    copy_keeper m_keeper; // after m_output_directory, these three use it
+    file_verifier m_verifier; // after m_keeper, it hands verified files to it
+    small_file_batch m_small_files; // after m_verifier, it hands completed files to it
 };
 
@@ -0,0 +1,394 @@
+module;
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+export module rostam_sink;
+
+// Where the extracted files go when they don't go to the output directory. The parser hands a sink every file as
+// it's received: begin_file when its name is known, its data as it arrives and end_file when it's complete or was
+// cut off. Files on different PIDs can be received at the same time, each has its own id. Ids are small numbers
+// that are used again once their file ended. Everything is called on the extracting thread. The files that are
+// being received when stop_after_cycle ends the extraction are copies of earlier ones, they get abandon_file instead
+// of end_file.
+export class output_sink
+{
+    public:
+
+    virtual ~output_sink() = default;
+
+    // `size` is what the header announced, a complete file has exactly that many bytes
+    virtual auto begin_file(std::uint32_t id, std::string_view name, std::uint64_t size) -> void = 0;
+    virtual auto write(std::uint32_t id, std::span<const std::uint8_t> data) -> void = 0;
+    // `losses` packets went missing on its PID while it was received
+    virtual auto end_file(std::uint32_t id, bool complete, std::uint64_t losses) -> void = 0;
+    // Drops what was received of the file, it isn't handed over or packed
+    virtual auto abandon_file(std::uint32_t) -> void {}
+    // The extraction is over, nothing is in progress anymore
+    virtual auto finish() -> void {}
+};
+
+// Drops everything. What is left is the cost of reading and demuxing the recording.
+export class null_sink
+:public output_sink
+{
+    public:
+
+    auto begin_file(std::uint32_t, std::string_view, std::uint64_t) -> void override {}
+    auto write(std::uint32_t, const std::span<const std::uint8_t> data) -> void override
+    {
+        m_bytes += data.size();
+    }
+    auto end_file(std::uint32_t, const bool complete, std::uint64_t) -> void override
+    {
+        if(complete) ++m_files;
+    }
+
+    auto bytes() const -> std::uint64_t
+    {
+        return m_bytes;
+    }
+
+    auto files() const -> std::uint64_t
+    {
+        return m_files;
+    }
+
+    private:
+
+    std::uint64_t m_bytes = 0;
+    std::uint64_t m_files = 0;
+};
+
+// Files that are held in memory until they ended. The buffers keep their capacity for the next file with the same id,
+// up to what a file is reserved at most.
+class buffered_files
+{
+    public:
+
+    struct file {
+        std::string name;
+        std::vector<std::uint8_t> data;
+    };
+
+    auto begin(const std::uint32_t id, const std::string_view name, const std::uint64_t size) -> void
+    {
+        if(id >= m_files.size()) m_files.resize(id + 1);
+        auto& file = m_files[id];
+        file.name.assign(name);
+        release(id);
+        // The header may lie about the size, never reserve more than a reasonable file
+        file.data.reserve(std::min<std::uint64_t>(size, RESERVE_LIMIT));
+    }
+
+    auto append(const std::uint32_t id, const std::span<const std::uint8_t> data) -> void
+    {
+        m_files.at(id).data.insert(m_files.at(id).data.end(), data.begin(), data.end());
+        m_held += data.size();
+    }
+
+    // Drops the data of the file, its name stays
+    auto release(const std::uint32_t id) -> void
+    {
+        auto& data = m_files.at(id).data;
+        m_held -= data.size();
+        data.clear();
+        if(data.capacity() > RESERVE_LIMIT) data = {};
+    }
+
+    auto operator[](const std::uint32_t id) -> file&
+    {
+        return m_files.at(id);
+    }
+
+    // Bytes of data held by all files
+    auto held() const -> std::uint64_t
+    {
+        return m_held;
+    }
+
+    // The id of the file that holds the most data
+    auto largest() const -> std::uint32_t
+    {
+        const auto found = std::ranges::max_element(m_files, {}, [](const file& file){ return file.data.size(); });
+        return static_cast<std::uint32_t>(found - m_files.begin());
+    }
+
+    private:
+
+    constexpr static auto RESERVE_LIMIT = std::uint64_t(64) << 20;
+    std::vector<file> m_files;
+    std::uint64_t m_held = 0;
+};
+
+// Hands every file to the embedder as one span once it ended, the files never touch the disk. The span is only valid
+// during the call. Every file is held in memory until then, for large files give it a chunk_callback instead: then
+// each piece is handed over as it arrives and nothing is held.
+export class memory_sink
+:public output_sink
+{
+    public:
+
+    using callback = std::function<void(std::string_view name, std::span<const std::uint8_t> data, bool complete, std::uint64_t losses)>;
+    // `offset` is where `data` goes in the file named `name`, files received at the same time have different ids.
+    // Once the file ended it's called one more time without data and with `ended` set, `complete` and `losses` are
+    // only meaningful then. An id that is still open at the end of the extraction was a copy, drop what it got.
+    using chunk_callback = std::function<void(std::uint32_t id, std::string_view name, std::uint64_t offset, std::span<const std::uint8_t> data,
+        bool ended, bool complete, std::uint64_t losses)>;
+
+    explicit memory_sink(callback on_file):
+    m_on_file(std::move(on_file))
+    {
+    }
+
+    explicit memory_sink(chunk_callback on_chunk):
+    m_on_chunk(std::move(on_chunk))
+    {
+    }
+
+    auto begin_file(const std::uint32_t id, const std::string_view name, const std::uint64_t size) -> void override
+    {
+        if(m_on_chunk)
+        {
+            if(id >= m_chunked.size()) m_chunked.resize(id + 1);
+            m_chunked[id] = {std::string(name), 0};
+        }
+        else m_files.begin(id, name, size);
+    }
+
+    auto write(const std::uint32_t id, const std::span<const std::uint8_t> data) -> void override
+    {
+        if(m_on_chunk)
+        {
+            auto& file = m_chunked.at(id);
+            m_on_chunk(id, file.name, file.size, data, false, false, 0);
+            file.size += data.size();
+        }
+        else m_files.append(id, data);
+    }
+
+    auto end_file(const std::uint32_t id, const bool complete, const std::uint64_t losses) -> void override
+    {
+        if(m_on_chunk)
+        {
+            const auto& file = m_chunked.at(id);
+            m_on_chunk(id, file.name, file.size, {}, true, complete, losses);
+            return;
+        }
+        auto& file = m_files[id];
+        m_on_file(file.name, file.data, complete, losses);
+        m_files.release(id);
+    }
+
+    auto abandon_file(const std::uint32_t id) -> void override
+    {
+        if(not m_on_chunk) m_files.release(id);
+    }
+
+    private:
+
+    struct chunked_file {
+        std::string name;
+        std::uint64_t size = 0; // Handed over so far
+    };
+
+    callback m_on_file;
+    chunk_callback m_on_chunk;
+    buffered_files m_files;
+    std::vector<chunked_file> m_chunked;
+};
+
+// Packs the files into a POSIX tar stream (to a file, a pipe, stdout...). Files received at the same time can't be
+// interleaved in a tar, so each is held until it ended and then written as one entry. Once the files being received
+// hold more than `memory_limit` bytes, the one holding the most goes on in a temporary file. Files that were cut off
+// are packed as <name>.part with what was received, like in the output directory. The end of the archive is written
+// by finish().
+export class tar_sink
+:public output_sink
+{
+    public:
+
+    constexpr static auto DEFAULT_MEMORY_LIMIT = std::uint64_t(256) << 20;
+
+    explicit tar_sink(const std::filesystem::path& archive, const std::uint64_t memory_limit = DEFAULT_MEMORY_LIMIT):
+    m_owned(std::make_unique<std::ofstream>(archive, std::ios::binary | std::ios::trunc)),
+    m_out(m_owned.get()),
+    m_memory_limit(memory_limit)
+    {
+        if(not *m_owned) throw std::runtime_error("[Rostam Core Error] Could not open the tar archive.");
+    }
+
+    explicit tar_sink(std::ostream& out, const std::uint64_t memory_limit = DEFAULT_MEMORY_LIMIT):
+    m_out(&out),
+    m_memory_limit(memory_limit)
+    {
+    }
+
+    auto begin_file(const std::uint32_t id, const std::string_view name, const std::uint64_t size) -> void override
+    {
+        m_files.begin(id, name, size);
+        if(id >= m_spools.size()) m_spools.resize(id + 1);
+        m_spools[id] = {};
+    }
+
+    auto write(const std::uint32_t id, const std::span<const std::uint8_t> data) -> void override
+    {
+        while(not m_spools.at(id).file and m_files.held() > 0 and m_files.held() + data.size() > m_memory_limit) spool(m_files.largest());
+        if(m_spools[id].file) m_spools[id].write(data);
+        else m_files.append(id, data);
+    }
+
+    auto end_file(const std::uint32_t id, const bool complete, std::uint64_t) -> void override
+    {
+        auto& file = m_files[id];
+        if(not complete) file.name += ".part";
+        if(auto& spooled = m_spools.at(id); spooled.file)
+        {
+            write_entry_header(file.name, spooled.size);
+            copy_spool(spooled);
+            write_padding(spooled.size);
+            spooled = {};
+        }
+        else
+        {
+            write_entry_header(file.name, file.data.size());
+            m_out->write(reinterpret_cast<const char*>(file.data.data()), static_cast<std::streamsize>(file.data.size()));
+            write_padding(file.data.size());
+            m_files.release(id);
+        }
+        if(not *m_out) throw std::runtime_error("[Rostam Core Error] Could not write the tar archive.");
+    }
+
+    auto abandon_file(const std::uint32_t id) -> void override
+    {
+        m_files.release(id);
+        m_spools.at(id) = {};
+    }
+
+    auto finish() -> void override
+    {
+        // Two empty blocks end the archive
+        const auto zeros = std::array<char, 2 * BLOCK>{};
+        m_out->write(zeros.data(), zeros.size());
+        if(not m_out->flush()) throw std::runtime_error("[Rostam Core Error] Could not write the tar archive.");
+    }
+
+    private:
+
+    constexpr static auto BLOCK = 512uz;
+    // The largest size the 11 octal digits of the ustar header hold, larger files need a pax size record
+    constexpr static auto MAX_USTAR_SIZE = (std::uint64_t(1) << 33) - 1;
+    using header = std::array<char, BLOCK>;
+
+    // A file that didn't fit in memory, removed as soon as it's closed
+    struct spool_file {
+        std::unique_ptr<std::FILE, decltype(&std::fclose)> file {nullptr, &std::fclose};
+        std::uint64_t size = 0;
+
+        auto write(const std::span<const std::uint8_t> data) -> void
+        {
+            if(std::fwrite(data.data(), 1, data.size(), file.get()) != data.size())
+                throw std::runtime_error("[Rostam Core Error] Could not write the temporary file of a large file for the tar archive.");
+            size += data.size();
+        }
+    };
+
+    auto spool(const std::uint32_t id) -> void
+    {
+        auto& spooled = m_spools.at(id);
+        spooled.file.reset(std::tmpfile());
+        if(not spooled.file) throw std::runtime_error("[Rostam Core Error] Could not create a temporary file for a large file of the tar archive.");
+        spooled.write(m_files[id].data);
+        m_files.release(id);
+    }
+
+    auto copy_spool(spool_file& spooled) -> void
+    {
+        std::rewind(spooled.file.get());
+        auto buffer = std::vector<char>(1 << 20);
+        for(auto left = spooled.size; left > 0;)
+        {
+            const auto piece = static_cast<std::size_t>(std::min<std::uint64_t>(left, buffer.size()));
+            if(std::fread(buffer.data(), 1, piece, spooled.file.get()) != piece)
+                throw std::runtime_error("[Rostam Core Error] Could not read the temporary file of a large file for the tar archive.");
+            m_out->write(buffer.data(), static_cast<std::streamsize>(piece));
+            left -= piece;
+        }
+    }
+
+    // ustar only has room for 100 bytes of name and sizes below 8 GiB. Anything larger goes in a pax header in front.
+    auto write_entry_header(const std::string_view name, const std::uint64_t size) -> void
+    {
+        auto records = std::string();
+        if(name.size() > 100) records += pax_record("path", name);
+        if(size > MAX_USTAR_SIZE) records += pax_record("size", std::to_string(size));
+        if(not records.empty())
+        {
+            write_header("pax_header", records.size(), 'x');
+            m_out->write(records.data(), static_cast<std::streamsize>(records.size()));
+            write_padding(records.size());
+        }
+        // The size the pax header carries is left 0 here, like other pax writers do
+        write_header(name.substr(0, 100), size > MAX_USTAR_SIZE? 0 : size, '0');
+    }
+
+    // "<length> <key>=<value>\n", the length counts itself
+    static auto pax_record(const std::string_view key, const std::string_view value) -> std::string
+    {
+        const auto record_size = [&](const std::size_t digits){ return digits + 3 + key.size() + value.size(); };
+        auto digits = std::to_string(record_size(1)).size();
+        while(std::to_string(record_size(digits)).size() != digits) ++digits;
+        return std::to_string(record_size(digits)) + ' ' + std::string(key) + '=' + std::string(value) + '\n';
+    }
+
+    auto write_header(const std::string_view name, const std::uint64_t size, const char type) -> void
+    {
+        auto block = header{};
+        std::ranges::copy(name, block.begin());
+        octal(std::span(block).subspan(100, 8), 0644); // mode
+        octal(std::span(block).subspan(108, 8), 0); // uid
+        octal(std::span(block).subspan(116, 8), 0); // gid
+        octal(std::span(block).subspan(124, 12), size);
+        octal(std::span(block).subspan(136, 12), 0); // mtime, the recording doesn't say
+        block[156] = type;
+        std::ranges::copy(std::string_view("ustar\0" "00", 8), block.begin() + 257);
+        // The checksum is computed with its own field filled with spaces
+        std::ranges::fill(std::span(block).subspan(148, 8), ' ');
+        auto checksum = 0u;
+        for(const auto c : block) checksum += static_cast<unsigned char>(c);
+        octal(std::span(block).subspan(148, 7), checksum);
+        m_out->write(block.data(), block.size());
+    }
+
+    // The data of an entry is padded to whole blocks
+    auto write_padding(const std::uint64_t size) -> void
+    {
+        const auto zeros = header{};
+        m_out->write(zeros.data(), static_cast<std::streamsize>((BLOCK - size % BLOCK) % BLOCK));
+    }
+
+    // Zero padded and NUL terminated, the way tar writes its numbers
+    static auto octal(const std::span<char> field, std::uint64_t value) -> void
+    {
+        field.back() = '\0';
+        for(auto i = field.size() - 1; i-- > 0; value /= 8) field[i] = static_cast<char>('0' + value % 8);
+    }
+
+    std::unique_ptr<std::ofstream> m_owned;
+    std::ostream* m_out;
+    std::uint64_t m_memory_limit;
+    buffered_files m_files;
+    std::vector<spool_file> m_spools; // By id, open for the files that went on in a temporary file
+};
@@ -0,0 +1,223 @@
+module;
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+#if __unix__
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+export module rostam_storage;
+
+// Platform specific bits of writing the extracted files and of the disk space they need.
+export namespace storage
+{
+    // The directory the files are extracted to. On unix it stays open and files are created and renamed relative to it
+    // (openat/renameat), so no full path has to be built and resolved for every file.
+    class output_directory
+    {
+        public:
+
+        output_directory() = default;
+        output_directory(const output_directory&) = delete;
+        auto operator=(const output_directory&) -> output_directory& = delete;
+
+        ~output_directory()
+        {
+            close();
+        }
+
+        auto open(const std::filesystem::path& directory) -> void
+        {
+            if(directory == m_path and is_open()) return;
+            close();
+            #if __unix__
+            m_fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if(m_fd < 0) throw std::runtime_error("[Rostam Core Error] Could not open the output directory.");
+            #endif
+            m_path = directory;
+        }
+
+        auto is_open() const -> bool
+        {
+            #if __unix__
+            return m_fd >= 0;
+            #else
+            return not m_path.empty();
+            #endif
+        }
+
+        auto path() const -> const std::filesystem::path&
+        {
+            return m_path;
+        }
+
+        // -1 where there is no such thing
+        auto fd() const -> int
+        {
+            return m_fd;
+        }
+
+        auto rename(const char* from, const char* to) const -> void
+        {
+            #if __unix__
+            if(::renameat(m_fd, from, m_fd, to) != 0)
+                throw std::system_error(errno, std::system_category(), std::format("[Rostam Core Error] Could not rename {}", from));
+            #else
+            std::filesystem::rename(m_path/from, m_path/to);
+            #endif
+        }
+
+        auto exists(const char* name) const -> bool
+        {
+            #if __unix__
+            return ::faccessat(m_fd, name, F_OK, 0) == 0;
+            #else
+            auto error = std::error_code();
+            return std::filesystem::exists(m_path/name, error);
+            #endif
+        }
+
+        // Missing files are fine, they are gone either way
+        auto remove(const char* name) const -> void
+        {
+            #if __unix__
+            if(::unlinkat(m_fd, name, 0) != 0 and errno != ENOENT)
+                throw std::system_error(errno, std::system_category(), std::format("[Rostam Core Error] Could not remove {}", name));
+            #else
+            std::filesystem::remove(m_path/name);
+            #endif
+        }
+
+        private:
+
+        auto close() -> void
+        {
+            #if __unix__
+            if(m_fd >= 0) ::close(std::exchange(m_fd, -1));
+            #endif
+            m_path.clear();
+        }
+
+        std::filesystem::path m_path;
+        int m_fd = -1;
+    };
+
+    // Reserves disk blocks for a file that is about to be written sequentially so it doesn't get fragmented
+    // and the filesystem doesn't update its metadata on every write. Returns false if the filesystem can't do it.
+    // Only Linux can reserve them without changing the visible size, which has to stay what a .part file received.
+    // posix_fallocate would grow the file to its full size (and glibc emulates it by writing zeros), so it isn't used.
+    auto preallocate([[maybe_unused]] const int fd, [[maybe_unused]] const std::uint64_t size) -> bool
+    {
+        #if __linux__
+        if(fd < 0) return false;
+        return ::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(size)) == 0;
+        #else
+        return false;
+        #endif
+    }
+
+    // Gives back what preallocate reserved past the end of the file, for a file that won't get the rest of its data.
+    // Truncating to the size it already has doesn't change it, only drops the blocks behind it.
+    auto release_preallocated([[maybe_unused]] const int fd) -> void
+    {
+        #if __linux__
+        struct stat info {};
+        if(fd >= 0 and ::fstat(fd, &info) == 0) static_cast<void>(::ftruncate(fd, info.st_size));
+        #endif
+    }
+
+    // Gives the disk space of the part of the recording that was already extracted back to the filesystem (punches a
+    // hole in it) while the rest is still being read. A recording and the files in it don't have to fit on the disk at
+    // the same time then. Only Linux can do it, elsewhere open() says no and the recording can only be removed at the end.
+    class input_releaser
+    {
+        public:
+
+        input_releaser() = default;
+        input_releaser(const input_releaser&) = delete;
+        auto operator=(const input_releaser&) -> input_releaser& = delete;
+
+        ~input_releaser()
+        {
+            close();
+        }
+
+        // False if the recording can't be opened for writing
+        auto open([[maybe_unused]] const std::filesystem::path& input) -> bool
+        {
+            close();
+            #if __linux__
+            m_fd = ::open(input.c_str(), O_WRONLY | O_CLOEXEC);
+            if(m_fd < 0) return false;
+            struct stat info {};
+            if(::fstat(m_fd, &info) != 0)
+            {
+                close();
+                return false;
+            }
+            m_modified = info.st_mtim;
+            m_released = 0;
+            return true;
+            #else
+            return false;
+            #endif
+        }
+
+        auto is_open() const -> bool
+        {
+            return m_fd >= 0;
+        }
+
+        // Releases everything before `offset` that wasn't released yet. The recording keeps its size and its
+        // modification time, so a checkpoint still recognizes it. Returns false once the filesystem refused.
+        auto release([[maybe_unused]] std::uint64_t offset) -> bool
+        {
+            #if __linux__
+            if(m_fd < 0) return false;
+            offset -= offset % RELEASE_ALIGNMENT; // Only whole blocks are freed anyway
+            if(offset <= m_released) return true;
+            if(::fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(m_released), static_cast<off_t>(offset - m_released)) != 0)
+            {
+                close();
+                return false;
+            }
+            m_released = offset;
+            const struct timespec times[2] = {{0, UTIME_OMIT}, m_modified};
+            ::futimens(m_fd, times);
+            return true;
+            #else
+            return false;
+            #endif
+        }
+
+        auto close() -> void
+        {
+            #if __unix__
+            if(m_fd >= 0) ::close(std::exchange(m_fd, -1));
+            #endif
+        }
+
+        private:
+
+        constexpr static auto RELEASE_ALIGNMENT = std::uint64_t(1) << 20;
+        int m_fd = -1;
+        std::uint64_t m_released = 0;
+        #if __linux__
+        struct timespec m_modified {};
+        #endif
+    };
+
+    // If we can't even find out, let the write fail later instead of refusing to extract.
+    auto has_free_space(const std::filesystem::path& directory, const std::uint64_t bytes) -> bool
+    {
+        auto error = std::error_code();
+        const auto info = std::filesystem::space(directory, error);
+        if(error) return true;
+        return info.available >= bytes;
+    }
+}
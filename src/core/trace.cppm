@@ -0,0 +1,180 @@
+module;
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+export module rostam_trace;
+
+// Where the time of an extraction goes: scoped zones around the stages of the hot path, exported as a Chrome trace
+// (chrome://tracing or ui.perfetto.dev). Only there when the core is built with ROSTAM_TRACE, otherwise a zone is an
+// empty object and the export writes an empty trace.
+#if ROSTAM_TRACE
+export constexpr auto TRACE_ENABLED = true;
+#else
+export constexpr auto TRACE_ENABLED = false;
+#endif
+
+#if ROSTAM_TRACE
+namespace trace_detail {
+
+struct event {
+    const char* name = nullptr;
+    std::uint64_t start = 0; // ns since the first zone of the process
+    std::uint64_t duration = 0;
+};
+
+// The zones a thread recorded, only ever written by that thread. Once it's full the oldest ones are overwritten.
+struct event_ring {
+    constexpr static auto CAPACITY = 1uz << 16; // 1.5 MiB, a few seconds of extracting with every zone on
+
+    std::array<event, CAPACITY> events;
+    std::atomic<std::uint64_t> recorded = 0;
+    std::uint32_t thread = 0;
+    const char* name = nullptr;
+    std::atomic<bool> exited = false;
+};
+
+struct registry {
+    std::mutex mutex;
+    std::vector<std::shared_ptr<event_ring>> rings;
+    std::uint32_t next_thread = 1;
+    const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+};
+
+auto get_registry() -> registry&
+{
+    static auto instance = registry();
+    return instance;
+}
+
+// The ring of the calling thread, made on its first zone. The registry keeps it after the thread exited so its
+// zones can still be exported.
+auto thread_ring() -> event_ring&
+{
+    struct owner {
+        std::shared_ptr<event_ring> ring;
+        ~owner()
+        {
+            if(ring) ring->exited = true;
+        }
+    };
+    thread_local auto current = owner();
+    if(not current.ring)
+    {
+        current.ring = std::make_shared<event_ring>();
+        auto& shared = get_registry();
+        const auto lock = std::lock_guard(shared.mutex);
+        current.ring->thread = shared.next_thread++;
+        shared.rings.push_back(current.ring);
+    }
+    return *current.ring;
+}
+
+auto now() -> std::uint64_t
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - get_registry().epoch).count();
+}
+
+}
+#endif
+
+// Records the time from its construction to its destruction under `name`. The name is kept as a pointer, it has to
+// be a string literal. Constructor and destructor are inline (member functions of a module aren't by default), so other
+// modules get a disabled zone compiled out instead of a call to an empty function.
+export class trace_zone
+{
+    public:
+
+    inline explicit trace_zone([[maybe_unused]] const char* name) noexcept
+    #if ROSTAM_TRACE
+    :m_name(name),
+    m_start(trace_detail::now())
+    #endif
+    {
+    }
+
+    trace_zone(const trace_zone&) = delete;
+    auto operator=(const trace_zone&) -> trace_zone& = delete;
+
+    inline ~trace_zone()
+    {
+        #if ROSTAM_TRACE
+        auto& ring = trace_detail::thread_ring();
+        const auto recorded = ring.recorded.load(std::memory_order_relaxed);
+        ring.events[recorded % ring.CAPACITY] = {m_name, m_start, trace_detail::now() - m_start};
+        ring.recorded.store(recorded + 1, std::memory_order_release);
+        #endif
+    }
+
+    private:
+
+    #if ROSTAM_TRACE
+    const char* m_name;
+    std::uint64_t m_start;
+    #endif
+};
+
+// Names the calling thread in the trace, a string literal like the zone names
+export auto trace_thread_name([[maybe_unused]] const char* name) -> void
+{
+    #if ROSTAM_TRACE
+    trace_detail::thread_ring().name = name;
+    #endif
+}
+
+// Writes the zones recorded so far as Chrome trace JSON. Call it while the traced threads are idle (e.g. after
+// extract returned), zones that end during the export may come out torn.
+export auto write_chrome_trace(std::ostream& out) -> void
+{
+    out << "{\"traceEvents\":[";
+    #if ROSTAM_TRACE
+    auto& shared = trace_detail::get_registry();
+    const auto lock = std::lock_guard(shared.mutex);
+    auto first = true;
+    const auto separator = [&first]{ return std::exchange(first, false)? "\n" : ",\n"; };
+    for(const auto& ring : shared.rings)
+    {
+        if(ring->name) out << separator() << std::format(R"({{"ph":"M","name":"thread_name","pid":1,"tid":{},"args":{{"name":"{}"}}}})", ring->thread, ring->name);
+        const auto recorded = ring->recorded.load(std::memory_order_acquire);
+        const auto kept = std::min<std::uint64_t>(recorded, ring->CAPACITY);
+        for(auto i = recorded - kept; i < recorded; ++i)
+        {
+            const auto& event = ring->events[i % ring->CAPACITY];
+            // Chrome wants microseconds, the fraction keeps the nanoseconds
+            out << separator() << std::format(R"({{"ph":"X","name":"{}","pid":1,"tid":{},"ts":{}.{:03},"dur":{}.{:03}}})",
+                event.name, ring->thread, event.start / 1000, event.start % 1000, event.duration / 1000, event.duration % 1000);
+        }
+    }
+    #endif
+    out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+    if(not out) throw std::runtime_error("[Rostam Core Error] Could not write the trace.");
+}
+
+export auto write_chrome_trace(const std::filesystem::path& path) -> void
+{
+    auto out = std::ofstream(path, std::ios::trunc);
+    if(not out) throw std::runtime_error("[Rostam Core Error] Could not create the trace file.");
+    write_chrome_trace(out);
+}
+
+// Forgets the zones recorded so far and the rings of threads that exited. Like the export, while the threads are idle.
+export auto clear_trace() -> void
+{
+    #if ROSTAM_TRACE
+    auto& shared = trace_detail::get_registry();
+    const auto lock = std::lock_guard(shared.mutex);
+    std::erase_if(shared.rings, [](const auto& ring){ return ring->exited.load(); });
+    for(const auto& ring : shared.rings) ring->recorded = 0;
+    #endif
+}
@@ -0,0 +1,148 @@
+module;
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+#if ROSTAM_HAS_IO_URING
+#include <liburing.h>
+#endif
+export module rostam_uring;
+
+// A thin wrapper around one io_uring instance shared by the reader and the writers of an extraction.
+// It's only compiled in when liburing was found (ROSTAM_HAS_IO_URING). create() returns nullptr
+// otherwise or when the kernel refuses (old kernels, seccomp in containers) and everyone falls back to the portable path.
+export class uring_queue
+{
+    public:
+
+    // One in-flight operation. It must stay where it is until wait() returned for it.
+    struct request {
+        bool pending = false;
+        int result = 0;
+    };
+
+    // Buffers for asynchronous writes. They are recycled so a steady stream of files doesn't allocate.
+    struct write_buffer {
+        std::vector<std::uint8_t> data;
+        std::size_t used = 0;
+        std::uint64_t offset = 0;
+        request req;
+    };
+
+    constexpr static auto WRITE_BUFFER_SIZE = 1uz << 20;
+
+    static auto create([[maybe_unused]] const unsigned depth = 64) -> std::unique_ptr<uring_queue>
+    {
+        #if ROSTAM_HAS_IO_URING
+        auto queue = std::unique_ptr<uring_queue>(new uring_queue());
+        if(io_uring_queue_init(depth, &queue->m_ring, 0) < 0) return nullptr;
+        queue->m_initialized = true;
+        return queue;
+        #else
+        return nullptr;
+        #endif
+    }
+
+    uring_queue(const uring_queue&) = delete;
+    auto operator=(const uring_queue&) -> uring_queue& = delete;
+
+    ~uring_queue()
+    {
+        #if ROSTAM_HAS_IO_URING
+        if(m_initialized) io_uring_queue_exit(&m_ring);
+        #endif
+    }
+
+    auto read([[maybe_unused]] const int fd, [[maybe_unused]] const std::span<std::uint8_t> buffer, [[maybe_unused]] const std::uint64_t offset, request& req) -> void
+    {
+        req = {true, 0};
+        #if ROSTAM_HAS_IO_URING
+        auto* sqe = get_sqe();
+        io_uring_prep_read(sqe, fd, buffer.data(), buffer.size(), offset);
+        io_uring_sqe_set_data(sqe, &req);
+        #endif
+    }
+
+    auto write([[maybe_unused]] const int fd, [[maybe_unused]] const std::span<const std::uint8_t> buffer, [[maybe_unused]] const std::uint64_t offset, request& req) -> void
+    {
+        req = {true, 0};
+        #if ROSTAM_HAS_IO_URING
+        auto* sqe = get_sqe();
+        io_uring_prep_write(sqe, fd, buffer.data(), buffer.size(), offset);
+        io_uring_sqe_set_data(sqe, &req);
+        #endif
+    }
+
+    auto submit() -> void
+    {
+        #if ROSTAM_HAS_IO_URING
+        if(const auto result = io_uring_submit(&m_ring); result < 0) throw std::system_error(-result, std::system_category(), "[Rostam Core Error] io_uring_submit failed");
+        #endif
+    }
+
+    // Reaps completions (of any request) until `req` is done and returns its result (bytes or -errno)
+    auto wait(request& req) -> int
+    {
+        #if ROSTAM_HAS_IO_URING
+        submit();
+        while(req.pending)
+        {
+            io_uring_cqe* cqe = nullptr;
+            if(const auto result = io_uring_wait_cqe(&m_ring, &cqe); result < 0)
+            {
+                if(result == -EINTR) continue;
+                throw std::system_error(-result, std::system_category(), "[Rostam Core Error] io_uring_wait_cqe failed");
+            }
+            auto* done = static_cast<request*>(io_uring_cqe_get_data(cqe));
+            done->result = cqe->res;
+            done->pending = false;
+            io_uring_cqe_seen(&m_ring, cqe);
+        }
+        #endif
+        return req.result;
+    }
+
+    auto take_buffer() -> std::unique_ptr<write_buffer>
+    {
+        if(m_free_buffers.empty())
+        {
+            auto buffer = std::make_unique<write_buffer>();
+            buffer->data.resize(WRITE_BUFFER_SIZE);
+            return buffer;
+        }
+        auto buffer = std::move(m_free_buffers.back());
+        m_free_buffers.pop_back();
+        buffer->used = 0;
+        return buffer;
+    }
+
+    auto give_back(std::unique_ptr<write_buffer> buffer) -> void
+    {
+        m_free_buffers.push_back(std::move(buffer));
+    }
+
+    private:
+
+    uring_queue() = default;
+
+    #if ROSTAM_HAS_IO_URING
+    auto get_sqe() -> io_uring_sqe*
+    {
+        auto* sqe = io_uring_get_sqe(&m_ring);
+        if(sqe) return sqe;
+        // The submission queue is full. Hand what we have to the kernel and try again.
+        submit();
+        sqe = io_uring_get_sqe(&m_ring);
+        if(not sqe) throw std::runtime_error("[Rostam Core Error] io_uring submission queue is full");
+        return sqe;
+    }
+
+    io_uring m_ring {};
+    #endif
+    bool m_initialized = false;
+    std::vector<std::unique_ptr<write_buffer>> m_free_buffers;
+};
@@ -0,0 +1,614 @@
+module;
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <initializer_list>
+#include <mutex>
+#include <print>
+#include <span>
+#include <stdexcept>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+#if __unix__
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+export module rostam_verify;
+import rostam_storage;
+import rostam_quality;
+import rostam_trace;
+
+// Same workaround as in rostam.cppm, std::println throws on windows when the console is disabled.
+#if _WIN32
+#define println _dummy_println_win_
+namespace std {
+    template <class... T>
+    void _dummy_println_win_ ([[maybe_unused]] const T&... _)
+    {
+        // Do nothing
+    }
+};
+#endif
+
+// Sometimes a healthy file gets overwritten by a broken copy that was received later. Rostam Media doesn't give us
+// checksums, so completed files are checked against the structure of their container instead: MP4 box tree,
+// ZIP central directory, JPEG markers, PNG chunks (with their CRCs) and the Matroska/WebM EBML tree.
+// Formats we don't know pass as they are.
+
+struct verification {
+    bool ok = true;
+    std::string_view format; // Empty when the format isn't known
+    std::uint64_t offset = 0; // Where the structure is broken
+    std::string_view problem;
+};
+
+// Random access to a completed file. Only the headers are read for most formats.
+class file_source
+{
+    public:
+
+    file_source(const storage::output_directory& directory, const char* name)
+    {
+        #if __unix__
+        m_fd = ::openat(directory.fd(), name, O_RDONLY | O_CLOEXEC);
+        if(m_fd < 0) throw std::runtime_error("the file is gone");
+        struct stat info {};
+        if(::fstat(m_fd, &info) != 0)
+        {
+            ::close(m_fd);
+            throw std::runtime_error("the file is gone");
+        }
+        m_size = info.st_size;
+        #else
+        m_file.open(directory.path()/name, std::ios::binary);
+        if(not m_file) throw std::runtime_error("the file is gone");
+        m_size = std::filesystem::file_size(directory.path()/name);
+        #endif
+    }
+
+    file_source(const file_source&) = delete;
+    auto operator=(const file_source&) -> file_source& = delete;
+
+    ~file_source()
+    {
+        #if __unix__
+        if(m_fd >= 0) ::close(m_fd);
+        #endif
+    }
+
+    auto size() const -> std::uint64_t
+    {
+        return m_size;
+    }
+
+    // True if all of `buffer` could be read from `offset`
+    auto read(const std::uint64_t offset, const std::span<std::uint8_t> buffer) -> bool
+    {
+        if(offset > m_size or buffer.size() > m_size - offset) return false;
+        #if __unix__
+        auto done = 0uz;
+        while(done < buffer.size())
+        {
+            const auto result = ::pread(m_fd, buffer.data() + done, buffer.size() - done, static_cast<off_t>(offset + done));
+            if(result < 0 and errno == EINTR) continue;
+            if(result <= 0) return false;
+            done += result;
+        }
+        return true;
+        #else
+        m_file.clear();
+        m_file.seekg(static_cast<std::streamoff>(offset));
+        m_file.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
+        return static_cast<std::size_t>(m_file.gcount()) == buffer.size();
+        #endif
+    }
+
+    private:
+
+    #if __unix__
+    int m_fd = -1;
+    #else
+    std::ifstream m_file;
+    #endif
+    std::uint64_t m_size = 0;
+};
+
+auto be32(const std::span<const std::uint8_t> bytes, const std::size_t at) -> std::uint32_t
+{
+    return std::uint32_t(bytes[at]) << 24 | std::uint32_t(bytes[at + 1]) << 16 | std::uint32_t(bytes[at + 2]) << 8 | bytes[at + 3];
+}
+
+auto be64(const std::span<const std::uint8_t> bytes, const std::size_t at) -> std::uint64_t
+{
+    return std::uint64_t(be32(bytes, at)) << 32 | be32(bytes, at + 4);
+}
+
+auto le16(const std::span<const std::uint8_t> bytes, const std::size_t at) -> std::uint16_t
+{
+    return bytes[at] | bytes[at + 1] << 8;
+}
+
+auto le32(const std::span<const std::uint8_t> bytes, const std::size_t at) -> std::uint32_t
+{
+    return le16(bytes, at) | std::uint32_t(le16(bytes, at + 2)) << 16;
+}
+
+auto le64(const std::span<const std::uint8_t> bytes, const std::size_t at) -> std::uint64_t
+{
+    return le32(bytes, at) | std::uint64_t(le32(bytes, at + 4)) << 32;
+}
+
+auto pass(const std::string_view format) -> verification
+{
+    return {true, format, 0, {}};
+}
+
+auto fail(const std::string_view format, const std::uint64_t offset, const std::string_view problem) -> verification
+{
+    return {false, format, offset, problem};
+}
+
+////// MP4 (ISO BMFF) //////
+
+// Boxes that only hold other boxes. Their children have to fill them exactly.
+auto is_mp4_container(const std::span<const std::uint8_t, 4> type) -> bool
+{
+    constexpr static auto containers = std::to_array<std::string_view>({"moov", "trak", "mdia", "minf", "stbl", "edts", "dinf", "mvex", "moof", "traf", "mfra"});
+    const auto name = std::string_view(reinterpret_cast<const char*>(type.data()), type.size());
+    return std::ranges::find(containers, name) != containers.end();
+}
+
+auto walk_mp4(file_source& file, const std::uint64_t begin, const std::uint64_t end, const int depth, bool& has_moov) -> verification
+{
+    constexpr auto format = std::string_view("MP4");
+    auto offset = begin;
+    while(offset < end)
+    {
+        auto header = std::array<std::uint8_t, 16>();
+        if(end - offset < 8 or not file.read(offset, std::span(header).first(8))) return fail(format, offset, "truncated box header");
+        auto size = std::uint64_t(be32(header, 0));
+        auto header_size = 8uz;
+        const auto type = std::span(header).subspan<4, 4>();
+        if(not std::ranges::all_of(type, [](const auto c){ return c >= 0x20 and c < 0x7F; })) return fail(format, offset, "not a box");
+        if(size == 1)
+        {
+            if(end - offset < 16 or not file.read(offset + 8, std::span(header).subspan(8, 8))) return fail(format, offset, "truncated box header");
+            size = be64(header, 8);
+            header_size = 16;
+        }
+        else if(size == 0) size = end - offset; // the last box may extend to the end of the file
+        if(size < header_size) return fail(format, offset, "box smaller than its header");
+        if(size > end - offset) return fail(format, offset, "box runs past the end of its parent");
+        if(depth == 0 and std::ranges::equal(type, std::string_view("moov"))) has_moov = true;
+        if(is_mp4_container(type) and depth < 8)
+        {
+            if(const auto inner = walk_mp4(file, offset + header_size, offset + size, depth + 1, has_moov); not inner.ok) return inner;
+        }
+        offset += size;
+    }
+    return pass(format);
+}
+
+auto verify_mp4(file_source& file) -> verification
+{
+    auto has_moov = false;
+    if(auto result = walk_mp4(file, 0, file.size(), 0, has_moov); not result.ok) return result;
+    if(not has_moov) return fail("MP4", 0, "no moov box, the file can't be played");
+    return pass("MP4");
+}
+
+////// ZIP //////
+
+auto verify_zip(file_source& file) -> verification
+{
+    constexpr auto format = std::string_view("ZIP");
+    constexpr auto EOCD_SIZE = 22uz;
+    // The end of central directory record is followed by a comment of up to 64 KiB
+    const auto tail_size = std::min<std::uint64_t>(file.size(), EOCD_SIZE + 0xFFFF);
+    const auto tail_offset = file.size() - tail_size;
+    auto tail = std::vector<std::uint8_t>(tail_size);
+    if(not file.read(tail_offset, tail)) return fail(format, tail_offset, "unreadable");
+    auto eocd = -1ll;
+    for(auto at = static_cast<long long>(tail_size) - static_cast<long long>(EOCD_SIZE); at >= 0; --at)
+    {
+        if(le32(tail, at) == 0x06054B50 and at + EOCD_SIZE + le16(tail, at + 20) == tail_size)
+        {
+            eocd = at;
+            break;
+        }
+    }
+    if(eocd < 0) return fail(format, file.size(), "no end of central directory record");
+    const auto eocd_offset = tail_offset + eocd;
+    auto entries = std::uint64_t(le16(tail, eocd + 10));
+    auto directory_size = std::uint64_t(le32(tail, eocd + 12));
+    auto directory_offset = std::uint64_t(le32(tail, eocd + 16));
+    auto directory_end = eocd_offset;
+    if(directory_offset == 0xFFFFFFFF or entries == 0xFFFF)
+    {
+        // ZIP64, the real numbers are in a record the locator in front of the EOCD points to
+        auto locator = std::array<std::uint8_t, 20>();
+        if(eocd_offset < locator.size() or not file.read(eocd_offset - locator.size(), locator) or le32(locator, 0) != 0x07064B50)
+            return fail(format, eocd_offset, "no ZIP64 end of central directory locator");
+        const auto record_offset = le64(locator, 8);
+        auto record = std::array<std::uint8_t, 56>();
+        if(not file.read(record_offset, record) or le32(record, 0) != 0x06064B50) return fail(format, record_offset, "broken ZIP64 end of central directory record");
+        entries = le64(record, 32);
+        directory_size = le64(record, 40);
+        directory_offset = le64(record, 48);
+        directory_end = record_offset;
+    }
+    if(directory_offset > directory_end or directory_size > directory_end - directory_offset) return fail(format, eocd_offset, "central directory outside of the file");
+
+    auto offset = directory_offset;
+    for(auto entry = std::uint64_t(); entry < entries; ++entry)
+    {
+        auto header = std::array<std::uint8_t, 46>();
+        if(offset + header.size() > directory_end or not file.read(offset, header) or le32(header, 0) != 0x02014B50) return fail(format, offset, "broken central directory entry");
+        // Local headers of ZIP64 entries are behind an extra field, only the 32 bit ones are checked
+        if(const auto local = std::uint64_t(le32(header, 42)); local != 0xFFFFFFFF)
+        {
+            auto signature = std::array<std::uint8_t, 4>();
+            if(local >= directory_offset or not file.read(local, signature) or le32(signature, 0) != 0x04034B50) return fail(format, local, "missing local file header");
+        }
+        offset += header.size() + le16(header, 28) + le16(header, 30) + le16(header, 32);
+    }
+    if(offset > directory_end) return fail(format, directory_offset, "central directory runs past its end");
+    return pass(format);
+}
+
+////// JPEG //////
+
+auto verify_jpeg(file_source& file) -> verification
+{
+    constexpr auto format = std::string_view("JPEG");
+    auto offset = std::uint64_t(2); // after SOI
+    while(true)
+    {
+        auto marker = std::array<std::uint8_t, 4>();
+        if(not file.read(offset, std::span(marker).first(2))) return fail(format, offset, "truncated before the image data");
+        if(marker[0] != 0xFF) return fail(format, offset, "expected a marker");
+        if(marker[1] == 0xFF)
+        {
+            ++offset; // fill byte
+            continue;
+        }
+        if(marker[1] == 0xD9) return fail(format, offset, "end of image before the image data");
+        if(marker[1] == 0x01 or (marker[1] >= 0xD0 and marker[1] <= 0xD7))
+        {
+            offset += 2;
+            continue;
+        }
+        if(not file.read(offset + 2, std::span(marker).subspan(2))) return fail(format, offset, "truncated segment");
+        const auto length = (marker[2] << 8) | marker[3];
+        if(length < 2 or offset + 2 + length > file.size()) return fail(format, offset, "segment runs past the end of the file");
+        offset += 2 + length;
+        if(marker[1] == 0xDA) break; // Start of scan, entropy coded data follows
+    }
+    // Encoders and muxers sometimes pad the end, the EOI has to be close to it though
+    const auto tail_size = std::min<std::uint64_t>(file.size() - offset, 64);
+    auto tail = std::vector<std::uint8_t>(tail_size);
+    if(not file.read(file.size() - tail_size, tail)) return fail(format, file.size(), "unreadable");
+    for(auto at = tail_size; at >= 2; --at)
+        if(tail[at - 2] == 0xFF and tail[at - 1] == 0xD9) return pass(format);
+    return fail(format, file.size(), "no end of image marker");
+}
+
+////// PNG //////
+
+constexpr auto CRC32_TABLE = []{
+    auto table = std::array<std::uint32_t, 256>();
+    for(auto n = 0u; n < table.size(); ++n)
+    {
+        auto c = n;
+        for(auto k = 0; k < 8; ++k) c = c & 1? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        table[n] = c;
+    }
+    return table;
+}();
+
+auto crc32(std::uint32_t crc, const std::span<const std::uint8_t> bytes) -> std::uint32_t
+{
+    for(const auto byte : bytes) crc = CRC32_TABLE[(crc ^ byte) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+auto verify_png(file_source& file) -> verification
+{
+    constexpr auto format = std::string_view("PNG");
+    auto offset = std::uint64_t(8); // after the signature
+    auto buffer = std::vector<std::uint8_t>(64 << 10);
+    auto first = true;
+    while(true)
+    {
+        auto header = std::array<std::uint8_t, 8>();
+        if(not file.read(offset, header)) return fail(format, offset, "no IEND chunk");
+        const auto length = std::uint64_t(be32(header, 0));
+        const auto type = std::span(header).subspan<4, 4>();
+        if(length > 0x7FFFFFFF or not std::ranges::all_of(type, [](const auto c){ return (c >= 'A' and c <= 'Z') or (c >= 'a' and c <= 'z'); }))
+            return fail(format, offset, "broken chunk header");
+        if(offset + 12 + length > file.size()) return fail(format, offset, "chunk runs past the end of the file");
+        if(first and not std::ranges::equal(type, std::string_view("IHDR"))) return fail(format, offset, "first chunk isn't IHDR");
+        first = false;
+        // The CRC covers the type and the data. This is the only format where we can catch broken data, not just structure.
+        auto crc = crc32(0xFFFFFFFF, type);
+        for(auto done = std::uint64_t(); done < length;)
+        {
+            const auto piece = std::span(buffer).first(std::min<std::uint64_t>(buffer.size(), length - done));
+            if(not file.read(offset + 8 + done, piece)) return fail(format, offset, "unreadable");
+            crc = crc32(crc, piece);
+            done += piece.size();
+        }
+        auto stored = std::array<std::uint8_t, 4>();
+        if(not file.read(offset + 8 + length, stored) or be32(stored, 0) != (crc ^ 0xFFFFFFFF)) return fail(format, offset, "chunk CRC mismatch");
+        if(std::ranges::equal(type, std::string_view("IEND"))) return pass(format);
+        offset += 12 + length;
+    }
+}
+
+////// Matroska / WebM //////
+
+constexpr auto EBML_UNKNOWN_SIZE = ~std::uint64_t();
+
+// An EBML variable size integer. `keep_marker` is for element IDs, which are compared with the marker bit in them.
+// Returns its length, 0 if it's broken.
+auto read_vint(file_source& file, const std::uint64_t offset, const bool keep_marker, std::uint64_t& value) -> std::size_t
+{
+    auto bytes = std::array<std::uint8_t, 8>();
+    if(not file.read(offset, std::span(bytes).first(1)) or bytes[0] == 0) return 0;
+    const auto length = static_cast<std::size_t>(std::countl_zero(bytes[0])) + 1;
+    if(keep_marker and length > 4) return 0;
+    if(length > 1 and not file.read(offset + 1, std::span(bytes).subspan(1, length - 1))) return 0;
+    value = keep_marker? bytes[0] : bytes[0] & (0xFF >> length);
+    auto all_ones = value == (0xFFu >> length);
+    for(auto i = 1uz; i < length; ++i)
+    {
+        value = value << 8 | bytes[i];
+        all_ones = all_ones and bytes[i] == 0xFF;
+    }
+    if(not keep_marker and all_ones) value = EBML_UNKNOWN_SIZE;
+    return length;
+}
+
+auto verify_mkv(file_source& file) -> verification
+{
+    constexpr auto format = std::string_view("Matroska");
+    constexpr auto SEGMENT = std::uint64_t(0x18538067);
+    constexpr auto CLUSTER = std::uint64_t(0x1F43B675);
+    // Top level, then the children of the segment
+    auto offset = std::uint64_t();
+    auto end = file.size();
+    auto in_segment = false;
+    while(offset < end)
+    {
+        auto id = std::uint64_t();
+        auto size = std::uint64_t();
+        const auto id_length = read_vint(file, offset, true, id);
+        const auto size_length = id_length == 0? 0 : read_vint(file, offset + id_length, false, size);
+        if(size_length == 0) return fail(format, offset, "broken EBML element header");
+        const auto data = offset + id_length + size_length;
+        if(size == EBML_UNKNOWN_SIZE)
+        {
+            // Live streams write the segment and clusters with an unknown size. There is nothing to check against.
+            if(id == SEGMENT and not in_segment)
+            {
+                in_segment = true;
+                offset = data;
+                continue;
+            }
+            if(id == CLUSTER) return pass(format);
+            return fail(format, offset, "unknown size on an element that needs one");
+        }
+        if(size > end - std::min(end, data)) return fail(format, offset, "element runs past the end of its parent");
+        if(id == SEGMENT and not in_segment)
+        {
+            in_segment = true;
+            end = data + size;
+            offset = data;
+            continue;
+        }
+        offset = data + size;
+    }
+    if(not in_segment) return fail(format, file.size(), "no segment");
+    return pass(format);
+}
+
+// Picks the check by the first bytes of the file. The name can't be trusted, it's often garbage.
+auto verify_structure(file_source& file) -> verification
+{
+    auto magic = std::array<std::uint8_t, 12>();
+    const auto known = std::min<std::uint64_t>(file.size(), magic.size());
+    if(not file.read(0, std::span(magic).first(known))) return fail("", 0, "unreadable");
+    const auto starts_with = [&](const std::initializer_list<std::uint8_t> prefix){ return known >= prefix.size() and std::ranges::equal(prefix, std::span(magic).first(prefix.size())); };
+    if(known >= 8 and std::ranges::equal(std::span(magic).subspan(4, 4), std::string_view("ftyp"))) return verify_mp4(file);
+    if(starts_with({'P', 'K', 0x03, 0x04}) or starts_with({'P', 'K', 0x05, 0x06})) return verify_zip(file);
+    if(starts_with({0xFF, 0xD8, 0xFF})) return verify_jpeg(file);
+    if(starts_with({0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A})) return verify_png(file);
+    if(starts_with({0x1A, 0x45, 0xDF, 0xA3})) return verify_mkv(file);
+    return {};
+}
+
+// A copy that passed verification and was handed to the copy_keeper
+export struct verified_copy {
+    std::string name;
+    std::uint64_t size = 0;
+    copy_quality quality;
+};
+
+// A file that was verified but couldn't be renamed afterwards. It stays as its .verify file.
+export struct unnamed_copy {
+    std::string name;
+    int pid = 0;
+    std::string reason;
+};
+
+// Checks completed files on a few threads of its own so the parser never waits for it.
+export class file_verifier
+{
+    public:
+
+    file_verifier(const storage::output_directory& directory, copy_keeper& keeper, const std::size_t threads):
+    m_directory(directory),
+    m_keeper(keeper),
+    m_threads(std::max(threads, 1uz))
+    {
+    }
+
+    file_verifier(const file_verifier&) = delete;
+    auto operator=(const file_verifier&) -> file_verifier& = delete;
+
+    // Files that are still waiting are verified first, none is left behind as a .verify
+    ~file_verifier()
+    {
+        wait();
+        for(auto& worker : m_workers) worker.request_stop();
+    }
+
+    // Takes over a completed <name>.part. It's renamed to <name>.<n>.verify right away (with an <n> that isn't taken, an
+    // earlier run may have left some behind), so more copies of the file can be received and wait for verification
+    // meanwhile, and to <name> once it passed (if the copy_keeper agrees). Files that don't pass are kept as
+    // <name>.broken. `quality` is how the copy came through, verifying it fills in `verified`. `pid` is only passed on
+    // to take_unnamed(). Throws std::system_error if the .part can't be renamed.
+    auto submit(const std::string_view name, const copy_quality quality, const int pid) -> void
+    {
+        auto job = verification_job{std::string(name), {}, quality, pid};
+        do job.pending = job.name + '.' + std::to_string(m_submitted++) + ".verify";
+        while(m_directory.exists(job.pending.c_str()));
+        m_directory.rename((job.name + ".part").c_str(), job.pending.c_str());
+        auto lock = std::scoped_lock(m_mutex);
+        // Threads are only started once there is something to verify
+        while(m_workers.size() < m_threads) m_workers.emplace_back([this](const std::stop_token stop){ work(stop); });
+        m_jobs.push_back(std::move(job));
+        m_changed.notify_all();
+    }
+
+    // Blocks until every submitted file was handled
+    auto wait() -> void
+    {
+        auto lock = std::unique_lock(m_mutex);
+        m_changed.wait(lock, [this]{ return m_jobs.empty() and m_busy == 0; });
+    }
+
+    // Whether the copies that pass are kept for take_passed(). Forgets the ones kept so far.
+    auto report_passed(const bool report) -> void
+    {
+        auto lock = std::scoped_lock(m_mutex);
+        m_report_passed = report;
+        m_passed.clear();
+    }
+
+    // The copies that passed since the last call, oldest first
+    auto take_passed() -> std::vector<verified_copy>
+    {
+        auto lock = std::scoped_lock(m_mutex);
+        return std::exchange(m_passed, {});
+    }
+
+    // The files that couldn't be renamed after their verification since the last call
+    auto take_unnamed() -> std::vector<unnamed_copy>
+    {
+        auto lock = std::scoped_lock(m_mutex);
+        return std::exchange(m_unnamed, {});
+    }
+
+    private:
+
+    struct verification_job {
+        std::string name;
+        std::string pending;
+        copy_quality quality;
+        int pid = 0;
+    };
+
+    auto work(const std::stop_token stop) -> void
+    {
+        trace_thread_name("verify");
+        auto lock = std::unique_lock(m_mutex);
+        while(m_changed.wait(lock, stop, [this]{ return not m_jobs.empty(); }))
+        {
+            const auto job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+            ++m_busy;
+            lock.unlock();
+            handle(job);
+            lock.lock();
+            --m_busy;
+            m_changed.notify_all();
+        }
+    }
+
+    auto handle(const verification_job& job) -> void
+    {
+        const auto zone = trace_zone("verify");
+        const auto& name = job.name;
+        const auto& pending = job.pending;
+        try
+        {
+            auto result = verification();
+            auto size = std::uint64_t();
+            {
+                auto file = file_source(m_directory, pending.c_str());
+                result = verify_structure(file);
+                size = file.size();
+            }
+            if(result.ok)
+            {
+                if(not result.format.empty()) std::println("Verified {} ({})", name, result.format);
+                auto quality = job.quality;
+                quality.verified = not result.format.empty();
+                try { m_keeper.complete(pending.c_str(), name.c_str(), quality); }
+                catch(const std::system_error& error)
+                {
+                    unnamed(job, std::format("Could not give {} its name: {}", name, error.what()));
+                    return;
+                }
+                auto lock = std::scoped_lock(m_mutex);
+                if(m_report_passed) m_passed.push_back({name, size, quality});
+                return;
+            }
+            std::println("Verification of {} failed at byte {}: {} ({}). Keeping it as {}.broken", name, result.offset, result.problem, result.format, name);
+            try { m_directory.rename(pending.c_str(), (name + ".broken").c_str()); }
+            catch(const std::system_error& error)
+            {
+                unnamed(job, std::format("Could not keep {} as {}.broken: {}", pending, name, error.what()));
+            }
+        }
+        catch(const std::exception& error)
+        {
+            // Another copy of the same file may have taken its place
+            std::println("Could not verify {}: {}", name, error.what());
+        }
+    }
+
+    auto unnamed(const verification_job& job, std::string reason) -> void
+    {
+        auto lock = std::scoped_lock(m_mutex);
+        m_unnamed.push_back({job.name, job.pid, std::move(reason)});
+    }
+
+    const storage::output_directory& m_directory;
+    copy_keeper& m_keeper;
+    std::size_t m_threads;
+    std::uint64_t m_submitted = 0; // Only submit() touches it, on the parser thread
+    std::mutex m_mutex;
+    std::condition_variable_any m_changed;
+    std::deque<verification_job> m_jobs;
+    std::size_t m_busy = 0;
+    bool m_report_passed = false;
+    std::vector<verified_copy> m_passed;
+    std::vector<unnamed_copy> m_unnamed;
+    std::vector<std::jthread> m_workers; // Last, they use everything above
+};
@@ -0,0 +1,293 @@
+module;
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <span>
+#include <system_error>
+#include <utility>
+#include <vector>
+#if __unix__
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+export module rostam_writer;
+import rostam_uring;
+import rostam_storage;
+import rostam_trace;
+
+// An output file that is being extracted. On unix it's a plain fd that is written through a buffer the writer keeps
+// between files. With an io_uring queue the payload is collected in big buffers that are written asynchronously
+// while the parser keeps going, with a couple of writes in flight per file. Elsewhere it's a std::ofstream.
+export class file_writer
+{
+    public:
+
+    file_writer() = default;
+
+    file_writer(file_writer&& other) noexcept:
+    m_stream(std::move(other.m_stream)),
+    m_buffer(std::move(other.m_buffer)),
+    m_used(std::exchange(other.m_used, 0)),
+    m_queue(std::exchange(other.m_queue, nullptr)),
+    m_fd(std::exchange(other.m_fd, -1)),
+    m_offset(std::exchange(other.m_offset, 0)),
+    m_current(std::move(other.m_current)),
+    m_in_flight(std::move(other.m_in_flight)),
+    m_failed(std::exchange(other.m_failed, false))
+    {
+    }
+
+    auto operator=(file_writer&& other) noexcept -> file_writer&
+    {
+        if(this == &other) return *this;
+        try { close(); } catch(...) {} // same as the destructor
+
+        m_stream = std::move(other.m_stream);
+        m_buffer = std::move(other.m_buffer);
+        m_used = std::exchange(other.m_used, 0);
+        m_queue = std::exchange(other.m_queue, nullptr);
+        m_fd = std::exchange(other.m_fd, -1);
+        m_offset = std::exchange(other.m_offset, 0);
+        m_current = std::move(other.m_current);
+        m_in_flight = std::move(other.m_in_flight);
+        m_failed = std::exchange(other.m_failed, false);
+        return *this;
+    }
+
+    ~file_writer()
+    {
+        // Errors can't be reported from here. Whoever cares calls close() first.
+        try { close(); } catch(...) {}
+    }
+
+    // Creates (or truncates) `name` in the directory
+    auto open(const storage::output_directory& directory, const char* name, uring_queue* queue = nullptr) -> bool
+    {
+        close();
+        m_failed = false;
+        m_offset = 0;
+        // Allocated once, a context slot receives file after file with the same writer
+        if(not m_buffer) m_buffer = std::make_unique<char[]>(BUFFER_SIZE);
+        #if __unix__
+        m_fd = ::openat(directory.fd(), name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(m_fd < 0) return false;
+        m_queue = queue;
+        return true;
+        #else
+        static_cast<void>(queue);
+        // Our buffer instead of the one std::filebuf allocates on every open
+        m_stream.rdbuf()->pubsetbuf(m_buffer.get(), BUFFER_SIZE);
+        m_stream.open(directory.path()/name, std::ios::binary);
+        return m_stream.is_open();
+        #endif
+    }
+
+    // Continues an existing file after its first `size` bytes, anything after them is cut off.
+    // Returns false if the file is gone or shorter than that.
+    auto reopen(const storage::output_directory& directory, const char* name, const std::uint64_t size, uring_queue* queue = nullptr) -> bool
+    {
+        close();
+        m_failed = false;
+        if(not m_buffer) m_buffer = std::make_unique<char[]>(BUFFER_SIZE);
+        #if __unix__
+        m_fd = ::openat(directory.fd(), name, O_WRONLY | O_CLOEXEC);
+        if(m_fd < 0) return false;
+        struct stat info {};
+        if(::fstat(m_fd, &info) != 0 or static_cast<std::uint64_t>(info.st_size) < size
+           or ::ftruncate(m_fd, static_cast<off_t>(size)) != 0 or ::lseek(m_fd, static_cast<off_t>(size), SEEK_SET) < 0)
+        {
+            ::close(std::exchange(m_fd, -1));
+            return false;
+        }
+        m_offset = size;
+        m_queue = queue;
+        return true;
+        #else
+        static_cast<void>(queue);
+        const auto path = directory.path()/name;
+        auto error = std::error_code();
+        if(const auto existing = std::filesystem::file_size(path, error); error or existing < size) return false;
+        std::filesystem::resize_file(path, size, error);
+        if(error) return false;
+        m_stream.rdbuf()->pubsetbuf(m_buffer.get(), BUFFER_SIZE);
+        m_stream.open(path, std::ios::binary | std::ios::in | std::ios::out);
+        m_stream.seekp(static_cast<std::streamoff>(size));
+        return m_stream.is_open();
+        #endif
+    }
+
+    auto is_open() const -> bool
+    {
+        return m_fd >= 0 or m_stream.is_open();
+    }
+
+    explicit operator bool() const
+    {
+        return is_open() and not m_failed and (m_fd >= 0 or m_stream.good());
+    }
+
+    // The file descriptor on unix, -1 otherwise
+    auto native_handle() const -> int
+    {
+        return m_fd;
+    }
+
+    // Throws std::system_error when writing to the disk fails
+    auto write(const std::span<const std::uint8_t> data) -> void
+    {
+        if(m_queue)
+        {
+            write_async(data);
+            return;
+        }
+        #if __unix__
+        // Big pieces skip the buffer, the parser mostly hands out pieces of a TS packet though
+        if(m_used == 0 and data.size() >= BUFFER_SIZE)
+        {
+            write_all(reinterpret_cast<const char*>(data.data()), data.size());
+            return;
+        }
+        auto rest = data;
+        while(not rest.empty())
+        {
+            const auto to_copy = std::min(rest.size(), BUFFER_SIZE - m_used);
+            std::ranges::copy(rest.first(to_copy), m_buffer.get() + m_used);
+            m_used += to_copy;
+            rest = rest.subspan(to_copy);
+            if(m_used == BUFFER_SIZE) write_all(m_buffer.get(), std::exchange(m_used, 0));
+        }
+        #else
+        m_stream.write(reinterpret_cast<const char*>(data.data()), data.size());
+        #endif
+    }
+
+    // Hands everything written so far to the OS (not fsync). Throws std::system_error like write().
+    auto sync() -> void
+    {
+        if(m_queue)
+        {
+            if(m_current and m_current->used > 0) flush();
+            while(not m_in_flight.empty()) retire_oldest();
+            return;
+        }
+        #if __unix__
+        if(m_fd >= 0 and m_used > 0) write_all(m_buffer.get(), std::exchange(m_used, 0));
+        #else
+        m_stream.flush();
+        #endif
+    }
+
+    // Writes what is left and closes the file. Throws std::system_error if a write failed, after closing the file anyway.
+    auto close() -> void
+    {
+        auto error = std::exception_ptr();
+        if(m_queue)
+        {
+            try { if(m_current and m_current->used > 0) flush(); } catch(...) { error = std::current_exception(); }
+            if(m_current) m_queue->give_back(std::move(m_current));
+            while(not m_in_flight.empty())
+            {
+                try { retire_oldest(); } catch(...) { if(not error) error = std::current_exception(); }
+            }
+            m_queue = nullptr;
+        }
+        #if __unix__
+        if(m_fd >= 0 and m_used > 0)
+        {
+            try { write_all(m_buffer.get(), m_used); } catch(...) { if(not error) error = std::current_exception(); }
+        }
+        m_used = 0;
+        if(m_fd >= 0) ::close(std::exchange(m_fd, -1));
+        #endif
+        if(m_stream.is_open()) m_stream.close();
+        if(error) std::rethrow_exception(error);
+    }
+
+    private:
+
+    constexpr static auto MAX_WRITES_IN_FLIGHT = 2uz;
+    constexpr static auto BUFFER_SIZE = 64uz << 10;
+
+    auto write_all([[maybe_unused]] const char* data, [[maybe_unused]] const std::size_t size) -> void
+    {
+        #if __unix__
+        const auto zone = trace_zone("write to disk");
+        auto written = 0uz;
+        while(written < size)
+        {
+            const auto result = ::write(m_fd, data + written, size - written);
+            if(result < 0 and errno == EINTR) continue;
+            if(result <= 0)
+            {
+                m_failed = true;
+                throw std::system_error(result < 0? errno : EIO, std::system_category(), "[Rostam Core Error] Writing the output file failed");
+            }
+            written += result;
+        }
+        #endif
+    }
+
+    auto write_async(const std::span<const std::uint8_t> data) -> void
+    {
+        auto rest = data;
+        while(not rest.empty())
+        {
+            if(not m_current) m_current = m_queue->take_buffer();
+            const auto to_copy = std::min(rest.size(), m_current->data.size() - m_current->used);
+            std::ranges::copy(rest.first(to_copy), m_current->data.begin() + m_current->used);
+            m_current->used += to_copy;
+            rest = rest.subspan(to_copy);
+            if(m_current->used == m_current->data.size()) flush();
+        }
+    }
+
+    auto flush() -> void
+    {
+        m_current->offset = m_offset;
+        m_offset += m_current->used;
+        m_queue->write(m_fd, std::span(m_current->data).first(m_current->used), m_current->offset, m_current->req);
+        m_queue->submit();
+        m_in_flight.push_back(std::move(m_current));
+        if(m_in_flight.size() > MAX_WRITES_IN_FLIGHT) retire_oldest();
+    }
+
+    auto retire_oldest() -> void
+    {
+        auto buffer = std::move(m_in_flight.front());
+        m_in_flight.erase(m_in_flight.begin());
+        const auto result = m_queue->wait(buffer->req);
+        const auto used = buffer->used;
+        auto written = result < 0? 0uz : static_cast<std::size_t>(result);
+        #if __unix__
+        // Short writes are legal. Finish them synchronously, they are rare enough.
+        while(result >= 0 and written < used)
+        {
+            const auto more = ::pwrite(m_fd, buffer->data.data() + written, used - written, static_cast<off_t>(buffer->offset + written));
+            if(more <= 0) break;
+            written += more;
+        }
+        #endif
+        m_queue->give_back(std::move(buffer));
+        if(result < 0 or written < used)
+        {
+            m_failed = true;
+            throw std::system_error(result < 0? -result : EIO, std::system_category(), "[Rostam Core Error] Writing the output file failed");
+        }
+    }
+
+    std::ofstream m_stream; // Only used where there is no fd
+    std::unique_ptr<char[]> m_buffer;
+    std::size_t m_used = 0;
+    uring_queue* m_queue = nullptr;
+    int m_fd = -1;
+    std::uint64_t m_offset = 0;
+    std::unique_ptr<uring_queue::write_buffer> m_current;
+    std::vector<std::unique_ptr<uring_queue::write_buffer>> m_in_flight;
+    bool m_failed = false;
+};
@@ -3,6 +3,7 @@ module;
 #include <filesystem>
 #include <memory>
 #include <future>
+#include <stop_token>
 #include <TGUI/TGUI.hpp>
 #include <TGUI/Backend/GLFW-OpenGL3.hpp>
 export module master_window;
@@ -29,8 +30,10 @@ public tgui::Gui
     tgui::Button::Ptr inputbtn;
     tgui::Button::Ptr outputbtn;
     std::shared_ptr<better_checkbox> delCheck;
+    std::shared_ptr<better_checkbox> cycleCheck;
 
     tgui::ProgressBar::Ptr progressbar;
+    tgui::Label::Ptr statuslbl;
 
     tgui::HorizontalLayout::Ptr bottom_box;
     tgui::Button::Ptr extract_btn;
@@ -42,11 +45,13 @@ public tgui::Gui
     
     rostam m_rostam;
     std::future<void> m_extraction_progress_thrd;
+    std::stop_source m_stop_extraction; // A new one for every extraction
+    tgui::Timer::Ptr m_progress_poller;
     void on_input_btn_clicked();
     void on_output_btn_clicked();
     void on_open_out_folder_clicked();
     void on_extract_button_clicked();
-    void on_extraction_progress(const int progress);
+    void on_extraction_progress();
     void on_options_button_clicked ();
     void on_about_clicked ();
     void on_satelite_info_clicked ();
@@ -1,6 +1,7 @@
 module;
 #include <chrono>
 #include <future>
+#include <stop_token>
 #include <stdexcept>
 #include <filesystem>
 #include <GLFW/glfw3.h>
@@ -8,7 +9,9 @@ module;
 #include <TGUI/TGUI.hpp>
 #include <TGUI/Backend/GLFW-OpenGL3.hpp>
 #include <array>
+#include <format>
 #include <ranges>
+#include <string>
 
 module master_window:impl;
 import master_window;
@@ -31,11 +34,12 @@ outputlbl(tgui::Label::create("Output Folder")),
 inputbtn(tgui::Button::create("Browse")),
 outputbtn(tgui::Button::create("Browse")),
 delCheck(std::make_shared<better_checkbox>("Delete ts files after extracting")),
+cycleCheck(std::make_shared<better_checkbox>("Stop once every file was received")),
 progressbar(tgui::ProgressBar::create()),
+statuslbl(tgui::Label::create()),
 bottom_box(tgui::HorizontalLayout::create({"100%",20})),
 extract_btn(tgui::Button::create("Extract")),
-openoutfolder(tgui::Button::create("Open output folder")),
-m_rostam(std::bind_front(&MainWindow::on_extraction_progress,this))
+openoutfolder(tgui::Button::create("Open output folder"))
 {
     //building ui
     
@@ -52,8 +56,10 @@ m_rostam(std::bind_front(&MainWindow::on_extraction_progress,this))
     main_controls->setAutoLayout(tgui::AutoLayout::Bottom);
     main_controls->getRenderer()->setSpaceBetweenWidgets(10);
     main_controls->add(inoutstuffgrid);
-    // main_controls->add(delCheck);
+    main_controls->add(delCheck);
+    main_controls->add(cycleCheck);
     main_controls->add(progressbar);
+    main_controls->add(statuslbl);
     main_controls->add(bottom_box);
 
     const auto notice_lbl = tgui::Label::create("*Notice: This app is NOT affiliated with or endorsed by Rostam Media.");
@@ -77,6 +83,8 @@ m_rostam(std::bind_front(&MainWindow::on_extraction_progress,this))
     inputbtn->onClick(&MainWindow::on_input_btn_clicked,this);
     outputbtn->onClick(&MainWindow::on_output_btn_clicked,this);
     progressbar->setHeight(10);
+    statuslbl->setTextSize(11);
+    statuslbl->getRenderer()->setTextColor("#838383");
     extract_btn->onClick(&MainWindow::on_extract_button_clicked,this);
     extract_btn->setEnabled(false);
     openoutfolder->onClick(&MainWindow::on_open_out_folder_clicked,this);
@@ -115,14 +123,25 @@ void MainWindow::on_extract_button_clicked()
     if(extract_btn->getText() == "Cancel")
     {
         extract_btn->setEnabled(false);
-        m_rostam.request_cancel();
+        m_stop_extraction.request_stop();
         return ;
     }
-    [[maybe_unused]]const auto delete_ts = delCheck->is_checked();
+    // The recording gives its disk space back while it's extracted and is gone afterwards
+    m_rostam.set_release_input(delCheck->is_checked());
+    // The rest of a long recording only repeats the carousel
+    m_rostam.set_stop_after_cycle(cycleCheck->is_checked());
+    // Recordings from other broadcasters have their files on other PIDs
+    m_rostam.set_discover_pids(true);
     extract_btn->setText("Cancel");
     if(m_extraction_progress_thrd.valid() and m_extraction_progress_thrd.wait_for(0ms) != std::future_status::ready)
         throw std::logic_error("Another thread is already running and the app requests for another one. This is not intended. Terminating...");
-    m_extraction_progress_thrd = std::async(std::launch::async,&rostam::extract,&m_rostam,m_inputaddr,m_outputaddr);
+    m_stop_extraction = std::stop_source();
+    m_extraction_progress_thrd = std::async(std::launch::async,[this, input = m_inputaddr, output = m_outputaddr, stop = m_stop_extraction.get_token()]{
+        m_rostam.extract(input, output, stop);
+    });
+    // The worker never touches the widgets. We poll its progress snapshot once per frame from the gui thread instead.
+    if(not m_progress_poller) m_progress_poller = tgui::Timer::create(std::bind_front(&MainWindow::on_extraction_progress,this),16ms);
+    m_progress_poller->setEnabled(true);
 }
 
 void MainWindow::on_open_out_folder_clicked()
@@ -132,14 +151,26 @@ void MainWindow::on_open_out_folder_clicked()
 }
 
 
-void MainWindow::on_extraction_progress(const int progress)
+void MainWindow::on_extraction_progress()
 {
-    progressbar->setValue(progress);
-    if(progress == 100)
+    const auto progress = m_rostam.progress().read();
+    progressbar->setValue(progress.percent());
+    const auto eta = progress.eta? std::format(" - ETA {:%T}", *progress.eta) : std::string();
+    statuslbl->setText(std::format("{} files - {:.1f} MB/s{}  {}", progress.files_done, progress.mb_per_sec, eta, progress.current_file));
+    if(m_rostam.progress().consume_finished())
     {
+        m_progress_poller->setEnabled(false);
+        progressbar->setValue(100);
         extract_btn->setText("Extract");
         extract_btn->setEnabled(true);
-        const auto result_dialog = std::make_shared<ModalMessageBox>("Result",m_rostam.is_cancelled()?"Cancelled the extraction.":"Extaction is completed.");
+        const auto& error = m_rostam.progress().error();
+        const auto result = not error.empty()? std::format("The extraction failed: {}", error)
+            : m_rostam.is_cancelled()? std::string("Cancelled the extraction.")
+            : progress.bytes_skipped > 0? std::format("Every file was received. Skipped the last {:.1f} MB of the recording.", progress.bytes_skipped / (1024.0 * 1024.0))
+            : std::string("Extaction is completed.");
+        // The worker is done, what it skipped can be read now
+        const auto skipped = m_rostam.skipped_header_count();
+        const auto result_dialog = std::make_shared<ModalMessageBox>("Result",skipped > 0? std::format("{}\n{} damaged headers or unwritable files were skipped.", result, skipped) : result);
         add(result_dialog);
     }
 }
@@ -206,7 +237,7 @@ void MainWindow::on_satelite_info_clicked ()
 
 MainWindow::~MainWindow()
 {
-    m_rostam.request_cancel();
+    m_stop_extraction.request_stop();
     // Rethrow all exceptions thrown from the other thread.
     if(m_extraction_progress_thrd.valid() and m_extraction_progress_thrd.wait_for(std::chrono::microseconds(0)) == std::future_status::ready)m_extraction_progress_thrd.get();
 }
\ No newline at end of file
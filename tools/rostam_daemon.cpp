@@ -0,0 +1,364 @@
+// Watches directories for new recordings and extracts them, so nobody has to click Extract when the capture drops a
+// new .ts. A recording is picked up as soon as it's created and extracted while it's still being written, it's done
+// once the capture closes it (or it didn't grow for --idle seconds). At most --jobs recordings are extracted at once.
+// A recording whose extraction failed, or that was still open when it stopped growing, is taken again when it's
+// closed or written again, from where it stopped.
+// usage: rostam-daemon [--jobs N] [--idle SECONDS] [--verify] [--stop-after-cycle] [--trace FILE] <output directory> <watched directory>...
+// Every recording goes to <output directory>/<recording name without .ts>/ and gets a report.json there when it's
+// done. Recordings that have a report are skipped, delete it to extract one again. SIGINT and SIGTERM stop the
+// extractions, they continue from their checkpoints when the daemon is started again. With --trace the zones the
+// extractions recorded are written to FILE as a Chrome trace when the daemon stops (needs a core built with ROSTAM_TRACE).
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <poll.h>
+#include <print>
+#include <set>
+#include <span>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+import rostam;
+
+struct daemon_options {
+    std::filesystem::path output;
+    std::vector<std::filesystem::path> watched;
+    std::size_t jobs = 2;
+    std::chrono::seconds idle = std::chrono::seconds(120);
+    bool verify = false;
+    bool stop_after_cycle = false;
+    std::filesystem::path trace;
+};
+
+struct recording_job {
+    std::filesystem::path recording;
+    std::shared_ptr<std::atomic_bool> writing; // Cleared when the capture closes the file
+};
+
+auto report_path(const daemon_options& options, const std::filesystem::path& recording) -> std::filesystem::path
+{
+    return options.output / recording.stem() / "report.json";
+}
+
+auto json_string(const std::string_view text) -> std::string
+{
+    auto escaped = std::string("\"");
+    for(const auto c : text)
+    {
+        if(c == '"' or c == '\\') escaped += std::format("\\{}", c);
+        else if(static_cast<unsigned char>(c) < 0x20) escaped += std::format("\\u{:04x}", static_cast<int>(c));
+        else escaped += c;
+    }
+    return escaped + '"';
+}
+
+auto utc_now() -> std::string
+{
+    return std::format("{:%FT%TZ}", std::chrono::floor<std::chrono::seconds>(std::chrono::system_clock::now()));
+}
+
+// What happened to a recording and what came out of it. Written next to the files, replaced atomically.
+auto write_report(const std::filesystem::path& path, const std::filesystem::path& recording, const std::string_view started,
+    const double seconds, const std::string_view status, const std::string_view error, const extraction_progress::snapshot& progress,
+    const std::span<const rostam::skipped_header> skipped_headers, const std::uint64_t skipped_header_count) -> void
+{
+    auto files = std::string();
+    for(const auto& entry : std::filesystem::directory_iterator(path.parent_path()))
+    {
+        const auto name = entry.path().filename().string();
+        if(not entry.is_regular_file() or name.starts_with('.') or name == path.filename()) continue;
+        const auto extension = entry.path().extension();
+        const auto state = extension == ".part"? "partial" : extension == ".broken"? "broken" : "complete";
+        if(not files.empty()) files += ",\n";
+        files += std::format("    {{\"name\": {}, \"size\": {}, \"state\": \"{}\"}}", json_string(name), entry.file_size(), state);
+    }
+    // Headers that didn't lead to a file, with their bytes for a closer look
+    auto headers = std::string();
+    for(const auto& skipped : skipped_headers)
+    {
+        auto raw = std::string();
+        for(const auto byte : skipped.raw) raw += std::format("{:02x}", byte);
+        if(not headers.empty()) headers += ",\n";
+        headers += std::format("    {{\"offset\": {}, \"pid\": {}, \"reason\": {}, \"raw\": \"{}\"}}", skipped.offset, skipped.pid, json_string(skipped.reason), raw);
+    }
+    auto temporary = path;
+    temporary += ".tmp";
+    {
+        auto report = std::ofstream(temporary, std::ios::trunc);
+        report << std::format("{{\n  \"recording\": {},\n  \"started\": \"{}\",\n  \"finished\": \"{}\",\n  \"seconds\": {:.1f},\n"
+            "  \"status\": \"{}\",\n  \"error\": {},\n  \"bytes\": {},\n  \"bytes_skipped\": {},\n  \"files_completed\": {},\n  \"files\": [\n{}\n  ],\n"
+            "  \"skipped_header_count\": {},\n  \"skipped_headers\": [\n{}\n  ]\n}}\n",
+            json_string(recording.string()), started, utc_now(), seconds, status, json_string(error), progress.bytes_processed, progress.bytes_skipped, progress.files_done, files,
+            skipped_header_count, headers);
+    }
+    std::filesystem::rename(temporary, path);
+}
+
+// Hands recordings to a fixed number of workers, each with a rostam of its own
+class recording_pool
+{
+    public:
+
+    explicit recording_pool(const daemon_options& options):
+    m_options(options)
+    {
+        for(auto i = 0uz; i < std::max(options.jobs, 1uz); ++i) m_workers.emplace_back([this](const std::stop_token stop){ work(stop); });
+    }
+
+    ~recording_pool()
+    {
+        for(auto& worker : m_workers) worker.request_stop();
+    }
+
+    // Every recording is only taken once, unless its last extraction failed or didn't get all of it
+    auto submit(const std::filesystem::path& recording, const bool writing) -> void
+    {
+        auto lock = std::scoped_lock(m_mutex);
+        if(not m_seen.insert(recording).second) return;
+        auto job = recording_job{recording, std::make_shared<std::atomic_bool>(writing)};
+        m_writing.emplace(recording.string(), job.writing);
+        m_jobs.push_back(std::move(job));
+        m_changed.notify_one();
+    }
+
+    auto closed(const std::filesystem::path& recording) -> void
+    {
+        auto lock = std::scoped_lock(m_mutex);
+        if(const auto found = m_writing.find(recording.string()); found != m_writing.end()) found->second->store(false);
+    }
+
+    private:
+
+    auto work(const std::stop_token stop) -> void
+    {
+        trace_thread_name("recording worker");
+        while(true)
+        {
+            auto job = recording_job();
+            {
+                auto lock = std::unique_lock(m_mutex);
+                if(not m_changed.wait(lock, stop, [this]{ return not m_jobs.empty(); })) return;
+                job = std::move(m_jobs.front());
+                m_jobs.pop_front();
+            }
+            const auto status = extract(job, stop);
+            auto lock = std::scoped_lock(m_mutex);
+            m_writing.erase(job.recording.string());
+            // The next IN_CLOSE_WRITE or rewrite of it submits it again. If the capture closed it while the
+            // extraction was finishing, that event already came, so it goes straight back into the queue.
+            if(status == "incomplete" and not job.writing->load())
+            {
+                m_jobs.push_back(recording_job{job.recording, job.writing});
+                m_changed.notify_one();
+            }
+            else if(status == "failed" or status == "incomplete") m_seen.erase(job.recording);
+        }
+    }
+
+    // Returns completed, failed, cancelled or incomplete (the capture still had it open when it stopped growing).
+    // The last two get no report.
+    auto extract(const recording_job& job, const std::stop_token stop) -> std::string_view
+    {
+        const auto output = m_options.output / job.recording.stem();
+        const auto started = utc_now();
+        const auto start = std::chrono::steady_clock::now();
+        auto options = extraction_options();
+        options.discover_pids = true;
+        options.verify = m_options.verify;
+        options.stop_after_cycle = m_options.stop_after_cycle;
+        options.reader.growing = [writing = job.writing, stop]{ return writing->load() and not stop.stop_requested(); };
+        options.reader.growing_timeout = m_options.idle;
+        auto core = rostam(options);
+        auto status = std::string_view("completed");
+        auto error = std::string();
+        try
+        {
+            std::filesystem::create_directories(output);
+            std::println("Extracting {} to {}", job.recording.string(), output.string());
+            core.extract(job.recording, output, stop);
+            const auto progress = core.progress().read();
+            auto size_error = std::error_code();
+            const auto size = std::filesystem::file_size(job.recording, size_error);
+            if(progress.cancelled) status = "cancelled";
+            // Either it was still open when it stopped growing for --idle, or something was appended after that
+            else if(job.writing->load() or (not size_error and size > progress.bytes_processed + progress.bytes_skipped))
+            {
+                status = "incomplete";
+                std::println("{} is still being written, it continues from its checkpoint once it's closed", job.recording.string());
+            }
+        }
+        catch(const std::exception& exception)
+        {
+            status = "failed";
+            error = exception.what();
+            std::println("Extracting {} failed: {}", job.recording.string(), error);
+        }
+        // A stopped or cut extraction continues from its checkpoint next time, it has no report yet
+        if(status == "cancelled" or status == "incomplete") return status;
+        try
+        {
+            const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            write_report(report_path(m_options, job.recording), job.recording, started, seconds, status, error, core.progress().read(), core.skipped_headers(), core.skipped_header_count());
+        }
+        catch(const std::exception& exception)
+        {
+            std::println("Could not write the report of {}: {}", job.recording.string(), exception.what());
+        }
+        return status;
+    }
+
+    const daemon_options& m_options;
+    std::mutex m_mutex;
+    std::condition_variable_any m_changed;
+    std::deque<recording_job> m_jobs;
+    std::set<std::filesystem::path> m_seen;
+    std::unordered_map<std::string, std::shared_ptr<std::atomic_bool>> m_writing;
+    std::vector<std::jthread> m_workers; // Last, they use everything above
+};
+
+auto is_recording(const std::filesystem::path& path) -> bool
+{
+    return path.extension() == ".ts";
+}
+
+auto parse_arguments(const int argc, char* argv[]) -> std::optional<daemon_options>
+{
+    auto options = daemon_options();
+    auto positional = std::vector<std::filesystem::path>();
+    const auto number = [](const std::string_view text, auto& into){ return std::from_chars(text.data(), text.data() + text.size(), into).ec == std::errc(); };
+    for(auto i = 1; i < argc; ++i)
+    {
+        const auto argument = std::string_view(argv[i]);
+        auto seconds = 0ll;
+        if(argument == "--verify") options.verify = true;
+        else if(argument == "--stop-after-cycle") options.stop_after_cycle = true;
+        else if(argument == "--jobs" and i + 1 < argc and number(argv[i + 1], options.jobs)) ++i;
+        else if(argument == "--trace" and i + 1 < argc) options.trace = argv[++i];
+        else if(argument == "--idle" and i + 1 < argc and number(argv[i + 1], seconds))
+        {
+            options.idle = std::chrono::seconds(seconds);
+            ++i;
+        }
+        else if(argument.starts_with("--")) return std::nullopt;
+        else positional.emplace_back(argument);
+    }
+    if(positional.size() < 2) return std::nullopt;
+    options.output = positional.front();
+    options.watched.assign(positional.begin() + 1, positional.end());
+    return options;
+}
+
+int main(int argc, char* argv[])
+{
+    const auto parsed = parse_arguments(argc, argv);
+    if(not parsed)
+    {
+        std::println("usage: {} [--jobs N] [--idle SECONDS] [--verify] [--stop-after-cycle] [--trace FILE] <output directory> <watched directory>...", argv[0]);
+        return 2;
+    }
+    const auto& options = *parsed;
+
+    // The signals are read from a signalfd next to inotify, no handler runs in the middle of anything
+    auto signals = sigset_t();
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    const auto signal_fd = ::signalfd(-1, &signals, SFD_CLOEXEC);
+    const auto inotify_fd = ::inotify_init1(IN_CLOEXEC);
+    if(signal_fd < 0 or inotify_fd < 0)
+    {
+        std::println("Could not set up inotify: {}", std::strerror(errno));
+        return 1;
+    }
+    auto watches = std::unordered_map<int, std::filesystem::path>();
+    for(const auto& directory : options.watched)
+    {
+        const auto watch = ::inotify_add_watch(inotify_fd, directory.c_str(), IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO);
+        if(watch < 0)
+        {
+            std::println("Could not watch {}: {}", directory.string(), std::strerror(errno));
+            return 1;
+        }
+        watches.emplace(watch, directory);
+    }
+    if(not options.trace.empty() and not TRACE_ENABLED) std::println("The core was built without ROSTAM_TRACE, the trace will be empty.");
+
+    // Optional so it can be stopped before the trace is written
+    auto pool = std::optional<recording_pool>(std::in_place, options);
+    // Recordings that showed up while the daemon wasn't running. One that changed recently may still be written.
+    for(const auto& directory : options.watched)
+        for(const auto& entry : std::filesystem::directory_iterator(directory))
+        {
+            if(not entry.is_regular_file() or not is_recording(entry.path()) or std::filesystem::exists(report_path(options, entry.path()))) continue;
+            const auto age = std::filesystem::file_time_type::clock::now() - entry.last_write_time();
+            pool->submit(entry.path(), age < options.idle);
+        }
+    std::println("Watching {} directories, extracting to {}", options.watched.size(), options.output.string());
+
+    alignas(inotify_event) char buffer[64 << 10];
+    auto descriptors = std::array<pollfd, 2>{pollfd{signal_fd, POLLIN, 0}, pollfd{inotify_fd, POLLIN, 0}};
+    while(true)
+    {
+        if(::poll(descriptors.data(), descriptors.size(), -1) < 0)
+        {
+            if(errno == EINTR) continue;
+            break;
+        }
+        if(descriptors[0].revents & POLLIN) break;
+        const auto length = ::read(inotify_fd, buffer, sizeof(buffer));
+        if(length <= 0) continue;
+        for(auto offset = 0z; offset < length;)
+        {
+            const auto* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+            offset += sizeof(inotify_event) + event->len;
+            if(event->len == 0 or (event->mask & IN_ISDIR)) continue;
+            const auto path = watches[event->wd] / event->name;
+            if(not is_recording(path)) continue;
+            // Extraction starts right away and follows the file until it's closed
+            if(event->mask & IN_CREATE) pool->submit(path, true);
+            else if(event->mask & IN_CLOSE_WRITE)
+            {
+                pool->closed(path);
+                pool->submit(path, false); // Created before we were watching
+            }
+            else if(event->mask & IN_MOVED_TO) pool->submit(path, false);
+        }
+    }
+    std::println("Stopping, unfinished recordings continue from their checkpoints next time.");
+    ::close(inotify_fd);
+    ::close(signal_fd);
+    pool.reset();
+    if(options.trace.empty()) return 0;
+    try
+    {
+        write_chrome_trace(options.trace);
+        std::println("Wrote the trace to {}", options.trace.string());
+    }
+    catch(const std::exception& error)
+    {
+        std::println("{}", error.what());
+        return 1;
+    }
+}
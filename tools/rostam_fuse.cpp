@@ -0,0 +1,123 @@
+// Shows the files in a recording as a read-only directory without extracting them, for browsing and spot checks.
+// The recording is indexed once when it's mounted, reads are served from the recording itself.
+// usage: rostam-fuse <recording.ts> <mountpoint> [FUSE options, e.g. -f to stay in the foreground]
+// Unmount with fusermount3 -u <mountpoint>.
+#define FUSE_USE_VERSION 31
+#include <fuse.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <filesystem>
+#include <memory>
+#include <print>
+#include <span>
+#include <string_view>
+#include <sys/stat.h>
+#include <unordered_map>
+#include <vector>
+import rostam;
+
+struct mounted_recording {
+    recording_index index;
+    std::unique_ptr<recording_reader> reader;
+    std::unordered_map<std::string_view, const recording_index::file*> files; // Names point into `index`
+    struct timespec modified {}; // Every file gets the time of the recording
+};
+
+auto mounted() -> mounted_recording&
+{
+    return *static_cast<mounted_recording*>(fuse_get_context()->private_data);
+}
+
+// The directory is flat, "/name" is all there is
+auto find_file(const char* path) -> const recording_index::file*
+{
+    const auto name = std::string_view(path).substr(1);
+    const auto found = mounted().files.find(name);
+    return found == mounted().files.end()? nullptr : found->second;
+}
+
+auto get_attributes(const char* path, struct stat* attributes, fuse_file_info*) -> int
+{
+    *attributes = {};
+    attributes->st_mtim = mounted().modified;
+    attributes->st_ctim = mounted().modified;
+    attributes->st_atim = mounted().modified;
+    if(std::string_view(path) == "/")
+    {
+        attributes->st_mode = S_IFDIR | 0555;
+        attributes->st_nlink = 2;
+        return 0;
+    }
+    const auto* file = find_file(path);
+    if(not file) return -ENOENT;
+    attributes->st_mode = S_IFREG | 0444;
+    attributes->st_nlink = 1;
+    attributes->st_size = static_cast<off_t>(file->size);
+    return 0;
+}
+
+auto read_directory(const char* path, void* buffer, fuse_fill_dir_t fill, off_t, fuse_file_info*, fuse_readdir_flags) -> int
+{
+    if(std::string_view(path) != "/") return -ENOENT;
+    fill(buffer, ".", nullptr, 0, fuse_fill_dir_flags());
+    fill(buffer, "..", nullptr, 0, fuse_fill_dir_flags());
+    for(const auto& file : mounted().index.files()) fill(buffer, file.name.c_str(), nullptr, 0, fuse_fill_dir_flags());
+    return 0;
+}
+
+auto open_file(const char* path, fuse_file_info* info) -> int
+{
+    const auto* file = find_file(path);
+    if(not file) return -ENOENT;
+    if((info->flags & O_ACCMODE) != O_RDONLY) return -EROFS;
+    info->fh = reinterpret_cast<std::uint64_t>(file);
+    // The data never changes while it's mounted
+    info->keep_cache = 1;
+    return 0;
+}
+
+auto read_file(const char*, char* buffer, const std::size_t size, const off_t offset, fuse_file_info* info) -> int
+{
+    if(offset < 0) return -EINVAL;
+    const auto& file = *reinterpret_cast<const recording_index::file*>(info->fh);
+    return static_cast<int>(mounted().reader->read(file, static_cast<std::uint64_t>(offset), std::span(reinterpret_cast<std::uint8_t*>(buffer), size)));
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc < 3)
+    {
+        std::println("usage: {} <recording.ts> <mountpoint> [FUSE options]", argv[0]);
+        return 2;
+    }
+    auto recording = mounted_recording();
+    try
+    {
+        const auto input = std::filesystem::path(argv[1]);
+        std::println("Indexing {}...", input.string());
+        auto options = extraction_options();
+        options.discover_pids = true;
+        auto core = rostam(options);
+        recording.index = core.index(input);
+        recording.reader = std::make_unique<recording_reader>(input);
+        struct stat info {};
+        if(::stat(input.c_str(), &info) == 0) recording.modified = info.st_mtim;
+    }
+    catch(const std::exception& error)
+    {
+        std::println("{}", error.what());
+        return 1;
+    }
+    for(const auto& file : recording.index.files()) recording.files.emplace(file.name, &file);
+    std::println("{} files in the recording.", recording.files.size());
+
+    auto operations = fuse_operations();
+    operations.getattr = get_attributes;
+    operations.readdir = read_directory;
+    operations.open = open_file;
+    operations.read = read_file;
+    // FUSE gets everything but the recording
+    auto arguments = std::vector<char*>{argv[0]};
+    arguments.insert(arguments.end(), argv + 2, argv + argc);
+    return fuse_main(static_cast<int>(arguments.size()), arguments.data(), &operations, &recording);
+}
@@ -0,0 +1,97 @@
+// Tries live extraction through a shared memory ring on one machine, without a capture card. One side stands in for
+// the capture process and feeds a recording (or stdin) into the ring, the other extracts from the ring.
+// usage: rostam-ring produce <recording.ts | -> <ring name, e.g. /rostam-capture> [--size MiB] [--rate MB/s]
+//        rostam-ring extract <ring, e.g. /dev/shm/rostam-capture> <output directory>
+// The producer waits at the end until the extraction read everything. --rate paces it like a live capture, without
+// it the ring is filled as fast as the extraction takes the packets.
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <istream>
+#include <iostream>
+#include <memory>
+#include <print>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+import rostam;
+
+auto produce(std::istream& input, const std::string& name, const std::size_t size, const double rate) -> int
+{
+    auto ring = ring_producer(name, size);
+    std::println("Ring ready at {}, start the extraction there.", ring.path().string());
+    auto buffer = std::vector<std::uint8_t>(TS_PACKET_SIZE * 1024);
+    const auto start = std::chrono::steady_clock::now();
+    auto sent = 0ull;
+    while(input)
+    {
+        input.read(reinterpret_cast<char*>(buffer.data()), static_cast<std::streamsize>(buffer.size()));
+        const auto read = static_cast<std::size_t>(input.gcount());
+        if(read == 0) break;
+        ring.write(std::span(buffer).first(read));
+        sent += read;
+        // Not faster than a capture at `rate` would be
+        if(rate > 0) std::this_thread::sleep_until(start + std::chrono::duration<double>(sent / (rate * 1e6)));
+    }
+    ring.close();
+    std::println("Sent {} bytes, waiting for the extraction to read them.", sent);
+    while(not ring.drained()) std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    return 0;
+}
+
+auto extract(const std::filesystem::path& ring, const std::filesystem::path& output) -> int
+{
+    auto options = extraction_options();
+    options.shared_memory = true;
+    options.discover_pids = true;
+    auto core = rostam(options);
+    core.extract(ring, output);
+    const auto progress = core.progress().read();
+    std::println("Extracted {} files from {} bytes.", progress.files_done, progress.bytes_processed);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    const auto usage = [&]{
+        std::println("usage: {} produce <recording.ts | -> <ring name> [--size MiB] [--rate MB/s]", argv[0]);
+        std::println("       {} extract <ring> <output directory>", argv[0]);
+        return 2;
+    };
+    if(argc < 4) return usage();
+    const auto mode = std::string_view(argv[1]);
+    try
+    {
+        if(mode == "extract") return extract(argv[2], argv[3]);
+        if(mode != "produce") return usage();
+        auto size = 64uz; // MiB
+        auto rate = 0.0;
+        for(auto i = 4; i + 1 < argc; i += 2)
+        {
+            const auto option = std::string_view(argv[i]);
+            const auto value = std::string_view(argv[i + 1]);
+            const auto parsed = option == "--size"? std::from_chars(value.data(), value.data() + value.size(), size).ec == std::errc()
+                : option == "--rate"? std::from_chars(value.data(), value.data() + value.size(), rate).ec == std::errc() : false;
+            if(not parsed) return usage();
+        }
+        if(std::string_view(argv[2]) == "-") return produce(std::cin, argv[3], size << 20, rate);
+        auto input = std::ifstream(argv[2], std::ios::binary);
+        if(not input)
+        {
+            std::println("Could not open {}", argv[2]);
+            return 1;
+        }
+        return produce(input, argv[3], size << 20, rate);
+    }
+    catch(const std::exception& error)
+    {
+        std::println("{}", error.what());
+        return 1;
+    }
+}